@@ -24,8 +24,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/statvfs.h>
+#include <sys/vfs.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 
 #include "fsarchiver.h"
 #include "dico.h"
@@ -33,6 +39,8 @@
 #include "options.h"
 #include "archreader.h"
 #include "queue.h"
+#include "blkbuf.h"
+#include "uring.h"
 #include "comp_gzip.h"
 #include "comp_bzip2.h"
 #include "error.h"
@@ -50,25 +58,228 @@ int archreader_init(carchreader *ai)
     ai->curvol=0;
     ai->filefmtver=0;
     ai->hasdirsinfohead=false;
+    ai->nextfd=-1;
     return 0;
 }
 
+#ifdef OPTION_URING_SUPPORT
+// start reading the segment at the next position of the volume
+static int archreader_submit_segment(carchreader *ai, int index)
+{
+    struct s_readseg *s=&ai->seg[index];
+    
+    s->offset=ai->nextpos;
+    s->size=0;
+    s->pos=0;
+    if ((uring_prep_read_fixed(ai->uring, ai->archfd, s->buffer, FSA_READER_SEGSIZE, s->offset, index, index)!=0) || (uring_submit(ai->uring)!=0))
+    {   errprintf("cannot submit a read request at offset=%lld\n", (long long)s->offset);
+        return -1;
+    }
+    s->inflight=true;
+    ai->nextpos+=FSA_READER_SEGSIZE;
+    return 0;
+}
+
+// wait until one of the segments read by io_uring is complete
+static int archreader_wait_segment(carchreader *ai)
+{
+    struct s_readseg *s;
+    u64 index;
+    s32 res;
+    
+    if (uring_wait(ai->uring, &index, &res)!=0)
+        return -1;
+    
+    s=&ai->seg[index];
+    s->inflight=false;
+    if (res<0)
+    {   errno=-res;
+        sysprintf("cannot read volume at offset=%lld\n", (long long)s->offset);
+        return -1;
+    }
+    s->size=res;
+    return 0;
+}
+
+// wait until there is no more read request in progress
+static int archreader_drain_segments(carchreader *ai)
+{
+    int res=0;
+    
+    while (uring_get_inflight(ai->uring)>0)
+    {   if (archreader_wait_segment(ai)!=0)
+            res=-1;
+    }
+    return res;
+}
+
+// drop the data read in advance and start reading the volume at pos
+static int archreader_start_segments(carchreader *ai, u64 pos)
+{
+    int i;
+    
+    if (archreader_drain_segments(ai)!=0)
+        return -1;
+    ai->nextpos=pos;
+    ai->curseg=0;
+    for (i=0; i < FSA_READER_SEGCOUNT; i++)
+    {   if (archreader_submit_segment(ai, i)!=0)
+            return -1;
+    }
+    return 0;
+}
+
+// copy the next bytes of the volume from the segments (they are just skipped when data is NULL)
+static int archreader_consume_segments(carchreader *ai, u8 *data, u64 size)
+{
+    struct s_readseg *s;
+    u32 len;
+    
+    while (size>0)
+    {
+        s=&ai->seg[ai->curseg];
+        while (s->inflight==true)
+        {   if (archreader_wait_segment(ai)!=0)
+                return -1;
+        }
+        
+        if (s->pos==s->size) // all the data of that segment have been consumed
+        {
+            if (s->size==0)
+            {   errprintf("read failed: end of volume reached at offset=%lld\n", (long long)ai->curpos);
+                return -1;
+            }
+            else if (s->size < FSA_READER_SEGSIZE) // short read: the next segments do not follow that one
+            {   if (archreader_start_segments(ai, s->offset+s->size)!=0)
+                    return -1;
+            }
+            else // reuse that segment to read further in the volume
+            {   if (archreader_submit_segment(ai, ai->curseg)!=0)
+                    return -1;
+                ai->curseg=(ai->curseg+1) % FSA_READER_SEGCOUNT;
+            }
+            continue;
+        }
+        
+        len=min(size, (u64)(s->size-s->pos));
+        if (data!=NULL)
+        {   memcpy(data, s->buffer+s->pos, len);
+            data+=len;
+        }
+        s->pos+=len;
+        ai->curpos+=len;
+        size-=len;
+    }
+    
+    return 0;
+}
+
+// allocate the segments and register them in io_uring (called when the first volume is opened)
+static int archreader_start_uring(carchreader *ai)
+{
+    struct iovec iov[FSA_READER_SEGCOUNT];
+    int i;
+    
+    if ((ai->uring=uring_create(2*FSA_READER_SEGCOUNT))==NULL)
+    {   msgprintf(MSG_VERB1, "io_uring is not available: the archive is read with read()\n");
+        return -1;
+    }
+    for (i=0; i < FSA_READER_SEGCOUNT; i++)
+    {
+        if ((ai->seg[i].buffer==NULL) && (posix_memalign((void**)&ai->seg[i].buffer, 4096, FSA_READER_SEGSIZE)!=0))
+        {   errprintf("posix_memalign(%ld) failed: out of memory\n", (long)FSA_READER_SEGSIZE);
+            ai->seg[i].buffer=NULL;
+            return -1;
+        }
+        iov[i].iov_base=ai->seg[i].buffer;
+        iov[i].iov_len=FSA_READER_SEGSIZE;
+    }
+    if (uring_register_buffers(ai->uring, iov, FSA_READER_SEGCOUNT)!=0)
+    {   msgprintf(MSG_VERB1, "cannot register buffers in io_uring: the archive is read with read()\n");
+        return -1;
+    }
+    msgprintf(MSG_VERB2, "the archive is read with io_uring\n");
+    return 0;
+}
+
+// stop using io_uring and release the segments
+static void archreader_stop_uring(carchreader *ai)
+{
+    int i;
+    
+    if (ai->uring!=NULL)
+    {   archreader_drain_segments(ai);
+        uring_destroy(ai->uring);
+        ai->uring=NULL;
+    }
+    for (i=0; i < FSA_READER_SEGCOUNT; i++)
+    {   free(ai->seg[i].buffer);
+        ai->seg[i].buffer=NULL;
+    }
+}
+#endif // OPTION_URING_SUPPORT
+
 int archreader_destroy(carchreader *ai)
 {
     assert(ai);
+#ifdef OPTION_URING_SUPPORT
+    archreader_stop_uring(ai);
+#endif // OPTION_URING_SUPPORT
+    free(ai->rabuf);
+    ai->rabuf=NULL;
+    if (ai->nextfd>=0)
+    {   close(ai->nextfd);
+        ai->nextfd=-1;
+    }
     return 0;
 }
 
+// a page of a mapping which cannot be read raises SIGBUS: the volumes are only mapped when
+// they are regular files on a local filesystem, where this only happens on media errors
+static bool archreader_is_local_file(carchreader *ai)
+{
+    struct statfs sfs;
+    struct stat64 st;
+    
+    if ((fstat64(ai->archfd, &st)!=0) || (!S_ISREG(st.st_mode)) || (fstatfs(ai->archfd, &sfs)!=0))
+        return false;
+    switch ((u32)sfs.f_type)
+    {
+        case 0x6969: // nfs
+        case 0x517B: // smb
+        case 0xFF534D42: // cifs
+        case 0xFE534D42: // smb2
+        case 0x65735546: // fuse
+        case 0x01021997: // 9p
+        case 0x00C36400: // ceph
+        case 0x5346414F: // afs
+            return false;
+        default:
+            return true;
+    }
+}
+
 int archreader_open(carchreader *ai)
 {   
     struct stat64 st;
     char volhead[64];
     int magiclen;
+    long lres;
     
     assert(ai);
     
-    // on the archive volume
-    ai->archfd=open64(ai->volpath, O_RDONLY|O_LARGEFILE);
+    // on the archive volume (it may have been opened in advance while the previous one was read)
+    if (ai->stream==true) // the descriptor is duplicated so that it can be closed like a volume
+        ai->archfd=dup(STDIN_FILENO);
+    else if ((ai->nextfd>=0) && (strncmp(ai->nextpath, ai->volpath, PATH_MAX)==0))
+        ai->archfd=ai->nextfd;
+    else
+    {   if (ai->nextfd>=0)
+            close(ai->nextfd);
+        ai->archfd=open64(ai->volpath, O_RDONLY|O_LARGEFILE);
+    }
+    ai->nextfd=-1;
+    ai->nextchecked=false;
     if (ai->archfd<0)
     {   sysprintf ("cannot open archive %s\n", ai->volpath);
         return -1;
@@ -79,19 +290,42 @@ int archreader_open(carchreader *ai)
     {   sysprintf("fstat64(%s) failed\n", ai->volpath);
         return -1;
     }
-    if (!S_ISREG(st.st_mode))
+    if ((ai->stream==false) && (!S_ISREG(st.st_mode)))
     {   errprintf("%s is not a regular file, cannot continue\n", ai->volpath);
         close(ai->archfd);
         return -1;
     }
+    ai->volsize=(ai->stream==true)?0:st.st_size;
+    ai->curpos=0;
     
+    // a stream cannot be rewound: the beginning is read in rabuf and it's read again from there
+    if (ai->stream==true)
+    {
+        if ((ai->rabuf==NULL) && ((ai->rabuf=malloc(FSA_READER_BUFSIZE))==NULL))
+        {   errprintf("cannot allocate the read-ahead buffer: out of memory\n");
+            close(ai->archfd);
+            return -1;
+        }
+        ai->raoffset=0;
+        ai->rasize=0;
+        ai->rapos=0;
+        while (ai->rasize < sizeof(volhead)) // a pipe may return less than requested
+        {   if ((lres=read(ai->archfd, ai->rabuf+ai->rasize, FSA_READER_BUFSIZE-ai->rasize))<=0)
+            {   sysprintf("cannot read magic from %s\n", ai->volpath);
+                close(ai->archfd);
+                return -1;
+            }
+            ai->rasize+=lres;
+        }
+        memcpy(volhead, ai->rabuf, sizeof(volhead));
+    }
     // read file format version and rewind to beginning of the volume
-    if (read(ai->archfd, volhead, sizeof(volhead))!=sizeof(volhead))
+    else if (read(ai->archfd, volhead, sizeof(volhead))!=sizeof(volhead))
     {   sysprintf("cannot read magic from %s\n", ai->volpath);
         close(ai->archfd);
         return -1;
     }
-    if (lseek64(ai->archfd, 0, SEEK_SET)!=0)
+    else if (lseek64(ai->archfd, 0, SEEK_SET)!=0)
     {   sysprintf("cannot rewind volume %s\n", ai->volpath);
         close(ai->archfd);
         return -1;
@@ -116,6 +350,45 @@ int archreader_open(carchreader *ai)
     
     msgprintf(MSG_VERB2, "Detected fileformat=%d in archive %s\n", (int)ai->filefmtver, ai->volpath);
     
+    // the stream is read sequentially through rabuf
+    if (ai->stream==true)
+        return 0;
+    
+    // the blocks are borrowed from the mapping instead of being read in buffers
+    if ((g_options.mmapread==true) && (archreader_is_local_file(ai)==false))
+        msgprintf(MSG_VERB1, "%s is not a regular file on a local disk: the archive is read with read()\n", ai->volpath);
+    else if (g_options.mmapread==true)
+    {
+        if ((ai->map=blkbuf_map_file(ai->archfd, st.st_size))!=NULL)
+        {   ai->mapadvpos=0;
+            return 0;
+        }
+        msgprintf(MSG_VERB1, "cannot map %s in memory: the archive is read with read()\n", ai->volpath);
+    }
+    
+#ifdef OPTION_URING_SUPPORT
+    // read the next segments of the volume in advance
+    if ((g_options.iouring==true) && (ai->uring==NULL) && (ai->curvol==0) && (archreader_start_uring(ai)!=0))
+        archreader_stop_uring(ai);
+    if ((ai->uring!=NULL) && (archreader_start_segments(ai, 0)!=0))
+    {   close(ai->archfd);
+        return -1;
+    }
+    if (ai->uring!=NULL)
+        return 0;
+#endif // OPTION_URING_SUPPORT
+    
+    // the volume is read by large chunks and the headers are parsed from memory
+    if ((ai->rabuf==NULL) && ((ai->rabuf=malloc(FSA_READER_BUFSIZE))==NULL))
+    {   errprintf("cannot allocate the read-ahead buffer: out of memory\n");
+        close(ai->archfd);
+        return -1;
+    }
+    ai->raoffset=0;
+    ai->rasize=0;
+    ai->rapos=0;
+    posix_fadvise(ai->archfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    
     return 0;
 }
 
@@ -126,6 +399,18 @@ int archreader_close(carchreader *ai)
     if (ai->archfd<0)
         return -1;
     
+    // the mapping is removed when the blocks borrowed from it have been released
+    if (ai->map!=NULL)
+    {   blkbuf_map_put(ai->map);
+        ai->map=NULL;
+    }
+    
+#ifdef OPTION_URING_SUPPORT
+    // the read requests must be complete before the volume is closed
+    if (ai->uring!=NULL)
+        archreader_drain_segments(ai);
+#endif // OPTION_URING_SUPPORT
+    
     lockf(ai->archfd, F_ULOCK, 0);
     close(ai->archfd);
     ai->archfd=-1;
@@ -136,6 +421,10 @@ int archreader_close(carchreader *ai)
 int archreader_volpath(carchreader *ai)
 {
     int res;
+    if (ai->stream==true)
+    {   snprintf(ai->volpath, PATH_MAX, "%s", ai->basepath);
+        return 0;
+    }
     res=get_path_to_volume(ai->volpath, PATH_MAX, ai->basepath, ai->curvol);
     return res;
 }
@@ -147,20 +436,184 @@ int archreader_incvolume(carchreader *ai, bool waitkeypress)
     return archreader_volpath(ai);
 }
 
+// ask the kernel to read the next part of the mapping before the reader needs it
+static void archreader_map_advise(carchreader *ai)
+{
+    u64 start;
+    u64 end;
+    
+    if (ai->curpos+FSA_READER_MAPAHEAD/2 < ai->mapadvpos)
+        return;
+    start=ai->curpos & ~((u64)getpagesize()-1);
+    end=min(ai->map->size, ai->curpos+FSA_READER_MAPAHEAD);
+    if (end > start)
+        madvise(ai->map->addr+start, end-start, MADV_WILLNEED);
+    ai->mapadvpos=end;
+}
+
+// return a pointer to the next bytes of a mapped volume and move after them
+static u8 *archreader_map_borrow(carchreader *ai, u64 size)
+{
+    u8 *data;
+    
+    if (ai->curpos+size > ai->map->size)
+    {   errprintf("read failed: end of volume reached at offset=%lld\n", (long long)ai->curpos);
+        return NULL;
+    }
+    data=ai->map->addr+ai->curpos;
+    if (blkbuf_map_check(data, size)!=0)
+    {   errprintf("read failed: cannot read the mapped volume at offset=%lld\n", (long long)ai->curpos);
+        return NULL;
+    }
+    ai->curpos+=size;
+    archreader_map_advise(ai);
+    return data;
+}
+
+// the data are skipped when data is NULL
 int archreader_read_data(carchreader *ai, void *data, u64 size)
 {
     long lres;
+    u8 *mapdata;
+    u64 done;
+    u32 len;
     
     assert(ai);
+    
+    if (ai->map!=NULL)
+    {   if ((mapdata=archreader_map_borrow(ai, size))==NULL)
+            return -1;
+        if (data!=NULL)
+            memcpy(data, mapdata, size);
+        return 0;
+    }
+    
+#ifdef OPTION_URING_SUPPORT
+    if (ai->uring!=NULL)
+        return archreader_consume_segments(ai, (u8*)data, size);
+#endif // OPTION_URING_SUPPORT
+    
+    while (size>0)
+    {
+        if (ai->rapos==ai->rasize) // all the data of rabuf have been consumed
+        {
+            ai->raoffset+=ai->rasize;
+            ai->rasize=0;
+            ai->rapos=0;
+            if ((size >= FSA_READER_BUFSIZE) && (data!=NULL)) // large blocks are read directly where they are expected
+            {
+                for (done=0; done < size; done+=lres) // a pipe may return less than requested
+                {   if ((lres=read(ai->archfd, (char*)data+done, (long)(size-done)))<=0)
+                    {   sysprintf("read failed: read(size=%ld)=%ld\n", (long)(size-done), lres);
+                        return -1;
+                    }
+                }
+                ai->raoffset+=size;
+                ai->curpos+=size;
+                return 0;
+            }
+            if ((lres=read(ai->archfd, ai->rabuf, FSA_READER_BUFSIZE))<=0)
+            {   sysprintf("read failed: read(size=%ld)=%ld\n", (long)FSA_READER_BUFSIZE, lres);
+                return -1;
+            }
+            ai->rasize=lres;
+        }
+        
+        len=min(size, (u64)(ai->rasize-ai->rapos));
+        if (data!=NULL)
+        {   memcpy(data, ai->rabuf+ai->rapos, len);
+            data=(char*)data+len;
+        }
+        ai->rapos+=len;
+        ai->curpos+=len;
+        size-=len;
+    }
+    
+    return 0;
+}
+
+// open the next volume and ask the kernel to read its beginning when the end of the current one is near
+static void archreader_prefetch_next(carchreader *ai)
+{
+    if ((ai->stream==true) || (ai->nextchecked==true) || (ai->curpos+FSA_READER_PREFETCH < ai->volsize))
+        return;
+    
+    ai->nextchecked=true;
+    if ((get_path_to_volume(ai->nextpath, PATH_MAX, ai->basepath, ai->curvol+1)!=0) || (regfile_exists(ai->nextpath)!=true))
+        return; // this is the last volume, or the user will be asked where the next one is
+    if ((ai->nextfd=open64(ai->nextpath, O_RDONLY|O_LARGEFILE))<0)
+        return;
+    posix_fadvise(ai->nextfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(ai->nextfd, 0, FSA_READER_PREFETCH, POSIX_FADV_WILLNEED);
+    msgprintf(MSG_VERB2, "Next volume [%s] opened in advance\n", ai->nextpath);
+}
 
-    if ((lres=read(ai->archfd, (char*)data, (long)size))!=(long)size)
-    {   sysprintf("read failed: read(size=%ld)=%ld\n", (long)size, lres);
+// go to an absolute position in the current volume
+int archreader_seek(carchreader *ai, u64 pos)
+{
+#ifdef OPTION_URING_SUPPORT
+    struct s_readseg *s;
+#endif // OPTION_URING_SUPPORT
+    
+    assert(ai);
+    
+    if (ai->map!=NULL)
+    {   if (pos > ai->map->size)
+        {   errprintf("cannot go to offset=%lld in %s\n", (long long)pos, ai->volpath);
+            return -1;
+        }
+        ai->curpos=pos;
+        return 0;
+    }
+    
+#ifdef OPTION_URING_SUPPORT
+    if (ai->uring!=NULL)
+    {
+        s=&ai->seg[ai->curseg];
+        if ((pos < ai->curpos) && (ai->curpos-pos <= s->pos)) // backwards in the current segment
+        {   s->pos-=(u32)(ai->curpos-pos);
+            ai->curpos=pos;
+            return 0;
+        }
+        if ((pos >= ai->curpos) && (pos-ai->curpos <= (u64)FSA_READER_SEGSIZE*FSA_READER_SEGCOUNT)) // the data are being read
+            return archreader_consume_segments(ai, NULL, pos-ai->curpos);
+        if (archreader_start_segments(ai, pos)!=0)
+            return -1;
+        ai->curpos=pos;
+        return 0;
+    }
+#endif // OPTION_URING_SUPPORT
+    
+    if ((pos >= ai->raoffset) && (pos <= ai->raoffset+ai->rasize)) // the data are in rabuf
+    {   ai->rapos=(u32)(pos-ai->raoffset);
+        ai->curpos=pos;
+        return 0;
+    }
+    
+    if (ai->stream==true) // a stream can only be read forwards
+    {   if (pos > ai->curpos)
+            return archreader_read_data(ai, NULL, pos-ai->curpos);
+        errprintf("cannot go back to offset=%lld in %s\n", (long long)pos, ai->volpath);
         return -1;
     }
     
+    if (lseek64(ai->archfd, (off64_t)pos, SEEK_SET)<0)
+    {   sysprintf("lseek64(pos=%lld, SEEK_SET) failed\n", (long long)pos);
+        return -1;
+    }
+    ai->raoffset=pos;
+    ai->rasize=0;
+    ai->rapos=0;
+    ai->curpos=pos;
     return 0;
 }
 
+u64 archreader_get_currentpos(carchreader *ai)
+{
+    assert(ai);
+    return ai->curpos;
+}
+
 int archreader_read_dico(carchreader *ai, cdico *d)
 {
     u16 size;
@@ -169,6 +622,7 @@ int archreader_read_dico(carchreader *ai, cdico *d)
     u32 newsum;
     u8 *buffer;
     u8 *bufpos;
+    u8 *tofree;
     u16 temp16;
     u32 temp32;
     u8 section;
@@ -202,21 +656,31 @@ int archreader_read_dico(carchreader *ai, cdico *d)
             return OLDERR_FATAL;
     }
     
-    bufpos=buffer=malloc(headerlen);
-    if (!buffer)
-    {   errprintf("cannot allocate memory for header\n");
-        return FSAERR_ENOMEM;
+    // the header is parsed in place when the volume is mapped
+    if (ai->map!=NULL)
+    {   if ((bufpos=buffer=archreader_map_borrow(ai, headerlen))==NULL)
+        {   errprintf("cannot read header data\n");
+            return OLDERR_FATAL;
+        }
+        tofree=NULL;
     }
-    
-    if (archreader_read_data(ai, buffer, headerlen)!=0)
-    {   errprintf("cannot read header data\n");
-        free(buffer);
-        return OLDERR_FATAL;
+    else
+    {   bufpos=buffer=tofree=malloc(headerlen);
+        if (!buffer)
+        {   errprintf("cannot allocate memory for header\n");
+            return FSAERR_ENOMEM;
+        }
+        
+        if (archreader_read_data(ai, buffer, headerlen)!=0)
+        {   errprintf("cannot read header data\n");
+            free(tofree);
+            return OLDERR_FATAL;
+        }
     }
     
     if (archreader_read_data(ai, &temp32, sizeof(temp32))!=0)
     {   errprintf("cannot read header checksum\n");
-        free(buffer);
+        free(tofree);
         return OLDERR_FATAL;
     }
     origsum=le32_to_cpu(temp32);
@@ -226,7 +690,7 @@ int archreader_read_dico(carchreader *ai, cdico *d)
     
     if (newsum!=origsum)
     {   errprintf("bad checksum for header\n");
-        free(buffer);
+        free(tofree);
         return OLDERR_MINOR; // header corrupt --> skip file
     }
     
@@ -262,13 +726,157 @@ int archreader_read_dico(carchreader *ai, cdico *d)
         bufpos+=size;
     }
     
-    free(buffer);
+    free(tofree);
     return FSAERR_SUCCESS;
 }
 
+// return the offset of the first valid magic in buf (or len if there is none), the bytes which
+// can start a magic are compared 16 at a time with SSE2 and the candidates are then checked
+static u64 archreader_scan_magic(u8 *buf, u64 len)
+{
+    bool isfirst[256];
+    u8 first[16];
+    int firstcount=0;
+    u64 last;
+    u64 i=0;
+    int j;
+#ifdef __SSE2__
+    __m128i vfirst[16];
+    __m128i block;
+    __m128i hits;
+    int mask;
+#endif // __SSE2__
+    
+    if (len < FSA_SIZEOF_MAGIC)
+        return len;
+    last=len-FSA_SIZEOF_MAGIC; // last offset where a magic can start
+    
+    memset(isfirst, 0, sizeof(isfirst));
+    for (j=0; valid_magic[j]!=NULL; j++)
+    {   if ((isfirst[(u8)valid_magic[j][0]]==false) && (firstcount<16))
+            first[firstcount++]=(u8)valid_magic[j][0];
+        isfirst[(u8)valid_magic[j][0]]=true;
+    }
+    
+#ifdef __SSE2__
+    for (j=0; j < firstcount; j++)
+        vfirst[j]=_mm_set1_epi8((char)first[j]);
+    for (; i+16 <= last+1; i+=16)
+    {
+        block=_mm_loadu_si128((__m128i*)(buf+i));
+        hits=_mm_setzero_si128();
+        for (j=0; j < firstcount; j++)
+            hits=_mm_or_si128(hits, _mm_cmpeq_epi8(block, vfirst[j]));
+        for (mask=_mm_movemask_epi8(hits); mask!=0; mask&=mask-1)
+        {   if (is_magic_valid((char*)buf+i+__builtin_ctz(mask))==true)
+                return i+__builtin_ctz(mask);
+        }
+    }
+#endif // __SSE2__
+    
+    for (; i <= last; i++)
+    {   if ((isfirst[buf[i]]==true) && (is_magic_valid((char*)buf+i)==true))
+            return i;
+    }
+    return len;
+}
+
+// check that a magic found after a corruption starts a real header: archive id and checksum of the dico
+static bool archreader_check_header(carchreader *ai, u64 pos)
+{
+    u8 head[FSA_SIZEOF_MAGIC+sizeof(u32)+sizeof(u16)+sizeof(u32)];
+    u32 headsize;
+    u32 headerlen;
+    u32 temp32;
+    u16 temp16;
+    u8 *buffer;
+    bool res;
+    
+    // magic, archive-id, filesystem-id and length of the dico
+    headsize=FSA_SIZEOF_MAGIC+sizeof(u32)+sizeof(u16)+((ai->filefmtver==1)?sizeof(u16):sizeof(u32));
+    if (pread64(ai->archfd, head, headsize, pos)!=(long)headsize)
+        return false;
+    memcpy(&temp32, head+FSA_SIZEOF_MAGIC, sizeof(temp32));
+    if ((ai->archid!=0) && (le32_to_cpu(temp32)!=ai->archid))
+        return false;
+    if (ai->filefmtver==1)
+    {   memcpy(&temp16, head+FSA_SIZEOF_MAGIC+sizeof(u32)+sizeof(u16), sizeof(temp16));
+        headerlen=le16_to_cpu(temp16);
+    }
+    else
+    {   memcpy(&temp32, head+FSA_SIZEOF_MAGIC+sizeof(u32)+sizeof(u16), sizeof(temp32));
+        headerlen=le32_to_cpu(temp32);
+    }
+    if (headerlen > FSA_READER_MAXHEADER)
+        return false;
+    
+    // data of the dico followed by its checksum
+    if ((buffer=malloc(headerlen+sizeof(u32)))==NULL)
+        return false;
+    res=(pread64(ai->archfd, buffer, headerlen+sizeof(u32), pos+headsize)==(long)(headerlen+sizeof(u32)));
+    if (res==true)
+    {   memcpy(&temp32, buffer+headerlen, sizeof(temp32));
+        res=(fletcher32(buffer, headerlen)==le32_to_cpu(temp32));
+    }
+    free(buffer);
+    return res;
+}
+
+// search the next valid header from pos after a corruption, the volume is scanned by large windows
+static int archreader_resync(carchreader *ai, u64 pos)
+{
+    u64 startpos=pos;
+    u8 *tofree=NULL;
+    u8 *window;
+    s64 len;
+    u64 off;
+    
+    if ((ai->map==NULL) && ((tofree=malloc(FSA_READER_BUFSIZE))==NULL))
+    {   errprintf("cannot allocate memory to search the next header\n");
+        return -1;
+    }
+    
+    for (;;)
+    {
+        if (ai->map!=NULL) // the window is just a part of the mapping
+        {   len=(pos < ai->map->size)?min(FSA_READER_BUFSIZE, ai->map->size-pos):0;
+            window=ai->map->addr+pos;
+            if (blkbuf_map_check(window, len)!=0)
+            {   errprintf("cannot read the mapped volume at offset=%lld\n", (long long)pos);
+                break;
+            }
+        }
+        else if ((len=pread64(ai->archfd, tofree, FSA_READER_BUFSIZE, pos))<0)
+        {   sysprintf("cannot read volume at offset=%lld\n", (long long)pos);
+            break;
+        }
+        else
+        {   window=tofree;
+        }
+        if (len < FSA_SIZEOF_MAGIC)
+        {   errprintf("no valid header found after offset=%lld\n", (long long)startpos);
+            break;
+        }
+        
+        for (off=0; (off+=archreader_scan_magic(window+off, len-off)) < (u64)len; off++)
+        {
+            if (archreader_check_header(ai, pos+off)==true)
+            {   free(tofree);
+                msgprintf(MSG_VERB2, "found a valid header at offset=%lld after skipping %lld bytes\n", 
+                    (long long)(pos+off), (long long)(pos+off-startpos));
+                return archreader_seek(ai, pos+off);
+            }
+        }
+        pos+=len-(FSA_SIZEOF_MAGIC-1); // a magic may overlap two windows
+    }
+    
+    free(tofree);
+    return -1;
+}
+
 int archreader_read_header(carchreader *ai, char *magic, cdico **d, bool allowseek, u16 *fsid)
 {
-    s64 curpos;
+    u64 curpos;
     u16 temp16;
     u32 temp32;
     u32 archid;
@@ -289,10 +897,7 @@ int archreader_read_header(carchreader *ai, char *magic, cdico **d, bool allowse
     }
     
     // search for next read header marker and magic (it may be further if corruption in archive)
-    if ((curpos=lseek64(ai->archfd, 0, SEEK_CUR))<0)
-    {   sysprintf("lseek64() failed to get the current position in archive\n");
-        return OLDERR_FATAL;
-    }
+    curpos=archreader_get_currentpos(ai);
     
     if ((res=archreader_read_data(ai, magic, FSA_SIZEOF_MAGIC))!=FSAERR_SUCCESS)
     {   msgprintf(MSG_STACK, "cannot read header magic: res=%d\n", res);
@@ -305,10 +910,20 @@ int archreader_read_header(carchreader *ai, char *magic, cdico **d, bool allowse
         return OLDERR_FATAL;
     }
     
-    while (is_magic_valid(magic)!=true)
+    // a stream cannot be read again: the magic is searched one byte after the other
+    while ((ai->stream==true) && (is_magic_valid(magic)!=true))
     {
-        if (lseek64(ai->archfd, curpos++, SEEK_SET)<0)
-        {   sysprintf("lseek64(pos=%lld, SEEK_SET) failed\n", (long long)curpos);
+        memmove(magic, magic+1, FSA_SIZEOF_MAGIC-1);
+        if ((res=archreader_read_data(ai, magic+FSA_SIZEOF_MAGIC-1, 1))!=FSAERR_SUCCESS)
+        {   msgprintf(MSG_STACK, "cannot read header magic: res=%d\n", res);
+            return OLDERR_FATAL;
+        }
+    }
+    
+    if (is_magic_valid(magic)!=true)
+    {
+        if (archreader_resync(ai, curpos+1)!=0)
+        {   msgprintf(MSG_STACK, "archreader_resync(pos=%lld) failed\n", (long long)(curpos+1));
             return OLDERR_FATAL;
         }
         if ((res=archreader_read_data(ai, magic, FSA_SIZEOF_MAGIC))!=FSAERR_SUCCESS)
@@ -443,6 +1058,7 @@ int archreader_read_block(carchreader *ai, cdico *in_blkdico, int in_skipblock,
     u32 finalsize; // compressed  block size
     u32 compsize;
     u8 *buffer;
+    int blknode;
     
     assert(ai);
     assert(out_sumok);
@@ -452,6 +1068,7 @@ int archreader_read_block(carchreader *ai, cdico *in_blkdico, int in_skipblock,
     // init
     memset(out_blkinfo, 0, sizeof(struct s_blockinfo));
     *out_sumok=-1;
+    archreader_prefetch_next(ai);
     
     if (dico_get_u64(in_blkdico, 0, BLOCKHEADITEMKEY_BLOCKOFFSET, &blockoffset)!=0)
     {   msgprintf(3, "cannot get blockoffset from block-header\n");
@@ -490,27 +1107,40 @@ int archreader_read_block(carchreader *ai, cdico *in_blkdico, int in_skipblock,
     
     if (in_skipblock==true) // the main thread does not need that block (block belongs to a filesys we want to skip)
     {
-        if (lseek64(ai->archfd, (long)finalsize, SEEK_CUR)<0)
-        {   sysprintf("cannot skip block (finalsize=%ld) failed\n", (long)finalsize);
+        if (archreader_seek(ai, ai->curpos+finalsize)!=0)
+        {   errprintf("cannot skip block (finalsize=%ld) failed\n", (long)finalsize);
             return -1;
         }
         return 0;
     }
     
-    // ---- allocate memory
-    if ((buffer=malloc(finalsize))==NULL)
-    {   errprintf("cannot allocate block: malloc(%d) failed\n", finalsize);
-        return FSAERR_ENOMEM;
+    // ---- borrow the block from the mapping: it's released by the thread which decompresses it
+    blknode=blkbuf_pick_node();
+    if (ai->map!=NULL)
+    {   if ((buffer=archreader_map_borrow(ai, finalsize))==NULL)
+        {   errprintf("cannot read block (finalsize=%ld) failed\n", (long)finalsize);
+            return -1;
+        }
+        blkbuf_map_get(ai->map);
+        out_blkinfo->blkmap=ai->map;
     }
-    
-    if (read(ai->archfd, buffer, (long)finalsize)!=(long)finalsize)
-    {   sysprintf("cannot read block (finalsize=%ld) failed\n", (long)finalsize);
-        free(buffer);
-        return -1;
+    else // ---- allocate memory on the node of the thread which will decompress the block
+    {
+        if ((buffer=(u8*)blkbuf_alloc(finalsize, blknode))==NULL)
+        {   errprintf("cannot allocate block: blkbuf_alloc(%d) failed\n", finalsize);
+            return FSAERR_ENOMEM;
+        }
+        
+        if (archreader_read_data(ai, buffer, finalsize)!=0)
+        {   errprintf("cannot read block (finalsize=%ld) failed\n", (long)finalsize);
+            blkbuf_free((char*)buffer);
+            return -1;
+        }
     }
     
     // prepare blkinfo
     out_blkinfo->blkdata=(char*)buffer;
+    out_blkinfo->blknode=blknode;
     out_blkinfo->blkrealsize=curblocksize;
     out_blkinfo->blkoffset=blockoffset;
     out_blkinfo->blkarcsum=arblockcsumorig;
@@ -524,16 +1154,16 @@ int archreader_read_block(carchreader *ai, cdico *in_blkdico, int in_skipblock,
     if (arblockcsumcalc!=arblockcsumorig) // bad checksum
     {
         errprintf("block is corrupt at offset=%ld, blksize=%ld\n", (long)blockoffset, (long)curblocksize);
-        free(out_blkinfo->blkdata);
-        if ((out_blkinfo->blkdata=malloc(curblocksize))==NULL)
-        {   errprintf("cannot allocate block: malloc(%d) failed\n", curblocksize);
+        blkbuf_release_block(out_blkinfo);
+        if ((out_blkinfo->blkdata=blkbuf_alloc(curblocksize, blknode))==NULL)
+        {   errprintf("cannot allocate block: blkbuf_alloc(%d) failed\n", curblocksize);
             return FSAERR_ENOMEM;
         }
         memset(out_blkinfo->blkdata, 0, curblocksize);
         *out_sumok=false;
         // go to the beginning of the corrupted contents so that the next header is searched here
-        if (lseek64(ai->archfd, -(long long)finalsize, SEEK_CUR)<0)
-        {   errprintf("lseek64() failed\n");
+        if ((ai->stream==false) && (archreader_seek(ai, ai->curpos-finalsize)!=0))
+        {   errprintf("archreader_seek() failed\n");
         }
     }
     else // no corruption detected
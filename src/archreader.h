@@ -23,6 +23,17 @@
 struct s_blockinfo;
 struct s_headinfo;
 struct s_dico;
+struct s_uring;
+struct s_blkmap;
+
+// read-ahead segment filled by io_uring
+struct s_readseg
+{   u8     *buffer; // registered buffer of FSA_READER_SEGSIZE bytes
+    u64    offset; // offset of the segment in the current volume
+    u32    size; // how many bytes have been read in the segment
+    u32    pos; // how many bytes of the segment have already been consumed
+    bool   inflight; // true while an io_uring request is reading the segment
+};
 
 struct s_archreader;
 typedef struct s_archreader carchreader;
@@ -33,6 +44,7 @@ struct s_archreader
     u64    fscount; // how many filesystems in archive (valid only if archtype=filesystems)
     u32    archtype; // what has been saved in the archive: filesystems or directories
     u32    curvol; // current volume number, starts at 0, incremented when we change the volume
+    bool   stream; // true when the archive is read from stdin (one volume, which is not seekable)
     u32    compalgo; // compression algorithm which has been used to create the archive
     u32    cryptalgo; // encryption algorithm which has been used to create the archive
     u32    complevel; // compression level which is specific to the compression algorithm
@@ -46,6 +58,21 @@ struct s_archreader
     char   label[FSA_MAX_LABELLEN]; // archive label defined by the user
     char   basepath[PATH_MAX]; // path of the first volume of an archive
     char   volpath[PATH_MAX]; // path of the current volume of an archive
+    u64    curpos; // offset in the current volume of the next byte to read
+    u8     *rabuf; // read-ahead buffer of FSA_READER_BUFSIZE bytes (not used with io_uring)
+    u64    raoffset; // offset in the current volume of the first byte of rabuf
+    u32    rasize; // how many bytes have been read in rabuf
+    u32    rapos; // how many bytes of rabuf have already been consumed
+    struct s_blkmap *map; // current volume mapped in memory (NULL if the volume is read with read())
+    u64    mapadvpos; // offset up to which the kernel has been asked to read the mapping in advance
+    u64    volsize; // size of the current volume
+    bool   nextchecked; // true when the next volume has been looked for while reading the current one
+    int    nextfd; // next volume opened in advance (-1 if it's not open)
+    char   nextpath[PATH_MAX]; // path of the next volume opened in advance
+    struct s_readseg seg[FSA_READER_SEGCOUNT]; // segments read in advance (only used with io_uring)
+    int    curseg; // segment where the next bytes are consumed
+    u64    nextpos; // offset in the current volume of the next segment to read
+    struct s_uring *uring; // used to read several segments at the same time (NULL if not used)
 };
 
 int archreader_init(carchreader *ai);
@@ -55,6 +82,8 @@ int archreader_close(carchreader *ai);
 int archreader_incvolume(carchreader *ai, bool waitkeypress);
 int archreader_volpath(carchreader *ai);
 int archreader_read_data(carchreader *ai, void *data, u64 size);
+int archreader_seek(carchreader *ai, u64 pos);
+u64 archreader_get_currentpos(carchreader *ai);
 int archreader_read_dico(carchreader *ai, struct s_dico *d);
 int archreader_read_volheader(carchreader *ai);
 int archreader_read_header(carchreader *ai, char *magic, struct s_dico **d, bool allowseek, u16 *fsid);
@@ -25,7 +25,10 @@
 #include <fcntl.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "fsarchiver.h"
 #include "dico.h"
@@ -36,11 +39,17 @@
 #include "writebuf.h"
 #include "comp_gzip.h"
 #include "comp_bzip2.h"
+#include "blkbuf.h"
+#include "uring.h"
+#include "syncthread.h"
 #include "error.h"
 
 #define FSA_SMB_SUPER_MAGIC 0x517B
 #define FSA_CIFS_MAGIC_NUMBER 0xFF534D42
 
+static int archwriter_flush_all(carchwriter *ai);
+static int archwriter_write_direct_tail(carchwriter *ai);
+
 int archwriter_init(carchwriter *ai)
 {
     assert(ai);
@@ -50,16 +59,334 @@ int archwriter_init(carchwriter *ai)
     ai->archfd=-1;
     ai->archid=0;
     ai->curvol=0;
+    ai->closefd=-1;
+    ai->volprep.oldfd=-1;
+    ai->volprep.fd=-1;
+    return 0;
+}
+
+// open a new volume, with O_DIRECT if it has been requested and if the filesystem supports it
+// (exclusive: fails if the file already exists, so that it can be removed if it's not used)
+static int archwriter_open_volume(char *path, bool *directio, bool exclusive)
+{
+    long archflags=O_RDWR|O_CREAT|O_TRUNC|O_LARGEFILE|(exclusive?O_EXCL:0);
+    long archperm=S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH;
+    int fd;
+    
+    // bypass the page cache so that the archive does not evict the data of the other programs
+    *directio=false;
+    if (g_options.directio==true)
+    {
+        if ((fd=open64(path, archflags|O_DIRECT, archperm))>=0)
+        {   *directio=true;
+            return fd;
+        }
+        if (errno==EINVAL) // O_DIRECT is not supported by that filesystem
+            msgprintf(MSG_VERB1, "O_DIRECT is not supported on %s: the archive is written through the page cache\n", path);
+    }
+    return open64(path, archflags, archperm);
+}
+
+// a copy which cannot be written is abandoned if it's optional, else the archive fails too
+static int archwriter_tee_failed(struct s_tee *tee)
+{
+    if (tee->fd>=0)
+    {   close(tee->fd);
+        tee->fd=-1;
+    }
+    if (tee->optional==false)
+        return -1;
+    
+    errprintf("the copy of the archive in %s is incomplete and it is not written anymore\n", tee->basepath);
+    tee->failed=true;
+    return 0;
+}
+
+// allocate the copies of the archive given with --tee and --tee-optional
+static int archwriter_tee_alloc(carchwriter *ai)
+{
+    cstrlist *lists[]={&g_options.teepaths, &g_options.teeoptional};
+    char path[PATH_MAX];
+    struct s_tee *tee;
+    int count;
+    int i, j;
+    
+    count=strlist_count(lists[0])+strlist_count(lists[1]);
+    if ((count==0) || (ai->tees!=NULL))
+        return 0;
+    if ((ai->tees=calloc(count, sizeof(struct s_tee)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)(count*sizeof(struct s_tee)));
+        return -1;
+    }
+    
+    for (j=0; j < 2; j++)
+    {
+        for (i=0; strlist_getitem(lists[j], i, path, sizeof(path))==0; i++)
+        {   tee=&ai->tees[ai->teecount++];
+            tee->fd=-1;
+            tee->optional=(j==1);
+            strlist_init(&tee->vollist);
+            path_force_extension(tee->basepath, PATH_MAX, path, ".fsa");
+        }
+    }
+    return 0;
+}
+
+// create the current volume in each copy of the archive
+static int archwriter_tee_create(carchwriter *ai)
+{
+    long archflags=O_RDWR|O_CREAT|O_TRUNC|O_LARGEFILE;
+    long archperm=S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH;
+    struct stat64 st;
+    struct s_tee *tee;
+    int res;
+    int i;
+    
+    for (i=0; i < ai->teecount; i++)
+    {
+        tee=&ai->tees[i];
+        if (tee->failed==true)
+            continue;
+        if (get_path_to_volume(tee->volpath, PATH_MAX, tee->basepath, ai->curvol)!=0)
+            return -1;
+        
+        res=stat64(tee->volpath, &st);
+        if ((res==0) && ((!S_ISREG(st.st_mode)) || (g_options.overwrite==0)))
+            errprintf("%s already exists, please remove it first.\n", tee->volpath);
+        else if ((tee->fd=open64(tee->volpath, archflags, archperm))<0)
+            sysprintf("cannot create the copy of the archive %s\n", tee->volpath);
+        else
+        {   strlist_add(&tee->vollist, tee->volpath);
+            continue;
+        }
+        if (archwriter_tee_failed(tee)!=0)
+            return -1;
+    }
+    return 0;
+}
+
+// sync and close the current volume in each copy of the archive
+static int archwriter_tee_close(carchwriter *ai)
+{
+    struct s_tee *tee;
+    int ret=0;
+    int res;
+    int i;
+    
+    for (i=0; i < ai->teecount; i++)
+    {
+        tee=&ai->tees[i];
+        if (tee->fd<0)
+            continue;
+        res=0;
+        if (fsync(tee->fd)!=0)
+        {   sysprintf("cannot sync the copy of the archive %s\n", tee->volpath);
+            res=-1;
+        }
+        if (close(tee->fd)!=0)
+        {   sysprintf("cannot close the copy of the archive %s\n", tee->volpath);
+            res=-1;
+        }
+        tee->fd=-1;
+        if ((res!=0) && (archwriter_tee_failed(tee)!=0))
+            ret=-1;
+    }
+    return ret;
+}
+
+// thread which syncs and closes the previous volume and creates the next one in advance
+static void *archwriter_volprep_fct(void *args)
+{
+    struct s_volprep *prep=(struct s_volprep *)args;
+    struct statvfs64 svfs;
+    
+    if (prep->oldfd>=0)
+    {   if (fsync(prep->oldfd)!=0) // just in case the user reboots after it exits
+        {   sysprintf("cannot sync the previous volume of the archive\n");
+            prep->failed=true;
+        }
+        if (close(prep->oldfd)!=0)
+        {   sysprintf("cannot close the previous volume of the archive\n");
+            prep->failed=true;
+        }
+        prep->oldfd=-1;
+    }
+    
+    // only a volume which does not exist yet is created in advance, since it's removed if it's not used:
+    // archwriter_create() overwrites an existing file or reports the errors when the volume is needed
+    if ((prep->path[0]==0) || ((prep->fd=archwriter_open_volume(prep->path, &prep->directio, true))<0))
+        return NULL;
+    
+    // reserve the space of the whole volume so that it's written in contiguous extents, but only
+    // when there is room for two volumes: the last volume is often small and it must not fail
+    // because the space reserved for it is bigger than what remains on the disk
+    if ((fstatvfs64(prep->fd, &svfs)!=0) || ((u64)svfs.f_bavail*svfs.f_frsize < 2*(u64)g_options.splitsize))
+        msgprintf(MSG_DEBUG1, "not enough free space to reserve the space of %s\n", prep->path);
+    else if (fallocate(prep->fd, FALLOC_FL_KEEP_SIZE, 0, g_options.splitsize)==0)
+        prep->prealloc=true;
+    else
+        msgprintf(MSG_DEBUG1, "fallocate(%s) failed: the space of the volume is not reserved\n", prep->path);
+    
+    return NULL;
+}
+
+// wait for the thread which prepares the next volume, returns -1 if the previous volume could not be completed
+static int archwriter_volprep_join(carchwriter *ai)
+{
+    if (ai->volprep.started==true)
+    {   pthread_join(ai->volprep.thread, NULL);
+        ai->volprep.started=false;
+    }
+    if (ai->volprep.failed==true)
+    {   ai->volprep.failed=false;
+        return -1;
+    }
     return 0;
 }
 
+// start the creation of the volume which follows the current one (and close the previous one)
+static void archwriter_volprep_start(carchwriter *ai)
+{
+    struct s_volprep *prep=&ai->volprep;
+    
+    prep->oldfd=ai->closefd;
+    prep->fd=-1;
+    prep->directio=false;
+    prep->prealloc=false;
+    ai->closefd=-1;
+    prep->path[0]=0;
+    // the current volume is probably the last one when all the items are in the queue:
+    // the next one is not created in advance (the previous one is still closed by the thread)
+    if ((queue_get_end_of_input(&g_queue)==false) &&
+        (get_path_to_volume(prep->path, PATH_MAX, ai->basepath, ai->curvol+1)!=0))
+        prep->path[0]=0;
+    if (pthread_create(&prep->thread, NULL, archwriter_volprep_fct, (void*)prep)!=0)
+    {   archwriter_volprep_fct((void*)prep); // the previous volume must be closed anyway
+        if (prep->fd>=0)
+        {   close(prep->fd);
+            unlink(prep->path);
+            prep->fd=-1;
+        }
+        return;
+    }
+    prep->started=true;
+}
+
+// the volume which has been created in advance is not needed (this is the end of the archive)
+static int archwriter_volprep_discard(carchwriter *ai)
+{
+    int res=0;
+    
+    if (archwriter_volprep_join(ai)!=0)
+        res=-1;
+    if (ai->volprep.fd>=0)
+    {   close(ai->volprep.fd);
+        unlink(ai->volprep.path);
+        ai->volprep.fd=-1;
+    }
+    if (ai->closefd>=0)
+    {   if (fsync(ai->closefd)!=0)
+        {   sysprintf("cannot sync the previous volume of the archive\n");
+            res=-1;
+        }
+        if (close(ai->closefd)!=0)
+        {   sysprintf("cannot close the previous volume of the archive\n");
+            res=-1;
+        }
+        ai->closefd=-1;
+    }
+    return res;
+}
+
+// forget the data of the batch and release the blocks which were waiting to be written
+static void archwriter_release_batch(struct s_writebatch *b)
+{
+    int i;
+    
+    for (i=0; i < b->pendcount; i++)
+        blkbuf_free(b->pendfree[i]);
+    b->pendcount=0;
+    b->iovcount=0;
+    b->iovbytes=0;
+    b->stageused=0;
+    b->inflight=false;
+}
+
 int archwriter_destroy(carchwriter *ai)
 {
+    int i;
+    
     assert(ai);
+    archwriter_volprep_discard(ai);
+#ifdef OPTION_URING_SUPPORT
+    if (ai->uring!=NULL)
+    {   archwriter_flush_all(ai);
+        uring_destroy(ai->uring);
+        ai->uring=NULL;
+    }
+#endif // OPTION_URING_SUPPORT
+    for (i=0; i < FSA_WRITER_MAXBATCH; i++)
+    {   archwriter_release_batch(&ai->batch[i]);
+        free(ai->batch[i].stagebuf);
+        ai->batch[i].stagebuf=NULL;
+    }
+    free(ai->directbuf);
+    ai->directbuf=NULL;
+    for (i=0; i < ai->teecount; i++)
+    {   if (ai->tees[i].fd>=0)
+            close(ai->tees[i].fd);
+        strlist_destroy(&ai->tees[i].vollist);
+    }
+    free(ai->tees);
+    ai->tees=NULL;
+    ai->teecount=0;
     strlist_destroy(&ai->vollist);
     return 0;
 }
 
+// allocate the staging buffers and start io_uring if it has been requested
+static int archwriter_alloc_batches(carchwriter *ai)
+{
+#ifdef OPTION_URING_SUPPORT
+    struct iovec iov[FSA_WRITER_MAXBATCH];
+#endif // OPTION_URING_SUPPORT
+    int i;
+    
+    for (i=0; i < FSA_WRITER_MAXBATCH; i++)
+    {
+        if ((ai->batch[i].stagebuf==NULL) && (posix_memalign((void**)&ai->batch[i].stagebuf, FSA_WRITER_STAGESIZE, FSA_WRITER_STAGESIZE)!=0))
+        {   errprintf("posix_memalign(%ld) failed: out of memory\n", (long)FSA_WRITER_STAGESIZE);
+            ai->batch[i].stagebuf=NULL;
+            return -1;
+        }
+    }
+    
+    if ((g_options.directio==true) && (ai->directbuf==NULL) && (posix_memalign((void**)&ai->directbuf, FSA_WRITER_DIRECTALIGN, FSA_WRITER_BATCHSIZE)!=0))
+    {   errprintf("posix_memalign(%ld) failed: out of memory\n", (long)FSA_WRITER_BATCHSIZE);
+        ai->directbuf=NULL;
+        return -1;
+    }
+    
+#ifdef OPTION_URING_SUPPORT
+    // the data written with O_DIRECT are copied in directbuf and written with write()
+    if ((g_options.iouring==true) && (g_options.directio==false) && (ai->stream==false) && (ai->uring==NULL) && (ai->curvol==0))
+    {
+        if ((ai->uring=uring_create(2*FSA_WRITER_MAXBATCH))==NULL)
+        {   msgprintf(MSG_VERB1, "io_uring is not available: the archive is written with write()\n");
+            return 0;
+        }
+        for (i=0; i < FSA_WRITER_MAXBATCH; i++)
+        {   iov[i].iov_base=ai->batch[i].stagebuf;
+            iov[i].iov_len=FSA_WRITER_STAGESIZE;
+        }
+        ai->uringfixed=(uring_register_buffers(ai->uring, iov, FSA_WRITER_MAXBATCH)==0);
+        msgprintf(MSG_VERB2, "the archive is written with io_uring (registered buffers: %s)\n", ai->uringfixed?"yes":"no");
+    }
+#endif // OPTION_URING_SUPPORT
+    
+    return 0;
+}
+
 int archwriter_generate_id(carchwriter *ai)
 {
     assert(ai);
@@ -73,19 +400,28 @@ int archwriter_create(carchwriter *ai)
     //struct statfs svfs;
     //int tempfd;
     struct stat64 st;
-    long archflags=0;
-    long archperm;
+    bool prepared;
     int res;
     
     assert(ai);
     
     // init
     memset(&st, 0, sizeof(st));
-    archflags=O_RDWR|O_CREAT|O_TRUNC|O_LARGEFILE;
-    archperm=S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH;
+    
+    // the volume may have been created in advance while the previous one was written
+    if (archwriter_volprep_join(ai)!=0)
+    {   errprintf("the previous volume of the archive is incomplete\n");
+        return -1;
+    }
+    prepared=((ai->volprep.fd>=0) && (strncmp(ai->volprep.path, ai->volpath, PATH_MAX)==0));
+    if ((prepared==false) && (ai->volprep.fd>=0))
+    {   close(ai->volprep.fd);
+        unlink(ai->volprep.path);
+        ai->volprep.fd=-1;
+    }
     
     // if the archive already exists and is a not regular file
-    res=stat64(ai->volpath, &st);
+    res=((prepared==true) || (ai->stream==true))?-1:stat64(ai->volpath, &st);
     if (res==0 && !S_ISREG(st.st_mode))
     {   errprintf("%s already exists, and is not a regular file.\n", ai->basepath);
         return -1;
@@ -111,14 +447,48 @@ int archwriter_create(carchwriter *ai)
         return -1;
     }*/
     
-    ai->archfd=open64(ai->volpath, archflags, archperm);
-    if (ai->archfd < 0)
+    if (archwriter_alloc_batches(ai)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_alloc_batches() failed\n");
+        return -1;
+    }
+    
+    ai->prealloc=false;
+    if (ai->stream==true) // the descriptor is duplicated so that it can be closed like a volume
+    {   ai->directio=false;
+        if ((ai->archfd=dup(STDOUT_FILENO))<0)
+        {   sysprintf("cannot write the archive to the standard output\n");
+            return -1;
+        }
+    }
+    else if (prepared==true)
+    {   ai->archfd=ai->volprep.fd;
+        ai->directio=ai->volprep.directio;
+        ai->prealloc=ai->volprep.prealloc;
+        ai->volprep.fd=-1;
+    }
+    else if ((ai->archfd=archwriter_open_volume(ai->volpath, &ai->directio, false)) < 0)
     {   sysprintf ("cannot create archive %s\n", ai->volpath);
         return -1;
     }
     ai->newarch=true;
+    ai->curpos=0;
+    ai->syncpos=0;
+    ai->syncrange=((ai->directio==false) && (ai->stream==false)); // nothing to write-behind without the page cache
+    ai->directused=0;
+    ai->curbatch=0;
+    
+    if (ai->stream==false) // there is nothing to remove when it's written to stdout
+        strlist_add(&ai->vollist, ai->volpath);
+    
+    // the copies of the archive are split at the same place
+    if ((archwriter_tee_alloc(ai)!=0) || (archwriter_tee_create(ai)!=0))
+    {   msgprintf(MSG_STACK, "cannot create the copies of the archive\n");
+        return -1;
+    }
     
-    strlist_add(&ai->vollist, ai->volpath);
+    // the next volume is created while this one is written
+    if (g_options.splitsize>0)
+        archwriter_volprep_start(ai);
     
     /* lockf is causing corruption when the archive is written on a smbfs/cifs filesystem */
     /*if (lockf(ai->archfd, F_LOCK, 0)!=0)
@@ -130,26 +500,67 @@ int archwriter_create(carchwriter *ai)
     return 0;
 }
 
-int archwriter_close(carchwriter *ai)
+// write the pending data of the volume, it's closed now or by the next volprep thread
+static int archwriter_close_volume(carchwriter *ai, bool background)
 {
-    assert(ai);
+    int res=0;
     
     if (ai->archfd<0)
         return -1;
     
+    // the last batch contains the volume footer: the archive is incomplete if it cannot be written
+    if (archwriter_flush_all(ai)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_flush_all() failed\n");
+        res=-1;
+    }
+    if ((ai->directio==true) && (archwriter_write_direct_tail(ai)!=0))
+    {   msgprintf(MSG_STACK, "archwriter_write_direct_tail() failed\n");
+        res=-1;
+    }
+    if ((ai->prealloc==true) && (ftruncate(ai->archfd, ai->curpos)!=0)) // release the space reserved after the end
+    {   sysprintf("ftruncate(%s) failed\n", ai->volpath);
+        res=-1;
+    }
+    
     //res=lockf(ai->archfd, F_ULOCK, 0);
-    fsync(ai->archfd); // just in case the user reboots after it exits
-    close(ai->archfd);
+    if (background==true)
+    {   ai->closefd=ai->archfd;
+    }
+    else
+    {   if (fsync(ai->archfd)!=0) // just in case the user reboots after it exits
+        {   sysprintf("fsync(%s) failed\n", ai->volpath);
+            res=-1;
+        }
+        close(ai->archfd);
+    }
+    if (archwriter_tee_close(ai)!=0)
+        res=-1;
     ai->archfd=-1;
     
-    return 0;
+    return res;
+}
+
+int archwriter_close(carchwriter *ai)
+{
+    int res=0;
+    
+    assert(ai);
+    
+    // this is the last volume: the next one is not needed
+    if (archwriter_volprep_discard(ai)!=0)
+    {   errprintf("the previous volume of the archive is incomplete\n");
+        res=-1;
+    }
+    if (archwriter_close_volume(ai, false)!=0)
+        return -1;
+    return res;
 }
 
 int archwriter_remove(carchwriter *ai)
 {
     char volpath[PATH_MAX];
     int count;
-    int i;
+    int i, j;
     
     assert(ai);
     
@@ -171,68 +582,457 @@ int archwriter_remove(carchwriter *ai)
                     errprintf("cannot remove %s\n", volpath);
             }
         }
+        
+        // the copies of the archive are incomplete too
+        for (j=0; j < ai->teecount; j++)
+        {
+            for (i=0; strlist_getitem(&ai->tees[j].vollist, i, volpath, sizeof(volpath))==0; i++)
+            {
+                if (unlink(volpath)==0)
+                    msgprintf(MSG_FORCE, "removed %s\n", volpath);
+                else
+                    errprintf("cannot remove %s\n", volpath);
+            }
+        }
     }
     return 0;
 }
 
+// the position is tracked in memory and it includes the data which have not been written yet
 s64 archwriter_get_currentpos(carchwriter *ai)
 {
     assert(ai);
-    return (s64)lseek64(ai->archfd, 0, SEEK_CUR);
+    return (s64)ai->curpos;
 }
 
-int archwriter_write_buffer(carchwriter *ai, struct s_writebuf *wb)
+// offset up to which all the data have been written in the volume
+static u64 archwriter_get_writtenpos(carchwriter *ai)
+{
+    u64 pos;
+    int i;
+    
+    pos=ai->curpos-ai->batch[ai->curbatch].iovbytes;
+    for (i=0; i < FSA_WRITER_MAXBATCH; i++)
+        if ((ai->batch[i].inflight==true) && (ai->batch[i].offset < pos))
+            pos=ai->batch[i].offset;
+    return pos;
+}
+
+// write-behind: start the writeback of the data which have just been written and wait for the
+// previous chunk, so that the dirty pages are written while the archive is being created
+static void archwriter_write_behind(carchwriter *ai)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+    u64 writtenpos=archwriter_get_writtenpos(ai);
+    
+    while ((ai->syncrange==true) && (writtenpos - ai->syncpos >= FSA_WRITER_SYNCSIZE))
+    {
+        if (sync_file_range(ai->archfd, ai->syncpos, FSA_WRITER_SYNCSIZE, SYNC_FILE_RANGE_WRITE)!=0)
+        {   msgprintf(MSG_DEBUG1, "sync_file_range() is not supported on %s\n", ai->volpath);
+            ai->syncrange=false; // not a regular file or not supported by the filesystem
+            return;
+        }
+        if (ai->syncpos >= FSA_WRITER_SYNCSIZE)
+            sync_file_range(ai->archfd, ai->syncpos-FSA_WRITER_SYNCSIZE, FSA_WRITER_SYNCSIZE, 
+                SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+        ai->syncpos+=FSA_WRITER_SYNCSIZE;
+    }
+#endif // SYNC_FILE_RANGE_WRITE
+}
+
+static void archwriter_write_error(int fd, long lres, u64 size)
 {
     struct statvfs64 statvfsbuf;
     char textbuf[128];
-    long lres;
     
-    assert(ai);
-    assert(wb);
-
-    if (wb->size == 0)
-    {   errprintf("wb->size=%ld\n", (long)wb->size);
-        return -1;
+    errprintf("write(size=%ld) returned %ld\n", (long)size, (long)lres);
+    if ((lres==0) || (errno==ENOSPC)) // probably "no space left"
+    {
+        if (fstatvfs64(fd, &statvfsbuf)!=0)
+        {   sysprintf("fstatvfs(fd=%d) failed\n", fd);
+            return;
+        }
+        
+        u64 freebytes = statvfsbuf.f_bfree * statvfsbuf.f_bsize;
+        errprintf("Can't write to the archive file. Space on device is %s. \n"
+            "If the archive is being written to a FAT filesystem, you may have reached \n"
+            "the maximum filesize that it can handle (in general 2 GB)\n", 
+            format_size(freebytes, textbuf, sizeof(textbuf), 'h'));
     }
+    else // another error
+    {
+        sysprintf("write(size=%ld) failed\n", (long)size);
+    }
+}
 
-    if ((lres=write(ai->archfd, (char*)wb->data, (long)wb->size))!=(long)wb->size)
+// write the same data in each copy of the archive (items are copied in iov since writev() may be incomplete)
+static int archwriter_tee_write(carchwriter *ai, struct iovec *items, int itemcount)
+{
+    struct iovec iov[FSA_WRITER_MAXIOV];
+    struct iovec *cur;
+    struct s_tee *tee;
+    u64 remaining;
+    int count;
+    long lres;
+    int i;
+    
+    for (i=0; i < ai->teecount; i++)
     {
-        errprintf("write(size=%ld) returned %ld\n", (long)wb->size, (long)lres);
-        if ((lres>0) && (lres < (long)wb->size)) // probably "no space left"
+        tee=&ai->tees[i];
+        if (tee->fd<0)
+            continue;
+        memcpy(iov, items, itemcount*sizeof(struct iovec));
+        for (remaining=0, count=0; count < itemcount; count++)
+            remaining+=iov[count].iov_len;
+        
+        cur=iov;
+        while (count>0)
         {
-            if (fstatvfs64(ai->archfd, &statvfsbuf)!=0)
-            {   sysprintf("fstatvfs(fd=%d) failed\n", ai->archfd);
-                return -1;
+            if ((lres=writev(tee->fd, cur, count))<=0)
+            {   archwriter_write_error(tee->fd, lres, remaining);
+                if (archwriter_tee_failed(tee)!=0)
+                    return -1;
+                break;
             }
+            remaining-=lres;
             
-            u64 freebytes = statvfsbuf.f_bfree * statvfsbuf.f_bsize;
-            errprintf("Can't write to the archive file. Space on device is %s. \n"
-                "If the archive is being written to a FAT filesystem, you may have reached \n"
-                "the maximum filesize that it can handle (in general 2 GB)\n", 
-                format_size(freebytes, textbuf, sizeof(textbuf), 'h'));
+            // skip the items which have been written and retry with the rest
+            while ((count>0) && ((u64)lres >= cur->iov_len))
+            {   lres-=cur->iov_len;
+                cur++;
+                count--;
+            }
+            if (count>0)
+            {   cur->iov_base=(char*)cur->iov_base+lres;
+                cur->iov_len-=lres;
+            }
+        }
+    }
+    return 0;
+}
+
+// write the batch with the system calls, starting after the first done bytes
+// (done>0 when an asynchronous write has been incomplete: the offset is then given explicitly)
+static int archwriter_write_batch(carchwriter *ai, struct s_writebatch *b, u64 done)
+{
+    struct iovec *iov;
+    int iovcount;
+    long lres;
+    
+    iov=b->iov;
+    iovcount=b->iovcount;
+    lres=done;
+    do
+    {
+        // skip the buffers which have been written and retry with the rest
+        while ((iovcount>0) && ((u64)lres >= iov->iov_len))
+        {   lres-=iov->iov_len;
+            iov++;
+            iovcount--;
+        }
+        if (iovcount==0)
+            break;
+        iov->iov_base=(char*)iov->iov_base+lres;
+        iov->iov_len-=lres;
+        
+        if (b->inflight==true)
+            lres=pwritev(ai->archfd, iov, iovcount, b->offset+done);
+        else
+            lres=writev(ai->archfd, iov, iovcount);
+        if (lres<=0)
+        {   archwriter_write_error(ai->archfd, lres, b->iovbytes-done);
             return -1;
         }
-        else // another error
-        {
-            sysprintf("write(size=%ld) failed\n", (long)wb->size);
+        done+=lres;
+    } while (iovcount>0);
+    
+    return 0;
+}
+
+#ifdef OPTION_URING_SUPPORT
+// wait until one of the batches written by io_uring is complete
+static int archwriter_wait_batch(carchwriter *ai)
+{
+    struct s_writebatch *b;
+    u64 index;
+    s32 res;
+    int ret=0;
+    
+    if (uring_wait(ai->uring, &index, &res)!=0)
+        return -1;
+    
+    b=&ai->batch[index];
+    if (res<0)
+    {   errno=-res;
+        archwriter_write_error(ai->archfd, -1, b->iovbytes);
+        ret=-1;
+    }
+    else if ((u64)res < b->iovbytes) // incomplete write: write the rest synchronously
+    {   ret=archwriter_write_batch(ai, b, res);
+    }
+    
+    archwriter_release_batch(b);
+    return ret;
+}
+
+// send the current batch to io_uring, returns as soon as a batch is available for the next items
+static int archwriter_submit_batch(carchwriter *ai)
+{
+    struct s_writebatch *b=&ai->batch[ai->curbatch];
+    int res;
+    
+    // a batch which only contains headers is in a registered buffer
+    if ((ai->uringfixed==true) && (b->iovcount==1) && (b->iov[0].iov_base==b->stagebuf))
+        res=uring_prep_write_fixed(ai->uring, ai->archfd, b->stagebuf, b->iovbytes, b->offset, ai->curbatch, ai->curbatch);
+    else
+        res=uring_prep_writev(ai->uring, ai->archfd, b->iov, b->iovcount, b->offset, ai->curbatch);
+    if ((res!=0) || (uring_submit(ai->uring)!=0))
+    {   archwriter_release_batch(b);
+        return -1;
+    }
+    b->inflight=true;
+    
+    ai->curbatch=(ai->curbatch+1) % FSA_WRITER_MAXBATCH;
+    while (ai->batch[ai->curbatch].inflight==true)
+    {   if (archwriter_wait_batch(ai)!=0)
+            return -1;
+    }
+    return 0;
+}
+#endif // OPTION_URING_SUPPORT
+
+// O_DIRECT: write the aligned part of directbuf and keep the tail at the beginning of the buffer
+static int archwriter_write_direct(carchwriter *ai)
+{
+    struct iovec iov;
+    u64 size;
+    u64 done;
+    long lres;
+    
+    size=ai->directused & ~((u64)FSA_WRITER_DIRECTALIGN-1);
+    iov.iov_base=ai->directbuf;
+    iov.iov_len=size;
+    if ((ai->teecount>0) && (size>0) && (archwriter_tee_write(ai, &iov, 1)!=0))
+        return -1;
+    for (done=0; done < size; done+=lres)
+    {
+        if ((lres=write(ai->archfd, ai->directbuf+done, size-done))<=0)
+        {   archwriter_write_error(ai->archfd, lres, size-done);
             return -1;
         }
     }
     
+    memmove(ai->directbuf, ai->directbuf+size, ai->directused-size);
+    ai->directused-=size;
     return 0;
 }
 
+// O_DIRECT: the tail is not aligned, so it is written without O_DIRECT when the volume is closed
+static int archwriter_write_direct_tail(carchwriter *ai)
+{
+    struct iovec iov;
+    long flags;
+    long lres;
+    u64 done;
+    
+    if (ai->directused==0)
+        return 0;
+    
+    iov.iov_base=ai->directbuf;
+    iov.iov_len=ai->directused;
+    if ((ai->teecount>0) && (archwriter_tee_write(ai, &iov, 1)!=0))
+        return -1;
+    
+    if (((flags=fcntl(ai->archfd, F_GETFL))<0) || (fcntl(ai->archfd, F_SETFL, flags&~O_DIRECT)!=0))
+    {   sysprintf("cannot clear O_DIRECT on %s\n", ai->volpath);
+        return -1;
+    }
+    for (done=0; done < ai->directused; done+=lres)
+    {
+        if ((lres=write(ai->archfd, ai->directbuf+done, ai->directused-done))<=0)
+        {   archwriter_write_error(ai->archfd, lres, ai->directused-done);
+            return -1;
+        }
+    }
+    
+    ai->directused=0;
+    return 0;
+}
+
+// O_DIRECT: copy the data in directbuf, so data and tofree are not needed after this call
+static int archwriter_add_direct(carchwriter *ai, char *data, u64 size, char *tofree)
+{
+    u64 len;
+    int res=0;
+    
+    while ((size>0) && (res==0))
+    {
+        len=min(size, FSA_WRITER_BATCHSIZE-ai->directused);
+        memcpy(ai->directbuf+ai->directused, data, len);
+        ai->directused+=len;
+        ai->curpos+=len;
+        data+=len;
+        size-=len;
+        if (ai->directused==FSA_WRITER_BATCHSIZE)
+            res=archwriter_write_direct(ai);
+    }
+    
+    blkbuf_free(tofree);
+    return res;
+}
+
+// write all the pending data with as few system calls as possible
+int archwriter_flush(carchwriter *ai)
+{
+    struct s_writebatch *b;
+    int res;
+    
+    assert(ai);
+    
+    if (ai->directio==true)
+        return archwriter_write_direct(ai);
+    
+    b=&ai->batch[ai->curbatch];
+    if (b->iovcount==0)
+        return 0;
+    b->offset=ai->curpos-b->iovbytes;
+    
+    if ((ai->teecount>0) && (archwriter_tee_write(ai, b->iov, b->iovcount)!=0))
+    {   archwriter_release_batch(b);
+        return -1;
+    }
+    
+#ifdef OPTION_URING_SUPPORT
+    if (ai->uring!=NULL)
+        res=archwriter_submit_batch(ai);
+    else
+#endif // OPTION_URING_SUPPORT
+    {   res=archwriter_write_batch(ai, b, 0);
+        archwriter_release_batch(b);
+    }
+    
+    archwriter_write_behind(ai);
+    return res;
+}
+
+// write the pending data and wait until all the batches have been written
+static int archwriter_flush_all(carchwriter *ai)
+{
+    int res;
+    
+    res=archwriter_flush(ai);
+#ifdef OPTION_URING_SUPPORT
+    while ((ai->uring!=NULL) && (uring_get_inflight(ai->uring)>0))
+    {   if (archwriter_wait_batch(ai)!=0)
+            res=-1;
+    }
+#endif // OPTION_URING_SUPPORT
+    return res;
+}
+
+bool archwriter_has_pending(carchwriter *ai)
+{
+    assert(ai);
+    if (ai->directio==true)
+        return (ai->directused>=FSA_WRITER_DIRECTALIGN);
+    return (ai->batch[ai->curbatch].iovcount>0);
+}
+
+// add data to the current batch: the data are not copied so they must not be
+// modified before they are written, tofree is released after it has been written
+static int archwriter_add_pending(carchwriter *ai, char *data, u64 size, char *tofree)
+{
+    struct s_writebatch *b=&ai->batch[ai->curbatch];
+    struct iovec *last;
+    
+    if (ai->directio==true)
+        return archwriter_add_direct(ai, data, size, tofree);
+    
+    if ((b->iovcount>=FSA_WRITER_MAXIOV) || (b->pendcount>=FSA_WRITER_MAXIOV))
+    {   if (archwriter_flush(ai)!=0)
+        {   blkbuf_free(tofree);
+            return -1;
+        }
+        b=&ai->batch[ai->curbatch];
+    }
+    
+    // merge the data with the previous buffer when they are contiguous (headers in stagebuf)
+    last=(b->iovcount>0)?&b->iov[b->iovcount-1]:NULL;
+    if ((last!=NULL) && ((char*)last->iov_base+last->iov_len==data))
+        last->iov_len+=size;
+    else
+    {   b->iov[b->iovcount].iov_base=data;
+        b->iov[b->iovcount].iov_len=size;
+        b->iovcount++;
+    }
+    if (tofree!=NULL)
+        b->pendfree[b->pendcount++]=tofree;
+    b->iovbytes+=size;
+    ai->curpos+=size;
+    
+    if (b->iovbytes>=FSA_WRITER_BATCHSIZE)
+        return archwriter_flush(ai);
+    return 0;
+}
+
+// the contents of wb are copied so that it can be destroyed after this call
+int archwriter_write_buffer(carchwriter *ai, struct s_writebuf *wb)
+{
+    struct s_writebatch *b;
+    char *data;
+    
+    assert(ai);
+    assert(wb);
+
+    if (wb->size == 0)
+    {   errprintf("wb->size=%ld\n", (long)wb->size);
+        return -1;
+    }
+    
+    if (ai->directio==true)
+        return archwriter_add_direct(ai, wb->data, wb->size, NULL);
+    
+    b=&ai->batch[ai->curbatch];
+    if ((b->stagebuf!=NULL) && (b->stageused+wb->size > FSA_WRITER_STAGESIZE))
+    {   if (archwriter_flush(ai)!=0)
+            return -1;
+        b=&ai->batch[ai->curbatch];
+    }
+    
+    if ((b->stagebuf==NULL) || (wb->size > FSA_WRITER_STAGESIZE)) // too big: write it now
+    {   if ((archwriter_flush(ai)!=0) || (archwriter_add_pending(ai, wb->data, wb->size, NULL)!=0))
+            return -1;
+        return archwriter_flush_all(ai);
+    }
+    
+    data=b->stagebuf+b->stageused;
+    memcpy(data, wb->data, wb->size);
+    b->stageused+=wb->size;
+    return archwriter_add_pending(ai, data, wb->size, NULL);
+}
+
 int archwriter_volpath(carchwriter *ai)
 {
     int res;
+    if (ai->stream==true)
+    {   snprintf(ai->volpath, PATH_MAX, "%s", ai->basepath);
+        return 0;
+    }
     res=get_path_to_volume(ai->volpath, PATH_MAX, ai->basepath, ai->curvol);
     return res;
 }
 
 int archwriter_is_path_to_curvol(carchwriter *ai, char *path)
 {
+    int i;
+    
     assert(ai);
     assert(path);
+    
+    // the copies of the archive must not be saved either
+    for (i=0; i < ai->teecount; i++)
+        if (strncmp(ai->tees[i].volpath, path, PATH_MAX)==0)
+            return true;
     return strncmp(ai->volpath, path, PATH_MAX)==0 ? true : false;
 }
 
@@ -354,7 +1154,10 @@ int archwriter_split_if_necessary(carchwriter *ai, struct s_writebuf *wb)
         {   msgprintf(MSG_STACK, "cannot write volume footer: archio_write_volfooter() failed\n");
             return -1;
         }
-        archwriter_close(ai);
+        if (archwriter_close_volume(ai, true)!=0)
+        {   msgprintf(MSG_STACK, "cannot complete the volume: archwriter_close_volume() failed\n");
+            return -1;
+        }
         archwriter_incvolume(ai, false);
         msgprintf(MSG_VERB2, "Creating new volume: [%s]\n", ai->volpath);
         if (archwriter_create(ai)!=0)
@@ -369,33 +1172,63 @@ int archwriter_split_if_necessary(carchwriter *ai, struct s_writebuf *wb)
     return 0;
 }
 
+// the block is released by the archwriter once it has been written (even if there is an error)
 int archwriter_dowrite_block(carchwriter *ai, struct s_blockinfo *blkinfo)
 {
     struct s_writebuf *wb=NULL;
+    struct s_writebuf frame;
     
     assert(ai);
 
     if ((wb=writebuf_alloc())==NULL)
     {   errprintf("writebuf_alloc() failed\n");
+        blkbuf_free(blkinfo->blkdata);
         return -1;
     }
     
-    if (writebuf_add_block(wb, blkinfo, ai->archid, blkinfo->blkfsid)!=0)
-    {   msgprintf(MSG_STACK, "archio_write_block() failed\n");
+    if (writebuf_add_block_header(wb, blkinfo, ai->archid, blkinfo->blkfsid)!=0)
+    {   msgprintf(MSG_STACK, "writebuf_add_block_header() failed\n");
+        writebuf_destroy(wb);
+        blkbuf_free(blkinfo->blkdata);
         return -1;
     }
     
-    if (archwriter_split_if_necessary(ai, wb)!=0)
+    // the split check only needs the size of the header and the data
+    frame.data=NULL;
+    frame.size=wb->size+blkinfo->blkarsize;
+    if (archwriter_split_if_necessary(ai, &frame)!=0)
     {   msgprintf(MSG_STACK, "archwriter_split_if_necessary() failed\n");
+        writebuf_destroy(wb);
+        blkbuf_free(blkinfo->blkdata);
         return -1;
     }
     
-    if (archwriter_write_buffer(ai, wb)!=0)
-    {   msgprintf(MSG_STACK, "archwriter_write_buffer() failed\n");
+    // the blocks are allocated with some free space before the data where the header is copied,
+    // so that the header and the data are written together without copying the data; a header
+    // which does not fit in this space is copied in the write buffer and written before the data
+    if (wb->size > BLKBUF_HEADROOM)
+    {   msgprintf(MSG_DEBUG1, "block header is bigger than the headroom: size=%ld\n", (long)wb->size);
+        if (archwriter_write_buffer(ai, wb)!=0)
+        {   msgprintf(MSG_STACK, "archwriter_write_buffer() failed\n");
+            writebuf_destroy(wb);
+            blkbuf_free(blkinfo->blkdata);
+            return -1;
+        }
+        frame.data=blkinfo->blkdata;
+        frame.size=blkinfo->blkarsize;
+    }
+    else
+    {   frame.data=blkinfo->blkdata-wb->size;
+        memcpy(frame.data, wb->data, wb->size);
+    }
+    writebuf_destroy(wb);
+    
+    // the block stays in memory until the pending data are written
+    if (archwriter_add_pending(ai, frame.data, frame.size, blkinfo->blkdata)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_add_pending() failed\n");
         return -1;
     }
 
-    writebuf_destroy(wb);
     return 0;
 }
 
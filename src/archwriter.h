@@ -19,12 +19,50 @@
 #define __ARCHWRITER_H__
 
 #include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "strlist.h"
 
 struct s_writebuf;
 struct s_blockinfo;
 struct s_headinfo;
 struct s_strlist;
+struct s_uring;
+
+// pending data which are written together with a single writev()
+struct s_writebatch
+{   struct iovec iov[FSA_WRITER_MAXIOV]; // buffers to write
+    int    iovcount; // how many items there are in iov
+    u64    iovbytes; // how many bytes there are in iov
+    char   *stagebuf; // copy of the headers (aligned buffer of FSA_WRITER_STAGESIZE bytes)
+    u64    stageused; // how many bytes of stagebuf are used
+    char   *pendfree[FSA_WRITER_MAXIOV]; // blocks to release when the batch has been written
+    int    pendcount; // how many items there are in pendfree
+    u64    offset; // where the batch is written in the volume
+    bool   inflight; // true while an io_uring request is writing the batch
+};
+
+// the next volume is created by a separate thread while the current one is written
+struct s_volprep
+{   pthread_t thread; // thread which closes the previous volume and creates the next one
+    bool   started; // true when the thread has been started and has not been joined yet
+    int    oldfd; // previous volume which the thread has to sync and close (-1 if none)
+    int    fd; // next volume created by the thread (-1 if it has not been created)
+    bool   directio; // true if the next volume has been opened with O_DIRECT
+    bool   prealloc; // true if the space of the next volume has been reserved with fallocate()
+    bool   failed; // true if the previous volume could not be synced or closed
+    char   path[PATH_MAX]; // path of the next volume (empty when it is not created in advance)
+};
+
+// copy of the archive which is written to another path at the same time
+struct s_tee
+{   int    fd; // file descriptor of the current volume of the copy (set to -1 when closed)
+    bool   optional; // true if the archive is still written when the copy fails
+    bool   failed; // true when the copy has failed and is not written anymore
+    char   basepath[PATH_MAX]; // path of the first volume of the copy
+    char   volpath[PATH_MAX]; // path of the current volume of the copy
+    cstrlist vollist; // paths to all volumes of the copy
+};
 
 struct s_archwriter;
 typedef struct s_archwriter carchwriter;
@@ -40,6 +78,22 @@ struct s_archwriter
     char   basepath[PATH_MAX]; // path of the first volume of an archive
     char   volpath[PATH_MAX]; // path of the current volume of an archive
     cstrlist vollist; // paths to all volumes of an archive
+    u64    curpos; // offset in the current volume where the next item will be (including the pending data)
+    u64    syncpos; // offset up to which the kernel has been asked to write the volume to the disk
+    bool   syncrange; // false when sync_file_range() is not supported on that volume
+    struct s_writebatch batch[FSA_WRITER_MAXBATCH]; // only batch[curbatch] is used when io_uring is not used
+    int    curbatch; // batch where the new items are added
+    struct s_uring *uring; // used to write several batches at the same time (NULL if not used)
+    bool   uringfixed; // true if the staging buffers have been registered in io_uring
+    bool   directio; // true if the current volume has been opened with O_DIRECT
+    char   *directbuf; // aligned buffer where the data are copied before they are written with O_DIRECT
+    u64    directused; // how many bytes of directbuf are used
+    bool   prealloc; // true if the space of the current volume has been reserved with fallocate()
+    int    closefd; // volume which has been completed and which is closed by the next volprep thread
+    struct s_volprep volprep; // creation of the next volume when the archive is split
+    struct s_tee *tees; // copies of the archive given with --tee and --tee-optional (NULL if not used)
+    int    teecount; // how many items there are in tees
+    bool   stream; // true when the archive is written to stdout (one volume, which is not seekable)
 };
 
 int archwriter_init(carchwriter *ai);
@@ -51,6 +105,8 @@ int archwriter_generate_id(carchwriter *ai);
 s64 archwriter_get_currentpos(carchwriter *ai);
 int archwriter_is_path_to_curvol(carchwriter *ai, char *path);
 int archwriter_write_buffer(carchwriter *ai, struct s_writebuf *wb);
+int archwriter_flush(carchwriter *ai);
+bool archwriter_has_pending(carchwriter *ai);
 int archwriter_incvolume(carchwriter *ai, bool waitkeypress);
 int archwriter_volpath(carchwriter *ai);
 int archwriter_write_volheader(carchwriter *ai);
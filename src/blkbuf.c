@@ -0,0 +1,541 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef OPTION_NUMA_SUPPORT
+#include <numa.h>
+#endif // OPTION_NUMA_SUPPORT
+
+#include "fsarchiver.h"
+#include "blkbuf.h"
+#include "queue.h"
+#include "error.h"
+
+// buffers are taken from a pool with size classes from 4KB to 2MB (four classes per power of two)
+#define BLKBUF_MINSHIFT     12
+#define BLKBUF_MAXSHIFT     21
+#define BLKBUF_CLASSES      (4*(BLKBUF_MAXSHIFT-BLKBUF_MINSHIFT)+1)
+#define BLKBUF_MAGSIZE      8                   // buffers cached by each thread for each size class
+#define BLKBUF_FREERATIO    4                   // the free buffers kept in the pool use at most 1/4 of the queue memory
+#define BLKBUF_CHUNKSIZE    (1LL<<BLKBUF_MAXSHIFT) // huge page: buffers are carved in chunks of that size
+
+enum {BLKBUF_FLAG_NUMA=1, BLKBUF_FLAG_CHUNK=2};
+
+// every buffer starts with this header so that blkbuf_free() knows how it has been allocated,
+// it is followed by BLKBUF_HEADROOM free bytes and by the data
+struct s_blkbufhead
+{   u64    size; // size of the allocation including this header
+    s16    node; // numa node where the memory has been allocated (-1 if not bound to a node)
+    s16    sclass; // size class in the pool (-1 if the buffer is not pooled)
+    u16    flags; // how the memory has been allocated (BLKBUF_FLAG_xxx)
+    u16    padding; // keeps the data aligned on 16 bytes
+};
+
+// buffers which are free are kept in the depot of their size class and node (linked through their data)
+struct s_blkbufdepot
+{   pthread_mutex_t  mutex;
+    char             *first;
+    u64              count;
+};
+
+// each thread keeps a few free buffers per size class so that most allocations take no lock
+struct s_blkbufmag
+{   int              count;
+    char             *bufs[BLKBUF_MAGSIZE];
+};
+
+// huge pages used to carve the buffers (one current chunk per node)
+struct s_blkbufchunk
+{   char             *data;
+    u64              used;
+};
+
+static int g_blkbufnodes=0; // number of numa nodes used (0 when numa is not used)
+static atomic_t g_blkbufnextnode={ (0) };
+
+static bool g_blkbufpool=false; // true when blkbuf_init_pool() has been called
+static bool g_blkbufhuge=false; // true when the buffers are carved in huge pages
+static u64 g_blkbufmaxbytes=0; // memory of the queue: limits the huge pages and the free buffers of the depots
+static u64 g_blkbuffreebytes=0; // size of the free buffers kept by the threads and the depots (except the huge pages)
+static struct s_blkbufdepot *g_blkbufdepot=NULL; // [BLKBUF_CLASSES * (g_blkbufnodes+1)]
+static struct s_blkbufchunk *g_blkbufchunk=NULL; // [g_blkbufnodes+1]
+static pthread_mutex_t g_blkbufchunkmutex=PTHREAD_MUTEX_INITIALIZER;
+static char **g_blkbufchunklist=NULL; // all the chunks allocated (released in blkbuf_destroy_pool)
+static int g_blkbufchunkcount=0;
+static pthread_key_t g_blkbufmagkey;
+
+static __thread struct s_blkbufmag g_blkbufmag[BLKBUF_CLASSES];
+static __thread bool g_blkbufmagused=false;
+
+#define BLKBUF_OVERHEAD     (sizeof(struct s_blkbufhead)+BLKBUF_HEADROOM)
+
+static inline struct s_blkbufhead *blkbuf_get_head(char *buf)
+{
+    return (struct s_blkbufhead *)(buf-BLKBUF_OVERHEAD);
+}
+
+static inline char *blkbuf_get_data(struct s_blkbufhead *head)
+{
+    return ((char*)head)+BLKBUF_OVERHEAD;
+}
+
+// size of the buffers of a class: 4KB, 5KB, 6KB, 7KB, 8KB, 10KB, ... 2MB
+static inline u64 blkbuf_class_size(int sclass)
+{
+    return ((u64)(4+(sclass%4)))<<(BLKBUF_MINSHIFT-2+(sclass/4));
+}
+
+// enable the allocation of the data blocks on numa nodes, returns the number of nodes
+int blkbuf_init_numa(void)
+{
+#ifdef OPTION_NUMA_SUPPORT
+    if (numa_available()<0)
+    {   errprintf("numa is not available on this system: option --numa ignored\n");
+        g_blkbufnodes=0;
+        return 1;
+    }
+    g_blkbufnodes=max(numa_num_configured_nodes(), 1);
+    msgprintf(MSG_VERB2, "numa support enabled with %d nodes\n", g_blkbufnodes);
+    return g_blkbufnodes;
+#else
+    errprintf("numa support has been disabled at compilation time: option --numa ignored\n");
+    return 1;
+#endif // OPTION_NUMA_SUPPORT
+}
+
+int blkbuf_get_numnodes(void)
+{
+    return g_blkbufnodes;
+}
+
+// node where the next block will be allocated: nodes are used in turn so that all the threads get work
+int blkbuf_pick_node(void)
+{
+    if (g_blkbufnodes<1)
+        return -1;
+    return (__sync_fetch_and_add(&g_blkbufnextnode.counter, 1) & 0x7fffffff) % g_blkbufnodes;
+}
+
+// run the current thread on a node and allocate its memory there
+int blkbuf_bind_thread(int node)
+{
+#ifdef OPTION_NUMA_SUPPORT
+    if ((g_blkbufnodes<1) || (node<0))
+        return 0;
+    if (numa_run_on_node(node)!=0)
+    {   sysprintf("numa_run_on_node(%d) failed\n", node);
+        return -1;
+    }
+    numa_set_preferred(node);
+#endif // OPTION_NUMA_SUPPORT
+    return 0;
+}
+
+// ---- low level allocations
+
+static inline int blkbuf_node_slot(int node)
+{
+    return ((g_blkbufnodes>0) && (node>=0))?(node % g_blkbufnodes):g_blkbufnodes;
+}
+
+static inline struct s_blkbufdepot *blkbuf_get_depot(int sclass, int node)
+{
+    return &g_blkbufdepot[(sclass*(g_blkbufnodes+1))+blkbuf_node_slot(node)];
+}
+
+// carve a buffer in a huge page of the node (runs with g_blkbufchunkmutex locked)
+static struct s_blkbufhead *blkbuf_chunk_carve(u64 size, int node)
+{
+    struct s_blkbufchunk *chunk=&g_blkbufchunk[blkbuf_node_slot(node)];
+    char **newlist;
+    void *data;
+    
+    if ((chunk->data==NULL) || (chunk->used+size > BLKBUF_CHUNKSIZE))
+    {
+        // the huge pages are never released before the end: the other buffers are allocated normally
+        if ((u64)(g_blkbufchunkcount+1)*BLKBUF_CHUNKSIZE > g_blkbufmaxbytes)
+            return NULL;
+        if ((newlist=realloc(g_blkbufchunklist, (g_blkbufchunkcount+1)*sizeof(char*)))==NULL)
+            return NULL;
+        g_blkbufchunklist=newlist;
+        
+        // explicit huge pages if the system has some reserved, else transparent huge pages
+        data=mmap(NULL, BLKBUF_CHUNKSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (data==MAP_FAILED)
+        {   data=mmap(NULL, 2*BLKBUF_CHUNKSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if (data==MAP_FAILED)
+                return NULL;
+            // keep an aligned part of the mapping so that the kernel can use a huge page
+            u64 offset=(BLKBUF_CHUNKSIZE-((unsigned long)data & (BLKBUF_CHUNKSIZE-1))) & (BLKBUF_CHUNKSIZE-1);
+            if (offset>0)
+                munmap(data, offset);
+            munmap((char*)data+offset+BLKBUF_CHUNKSIZE, BLKBUF_CHUNKSIZE-offset);
+            data=(char*)data+offset;
+#ifdef MADV_HUGEPAGE
+            madvise(data, BLKBUF_CHUNKSIZE, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+        }
+#ifdef OPTION_NUMA_SUPPORT
+        if ((g_blkbufnodes>0) && (node>=0))
+            numa_tonode_memory(data, BLKBUF_CHUNKSIZE, node % g_blkbufnodes);
+#endif // OPTION_NUMA_SUPPORT
+        g_blkbufchunklist[g_blkbufchunkcount++]=data;
+        chunk->data=data;
+        chunk->used=0;
+    }
+    
+    data=chunk->data+chunk->used;
+    chunk->used+=size;
+    return (struct s_blkbufhead *)data;
+}
+
+// allocate new memory: size includes the header
+static struct s_blkbufhead *blkbuf_sys_alloc(u64 size, int node, bool pooled)
+{
+    struct s_blkbufhead *head=NULL;
+    u16 flags=0;
+    
+    if (pooled && g_blkbufhuge)
+    {   assert(pthread_mutex_lock(&g_blkbufchunkmutex)==0);
+        if ((head=blkbuf_chunk_carve(size, node))!=NULL)
+            flags=BLKBUF_FLAG_CHUNK;
+        assert(pthread_mutex_unlock(&g_blkbufchunkmutex)==0);
+    }
+#ifdef OPTION_NUMA_SUPPORT
+    if ((head==NULL) && (g_blkbufnodes>0) && (node>=0))
+    {   if ((head=numa_alloc_onnode(size, node % g_blkbufnodes))!=NULL)
+            flags=BLKBUF_FLAG_NUMA;
+    }
+#endif // OPTION_NUMA_SUPPORT
+    if ((head==NULL) && ((head=malloc(size))==NULL))
+        return NULL;
+    
+    head->size=size;
+    head->node=((g_blkbufnodes>0) && (node>=0))?(node % g_blkbufnodes):-1;
+    head->sclass=-1;
+    head->flags=flags;
+    return head;
+}
+
+static void blkbuf_sys_free(struct s_blkbufhead *head)
+{
+    if (head->flags & BLKBUF_FLAG_CHUNK)
+        return; // huge pages are released by blkbuf_destroy_pool()
+#ifdef OPTION_NUMA_SUPPORT
+    if (head->flags & BLKBUF_FLAG_NUMA)
+    {   numa_free(head, head->size);
+        return;
+    }
+#endif // OPTION_NUMA_SUPPORT
+    free(head);
+}
+
+// ---- pool of buffers
+
+// give a free buffer back to the depot of its size class and node
+static void blkbuf_depot_put(struct s_blkbufhead *head)
+{
+    struct s_blkbufdepot *depot=blkbuf_get_depot(head->sclass, head->node);
+    
+    assert(pthread_mutex_lock(&depot->mutex)==0);
+    *(char**)blkbuf_get_data(head)=depot->first;
+    depot->first=(char*)head;
+    depot->count++;
+    assert(pthread_mutex_unlock(&depot->mutex)==0);
+}
+
+static struct s_blkbufhead *blkbuf_depot_get(int sclass, int node)
+{
+    struct s_blkbufdepot *depot=blkbuf_get_depot(sclass, node);
+    struct s_blkbufhead *head=NULL;
+    
+    assert(pthread_mutex_lock(&depot->mutex)==0);
+    if (depot->first!=NULL)
+    {   head=(struct s_blkbufhead *)depot->first;
+        depot->first=*(char**)blkbuf_get_data(head);
+        depot->count--;
+    }
+    assert(pthread_mutex_unlock(&depot->mutex)==0);
+    return head;
+}
+
+// give the buffers cached by the current thread back to the depots
+static void blkbuf_mag_flush(void)
+{
+    struct s_blkbufmag *mag;
+    int i;
+    
+    for (i=0; i < BLKBUF_CLASSES; i++)
+    {
+        mag=&g_blkbufmag[i];
+        while (mag->count>0)
+            blkbuf_depot_put((struct s_blkbufhead *)mag->bufs[--mag->count]);
+    }
+}
+
+// called when a thread which used the pool exits
+static void blkbuf_mag_destructor(void *arg)
+{
+    blkbuf_mag_flush();
+}
+
+// must be called before the threads which use the buffers are created, maxbytes is the memory of the queue
+int blkbuf_init_pool(bool hugepages, u64 maxbytes)
+{
+    int count;
+    int i;
+    
+    if (g_blkbufpool==true)
+        return 0;
+    
+    count=BLKBUF_CLASSES*(g_blkbufnodes+1);
+    if ((g_blkbufdepot=calloc(count, sizeof(struct s_blkbufdepot)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)(count*sizeof(struct s_blkbufdepot)));
+        return -1;
+    }
+    for (i=0; i < count; i++)
+        assert(pthread_mutex_init(&g_blkbufdepot[i].mutex, NULL)==0);
+    if ((g_blkbufchunk=calloc(g_blkbufnodes+1, sizeof(struct s_blkbufchunk)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)((g_blkbufnodes+1)*sizeof(struct s_blkbufchunk)));
+        free(g_blkbufdepot);
+        return -1;
+    }
+    assert(pthread_key_create(&g_blkbufmagkey, blkbuf_mag_destructor)==0);
+    
+    g_blkbufhuge=hugepages;
+    g_blkbufmaxbytes=maxbytes;
+    g_blkbuffreebytes=0;
+    g_blkbufpool=true;
+    return 0;
+}
+
+// release the memory kept in the pool: all the other threads must have exited
+int blkbuf_destroy_pool(void)
+{
+    struct s_blkbufhead *head;
+    int count;
+    int i;
+    
+    if (g_blkbufpool==false)
+        return 0;
+    
+    blkbuf_mag_flush();
+    g_blkbufmagused=false;
+    g_blkbufpool=false;
+    
+    count=BLKBUF_CLASSES*(g_blkbufnodes+1);
+    for (i=0; i < count; i++)
+    {
+        while ((head=(struct s_blkbufhead *)g_blkbufdepot[i].first)!=NULL)
+        {   g_blkbufdepot[i].first=*(char**)blkbuf_get_data(head);
+            blkbuf_sys_free(head);
+        }
+        assert(pthread_mutex_destroy(&g_blkbufdepot[i].mutex)==0);
+    }
+    for (i=0; i < g_blkbufchunkcount; i++)
+        munmap(g_blkbufchunklist[i], BLKBUF_CHUNKSIZE);
+    
+    free(g_blkbufchunklist);
+    g_blkbufchunklist=NULL;
+    g_blkbufchunkcount=0;
+    free(g_blkbufchunk);
+    g_blkbufchunk=NULL;
+    free(g_blkbufdepot);
+    g_blkbufdepot=NULL;
+    pthread_key_delete(g_blkbufmagkey);
+    return 0;
+}
+
+char *blkbuf_alloc(u64 size, int node)
+{
+    struct s_blkbufhead *head=NULL;
+    struct s_blkbufmag *mag;
+    u64 allocsize=size+BLKBUF_OVERHEAD;
+    int sclass;
+    int i;
+    
+    // big buffers and buffers allocated when the pool is not used are not pooled
+    if ((g_blkbufpool==false) || (allocsize > (1LL<<BLKBUF_MAXSHIFT)))
+    {   if ((head=blkbuf_sys_alloc(allocsize, node, false))==NULL)
+            return NULL;
+        return blkbuf_get_data(head);
+    }
+    
+    for (sclass=0; blkbuf_class_size(sclass) < allocsize; sclass++);
+    if (g_blkbufnodes<1)
+        node=-1;
+    else if (node>=0)
+        node%=g_blkbufnodes;
+    
+    // first look in the buffers cached by this thread, then in the depot
+    mag=&g_blkbufmag[sclass];
+    for (i=mag->count-1; (head==NULL) && (i>=0); i--)
+    {
+        if (((struct s_blkbufhead *)mag->bufs[i])->node==node)
+        {   head=(struct s_blkbufhead *)mag->bufs[i];
+            mag->bufs[i]=mag->bufs[--mag->count];
+        }
+    }
+    if ((head==NULL) && ((head=blkbuf_depot_get(sclass, node))==NULL))
+    {   if ((head=blkbuf_sys_alloc(blkbuf_class_size(sclass), node, true))==NULL)
+            return NULL;
+        head->sclass=sclass;
+    }
+    else if (!(head->flags & BLKBUF_FLAG_CHUNK))
+    {   __sync_sub_and_fetch(&g_blkbuffreebytes, head->size);
+    }
+    
+    return blkbuf_get_data(head);
+}
+
+void blkbuf_free(char *buf)
+{
+    struct s_blkbufhead *head;
+    struct s_blkbufmag *mag;
+    
+    if (buf==NULL)
+        return;
+    
+    head=blkbuf_get_head(buf);
+    if ((head->sclass<0) || (g_blkbufpool==false))
+    {   blkbuf_sys_free(head);
+        return;
+    }
+    
+    // the free buffers are limited globally, whatever their size class: the huge pages are kept anyway
+    if (!(head->flags & BLKBUF_FLAG_CHUNK) && 
+        (__sync_add_and_fetch(&g_blkbuffreebytes, head->size) > g_blkbufmaxbytes/BLKBUF_FREERATIO))
+    {   __sync_sub_and_fetch(&g_blkbuffreebytes, head->size);
+        blkbuf_sys_free(head);
+        return;
+    }
+    
+    // the destructor will give the cached buffers back when this thread exits
+    if (g_blkbufmagused==false)
+    {   pthread_setspecific(g_blkbufmagkey, (void*)1);
+        g_blkbufmagused=true;
+    }
+    
+    mag=&g_blkbufmag[head->sclass];
+    if (mag->count==BLKBUF_MAGSIZE) // keep the most recent buffers in the thread
+    {   blkbuf_depot_put((struct s_blkbufhead *)mag->bufs[0]);
+        memmove(&mag->bufs[0], &mag->bufs[1], (BLKBUF_MAGSIZE-1)*sizeof(char*));
+        mag->count--;
+    }
+    mag->bufs[mag->count++]=(char*)head;
+}
+
+// SIGBUS is raised when a page of a mapping cannot be read (media error or truncated volume)
+static __thread sigjmp_buf *volatile g_blkmapjmp=NULL; // volatile: the stores around the reads must be kept
+static pthread_once_t g_blkmaponce=PTHREAD_ONCE_INIT;
+
+static void blkbuf_map_sigbus(int sig)
+{
+    if (g_blkmapjmp!=NULL) // fault in blkbuf_map_check(): it returns an error
+        siglongjmp(*g_blkmapjmp, 1);
+    signal(SIGBUS, SIG_DFL); // other faults kill the program when the instruction is restarted
+}
+
+static void blkbuf_map_init(void)
+{
+    struct sigaction sa;
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler=blkbuf_map_sigbus;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+// read all the pages of a range of a mapping so that an error is reported instead of a SIGBUS
+int blkbuf_map_check(u8 *data, u64 size)
+{
+    volatile u8 *vdata=data;
+    sigjmp_buf jmp;
+    u64 pagesize;
+    u64 pos;
+    
+    if (sigsetjmp(jmp, 1)!=0)
+    {   g_blkmapjmp=NULL;
+        return -1;
+    }
+    g_blkmapjmp=&jmp;
+    pagesize=sysconf(_SC_PAGESIZE);
+    for (pos=0; pos < size; pos+=pagesize)
+        (void)vdata[pos];
+    if (size > 0)
+        (void)vdata[size-1];
+    g_blkmapjmp=NULL;
+    return 0;
+}
+
+// map a whole volume of the archive so that the blocks can be borrowed from the mapping
+cblkmap *blkbuf_map_file(int fd, u64 size)
+{
+    cblkmap *map;
+    
+    pthread_once(&g_blkmaponce, blkbuf_map_init);
+    if ((map=malloc(sizeof(cblkmap)))==NULL)
+        return NULL;
+    
+    map->addr=mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map->addr==MAP_FAILED)
+    {   msgprintf(MSG_DEBUG1, "mmap(size=%lld) failed\n", (long long)size);
+        free(map);
+        return NULL;
+    }
+    map->size=size;
+    map->refcount=1;
+    madvise(map->addr, size, MADV_SEQUENTIAL);
+    return map;
+}
+
+void blkbuf_map_get(cblkmap *map)
+{
+    __sync_fetch_and_add(&map->refcount, 1);
+}
+
+// the mapping is removed when the volume has been closed and all its blocks have been released
+void blkbuf_map_put(cblkmap *map)
+{
+    if (__sync_sub_and_fetch(&map->refcount, 1)==0)
+    {   munmap(map->addr, map->size);
+        free(map);
+    }
+}
+
+// release the data of a block which are either in a buffer or borrowed from a mapping
+void blkbuf_release_block(struct s_blockinfo *blkinfo)
+{
+    if (blkinfo->blkmap!=NULL)
+        blkbuf_map_put(blkinfo->blkmap);
+    else
+        blkbuf_free(blkinfo->blkdata);
+    blkinfo->blkmap=NULL;
+    blkinfo->blkdata=NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __BLKBUF_H__
+#define __BLKBUF_H__
+
+// numa support: blocks can be allocated on a particular node
+int   blkbuf_init_numa(void);
+int   blkbuf_get_numnodes(void);
+int   blkbuf_pick_node(void);
+int   blkbuf_bind_thread(int node);
+
+// pool of buffers reused by all the threads (optionally carved in huge pages)
+int   blkbuf_init_pool(bool hugepages, u64 maxbytes);
+int   blkbuf_destroy_pool(void);
+
+// allocation of the buffers which contain the data blocks: there are always
+// BLKBUF_HEADROOM free bytes before the data where the block header can be written
+#define BLKBUF_HEADROOM  128
+char *blkbuf_alloc(u64 size, int node);
+void  blkbuf_free(char *buf);
+
+// the blocks can also be borrowed from a volume mapped in memory (the mapping is refcounted)
+struct s_blockinfo;
+struct s_blkmap;
+typedef struct s_blkmap cblkmap;
+struct s_blkmap
+{   u8     *addr; // address of the mapping
+    u64    size; // size of the mapping
+    int    refcount; // one reference for the reader and one per block borrowed from the mapping
+};
+cblkmap *blkbuf_map_file(int fd, u64 size);
+int   blkbuf_map_check(u8 *data, u64 size);
+void  blkbuf_map_get(cblkmap *map);
+void  blkbuf_map_put(cblkmap *map);
+void  blkbuf_release_block(struct s_blockinfo *blkinfo);
+
+#endif // __BLKBUF_H__
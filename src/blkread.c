@@ -0,0 +1,215 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "fsarchiver.h"
+#include "blkread.h"
+#include "blkbuf.h"
+#include "error.h"
+
+// read a whole block, a short count is only returned at the end of the file
+static long blkread_pread(int fd, char *data, u32 size, u64 offset)
+{
+    long done;
+    long lres;
+    
+    for (done=0; done < (long)size; done+=lres)
+    {
+        if ((lres=pread64(fd, data+done, size-done, offset+done))<0)
+            return -1;
+        if (lres==0) // the file has been truncated
+            break;
+    }
+    return done;
+}
+
+// read thread: it reads the next block of the file as long as it can be stored in its slot
+static void *blkread_fct(void *args)
+{
+    cblkread *br=(cblkread *)args;
+    struct s_blkreadslot slot;
+    u64 blocknum;
+    u64 offset;
+    u32 size;
+    int fd;
+    
+    pthread_mutex_lock(&br->mutex);
+    for (;;)
+    {
+        while ((br->stop==false) && ((br->active==false) || (br->nextblock==br->blockcount) || 
+            (br->nextblock >= br->takenblock+br->slotcount)))
+            pthread_cond_wait(&br->condslot, &br->mutex);
+        if (br->stop==true)
+            break;
+        blocknum=br->nextblock++;
+        offset=blocknum*br->blocksize;
+        size=min(br->blocksize, br->filesize-offset);
+        fd=br->fd;
+        br->inflight++;
+        pthread_mutex_unlock(&br->mutex);
+        
+        memset(&slot, 0, sizeof(slot));
+        slot.node=blkbuf_pick_node(); // the block will be processed by a thread running on that node
+        if ((slot.data=blkbuf_alloc(size, slot.node))==NULL)
+            slot.res=-1;
+        else if ((slot.res=blkread_pread(fd, slot.data, size, offset))<0)
+            slot.err=errno;
+        slot.ready=true;
+        
+        pthread_mutex_lock(&br->mutex);
+        br->slots[blocknum % br->slotcount]=slot;
+        br->inflight--;
+        pthread_cond_broadcast(&br->condread);
+    }
+    pthread_mutex_unlock(&br->mutex);
+    
+    return NULL;
+}
+
+int blkread_init(cblkread *br, int threadcount)
+{
+    int i;
+    
+    assert(br);
+    memset(br, 0, sizeof(cblkread));
+    
+    br->slotcount=threadcount*FSA_BLKREAD_SLOTSPERJOB;
+    if (((br->threads=calloc(threadcount, sizeof(pthread_t)))==NULL) || 
+        ((br->slots=calloc(br->slotcount, sizeof(struct s_blkreadslot)))==NULL))
+    {   errprintf("calloc() failed: out of memory\n");
+        free(br->threads);
+        br->threads=NULL;
+        return -1;
+    }
+    pthread_mutex_init(&br->mutex, NULL);
+    pthread_cond_init(&br->condread, NULL);
+    pthread_cond_init(&br->condslot, NULL);
+    
+    for (i=0; i < threadcount; i++)
+    {
+        if (pthread_create(&br->threads[i], NULL, blkread_fct, (void*)br)!=0)
+        {   errprintf("pthread_create() failed: cannot start the read threads\n");
+            blkread_destroy(br);
+            return -1;
+        }
+        br->threadcount++;
+    }
+    
+    msgprintf(MSG_VERB2, "large files are read by %d threads\n", threadcount);
+    return 0;
+}
+
+int blkread_destroy(cblkread *br)
+{
+    int i;
+    
+    assert(br);
+    
+    if (br->threads==NULL)
+        return 0;
+    
+    pthread_mutex_lock(&br->mutex);
+    br->stop=true;
+    pthread_cond_broadcast(&br->condslot);
+    pthread_mutex_unlock(&br->mutex);
+    for (i=0; i < br->threadcount; i++)
+        pthread_join(br->threads[i], NULL);
+    
+    for (i=0; i < br->slotcount; i++)
+    {   if (br->slots[i].ready==true)
+            blkbuf_free(br->slots[i].data);
+    }
+    pthread_cond_destroy(&br->condslot);
+    pthread_cond_destroy(&br->condread);
+    pthread_mutex_destroy(&br->mutex);
+    free(br->slots);
+    free(br->threads);
+    memset(br, 0, sizeof(cblkread));
+    return 0;
+}
+
+// the threads start to read the blocks of that file (the descriptor must stay open until blkread_finish())
+int blkread_start(cblkread *br, int fd, u64 filesize, u32 blocksize)
+{
+    assert(br);
+    
+    pthread_mutex_lock(&br->mutex);
+    br->fd=fd;
+    br->filesize=filesize;
+    br->blocksize=blocksize;
+    br->blockcount=(filesize+blocksize-1)/blocksize;
+    br->nextblock=0;
+    br->takenblock=0;
+    br->active=true;
+    pthread_cond_broadcast(&br->condslot);
+    pthread_mutex_unlock(&br->mutex);
+    return 0;
+}
+
+// wait until the block has been read and take it (the blocks must be taken in order)
+int blkread_take(cblkread *br, u64 blocknum, struct s_blkreadslot *slot)
+{
+    struct s_blkreadslot *cur;
+    
+    assert(br);
+    assert(slot);
+    
+    pthread_mutex_lock(&br->mutex);
+    if ((br->active==false) || (blocknum!=br->takenblock) || (blocknum>=br->blockcount))
+    {   pthread_mutex_unlock(&br->mutex);
+        errprintf("block %lld cannot be taken\n", (long long)blocknum);
+        return -1;
+    }
+    cur=&br->slots[blocknum % br->slotcount];
+    while (cur->ready==false)
+        pthread_cond_wait(&br->condread, &br->mutex);
+    *slot=*cur;
+    memset(cur, 0, sizeof(struct s_blkreadslot));
+    br->takenblock++;
+    pthread_cond_broadcast(&br->condslot);
+    pthread_mutex_unlock(&br->mutex);
+    return 0;
+}
+
+// stop reading the file: wait for the blocks which are being read and release the ones which have not been taken
+int blkread_finish(cblkread *br)
+{
+    int i;
+    
+    assert(br);
+    
+    pthread_mutex_lock(&br->mutex);
+    br->active=false;
+    while (br->inflight>0)
+        pthread_cond_wait(&br->condread, &br->mutex);
+    for (i=0; i < br->slotcount; i++)
+    {   if (br->slots[i].ready==true)
+            blkbuf_free(br->slots[i].data);
+        memset(&br->slots[i], 0, sizeof(struct s_blkreadslot));
+    }
+    pthread_mutex_unlock(&br->mutex);
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __BLKREAD_H__
+#define __BLKREAD_H__
+
+#include <pthread.h>
+
+// data block of the file which has been read by a read thread
+struct s_blkreadslot
+{   char   *data; // block allocated with blkbuf_alloc() (NULL if it could not be allocated)
+    int    node; // numa node where the block has been allocated
+    long   res; // how many bytes have been read (-1 if pread() failed)
+    int    err; // errno when pread() failed
+    bool   ready; // true when the block has been read and it has not been taken yet
+};
+
+struct s_blkread;
+typedef struct s_blkread cblkread;
+
+// threads which read the blocks of a large file at the same time, the blocks are taken in order
+struct s_blkread
+{   pthread_t *threads; // read threads
+    int    threadcount; // how many items there are in threads
+    pthread_mutex_t mutex; // protects all the other fields
+    pthread_cond_t condread; // signaled when a block has been read
+    pthread_cond_t condslot; // signaled when a slot is free, when a file starts or when the threads have to stop
+    struct s_blkreadslot *slots; // block number n is read in slots[n % slotcount]
+    int    slotcount; // how many blocks can be read in advance
+    int    inflight; // how many blocks are being read
+    int    fd; // file which is being read
+    u64    filesize; // size of the file when it has been opened
+    u32    blocksize; // size of the data blocks
+    u64    blockcount; // how many blocks there are in the file
+    u64    nextblock; // next block which has to be read by a thread
+    u64    takenblock; // next block which will be taken by the main thread
+    bool   active; // true while a file is being read
+    bool   stop; // true when the threads have to exit
+};
+
+int blkread_init(cblkread *br, int threadcount);
+int blkread_destroy(cblkread *br);
+int blkread_start(cblkread *br, int fd, u64 filesize, u32 blocksize);
+int blkread_take(cblkread *br, u64 blocknum, struct s_blkreadslot *slot);
+int blkread_finish(cblkread *br);
+
+#endif // __BLKREAD_H__
@@ -33,6 +33,7 @@
 #include <fnmatch.h>
 #include <time.h>
 #include <limits.h>
+#include <sched.h>
 
 #ifdef HAVE_EXECINFO_H
 #include <execinfo.h>
@@ -616,3 +617,124 @@ int get_path_to_volume(char *newvolbuf, int bufsize, char *basepath, long curvol
     
     return 0;
 }
+
+// read the cpu quota of a cgroup in cpus (rounded up), returns 0 if there is no quota
+static long get_cgroup_quota(char *cgpath, bool cgroupv2)
+{
+    char path[PATH_MAX];
+    long long quota, period;
+    FILE *f;
+    int res;
+    
+    if (cgroupv2) // cpu.max contains "quota period" or "max period"
+    {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cgpath);
+        if ((f=fopen(path, "r"))==NULL)
+            return 0;
+        res=fscanf(f, "%lld %lld", &quota, &period);
+        fclose(f);
+        if (res!=2) // "max" means there is no limit
+            return 0;
+    }
+    else // cgroup v1: quota and period are in two different files
+    {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu,cpuacct%s/cpu.cfs_quota_us", cgpath);
+        if ((f=fopen(path, "r"))==NULL)
+        {   snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_quota_us", cgpath);
+            if ((f=fopen(path, "r"))==NULL)
+                return 0;
+        }
+        res=fscanf(f, "%lld", &quota);
+        fclose(f);
+        if (res!=1)
+            return 0;
+        memcpy(path+strlen(path)-strlen("quota_us"), "period_us", strlen("period_us")+1);
+        if ((f=fopen(path, "r"))==NULL)
+            return 0;
+        res=fscanf(f, "%lld", &period);
+        fclose(f);
+        if (res!=1)
+            return 0;
+    }
+    
+    if ((quota<=0) || (period<=0)) // v1 uses -1 for no limit
+        return 0;
+    return (long)((quota+period-1)/period);
+}
+
+// the quota of a cgroup also applies to its children: take the smallest one up to the root
+static long get_cgroup_min_quota(char *cgpath, bool cgroupv2)
+{
+    char path[PATH_MAX];
+    long minquota=0;
+    long quota;
+    char *last;
+    
+    snprintf(path, sizeof(path), "%s", cgpath);
+    for (;;)
+    {
+        quota=get_cgroup_quota(path, cgroupv2);
+        if ((quota>0) && ((minquota==0) || (quota<minquota)))
+            minquota=quota;
+        if ((last=strrchr(path, '/'))==NULL)
+            break;
+        *last=0; // parent cgroup ("" is the root)
+    }
+    return minquota;
+}
+
+// how many cpus this process can really use (affinity mask and cgroup cpu quota)
+int get_cpu_count(void)
+{
+    char line[PATH_MAX+64];
+    char cgpath[PATH_MAX];
+    char ctrllist[256];
+    cpu_set_t cpuset;
+    long count=0;
+    long quota=0;
+    char *ctrl, *path;
+    FILE *f;
+    
+    // cpus where this process is allowed to run
+    CPU_ZERO(&cpuset);
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset)==0)
+        count=CPU_COUNT(&cpuset);
+    if (count<1)
+        count=sysconf(_SC_NPROCESSORS_ONLN);
+    
+    // cpu quota of the cgroup: lines are "id:controllers:path" ("0::path" for cgroup v2)
+    if ((f=fopen("/proc/self/cgroup", "r"))!=NULL)
+    {
+        while ((quota==0) && (fgets(line, sizeof(line), f)!=NULL))
+        {
+            line[strcspn(line, "\n")]=0;
+            if (((ctrl=strchr(line, ':'))==NULL) || ((path=strchr(++ctrl, ':'))==NULL))
+                continue;
+            *path++=0;
+            snprintf(cgpath, sizeof(cgpath), "%s", (strcmp(path, "/")==0)?"":path);
+            if (*ctrl==0) // cgroup v2
+                quota=get_cgroup_min_quota(cgpath, true);
+            else // cgroup v1: only the hierarchy of the "cpu" controller has a quota
+            {   snprintf(ctrllist, sizeof(ctrllist), ",%s,", ctrl);
+                if (strstr(ctrllist, ",cpu,")==NULL)
+                    continue;
+                quota=get_cgroup_min_quota(cgpath, false);
+            }
+        }
+        fclose(f);
+    }
+    
+    msgprintf(MSG_DEBUG1, "cpus available: affinity=%ld, cgroup-quota=%ld\n", count, quota);
+    if ((quota>0) && (quota<count))
+        count=quota;
+    
+    return (int)max(count, 1);
+}
+
+// monotonic clock in nanoseconds, used to measure how long the threads wait
+u64 get_time_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((u64)t.tv_sec*1000000000LL)+(u64)t.tv_nsec;
+}
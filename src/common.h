@@ -50,5 +50,7 @@ int stats_show(struct s_stats, int fsid);
 u64 stats_errcount(struct s_stats stats);
 int exclude_check(struct s_strlist *patlist, char *string);
 int get_path_to_volume(char *newvolbuf, int bufsize, char *basepath, long curvol);
+int get_cpu_count(void);
+u64 get_time_ns(void);
 
 #endif // __COMMON_H__
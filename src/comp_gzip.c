@@ -19,6 +19,7 @@
 #  include "config.h"
 #endif
 
+#include <string.h>
 #include <zlib.h>
 
 #include "fsarchiver.h"
@@ -26,22 +27,56 @@
 #include "comp_gzip.h"
 #include "error.h"
 
+// each (de)compression thread keeps its zlib streams and resets them between blocks
+static __thread z_stream g_gzcomp;
+static __thread z_stream g_gzdecomp;
+static __thread bool g_gzcompinit=false;
+static __thread bool g_gzdecompinit=false;
+static __thread int g_gzcomplevel=0;
+
 int compress_block_gzip(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u64 compbufsize, int level)
 {
-    uLong gzsize;
-    Bytef *gzbuffer;
+    int res;
     
-    gzsize=(uLong)compbufsize;
-    gzbuffer=(Bytef *)compbuf;
+    // the stream is created again when the level changes
+    if ((g_gzcompinit==true) && (g_gzcomplevel!=level))
+    {   deflateEnd(&g_gzcomp);
+        g_gzcompinit=false;
+    }
     
-    switch (compress2(gzbuffer, &gzsize, (const Bytef*)origbuf, (uLong)origsize, level))
+    if (g_gzcompinit==false)
+    {   memset(&g_gzcomp, 0, sizeof(g_gzcomp));
+        switch ((res=deflateInit(&g_gzcomp, level)))
+        {
+            case Z_OK:
+                break;
+            case Z_MEM_ERROR:
+                return FSAERR_ENOMEM;
+            default:
+                errprintf("deflateInit(%d) failed, res=%d\n", level, res);
+                return FSAERR_UNKNOWN;
+        }
+        g_gzcompinit=true;
+        g_gzcomplevel=level;
+    }
+    else if (deflateReset(&g_gzcomp)!=Z_OK)
+    {   errprintf("deflateReset() failed\n");
+        return FSAERR_UNKNOWN;
+    }
+    
+    g_gzcomp.next_in=(Bytef *)origbuf;
+    g_gzcomp.avail_in=(uInt)origsize;
+    g_gzcomp.next_out=(Bytef *)compbuf;
+    g_gzcomp.avail_out=(uInt)compbufsize;
+    
+    switch (deflate(&g_gzcomp, Z_FINISH))
     {
-        case Z_OK:
-            *compsize=(u64)gzsize;
+        case Z_STREAM_END:
+            *compsize=(u64)g_gzcomp.total_out;
             return FSAERR_SUCCESS;
         case Z_MEM_ERROR:
             return FSAERR_ENOMEM;
-        default:
+        default: // the output buffer is too small
             return FSAERR_UNKNOWN;
     }
     
@@ -50,19 +85,54 @@ int compress_block_gzip(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u
 
 int uncompress_block_gzip(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufsize, u8 *compbuf)
 {
-    uLong gzsize=(uLong)origbufsize;
-    Bytef *gzbuffer=(Bytef *)origbuf;
     int res;
     
-    switch ((res=uncompress(gzbuffer, &gzsize, (const Bytef*)compbuf, (uLong)compsize)))
+    if (g_gzdecompinit==false)
+    {   memset(&g_gzdecomp, 0, sizeof(g_gzdecomp));
+        switch ((res=inflateInit(&g_gzdecomp)))
+        {
+            case Z_OK:
+                break;
+            case Z_MEM_ERROR:
+                return FSAERR_ENOMEM;
+            default:
+                errprintf("inflateInit() failed, res=%d\n", res);
+                return FSAERR_UNKNOWN;
+        }
+        g_gzdecompinit=true;
+    }
+    else if (inflateReset(&g_gzdecomp)!=Z_OK)
+    {   errprintf("inflateReset() failed\n");
+        return FSAERR_UNKNOWN;
+    }
+    
+    g_gzdecomp.next_in=(Bytef *)compbuf;
+    g_gzdecomp.avail_in=(uInt)compsize;
+    g_gzdecomp.next_out=(Bytef *)origbuf;
+    g_gzdecomp.avail_out=(uInt)origbufsize;
+    
+    switch ((res=inflate(&g_gzdecomp, Z_FINISH)))
     {
-        case Z_OK:
-            *origsize=(u64)gzsize;
+        case Z_STREAM_END:
+            *origsize=(u64)g_gzdecomp.total_out;
             return FSAERR_SUCCESS;
         case Z_MEM_ERROR:
             return FSAERR_ENOMEM;
         default:
-            errprintf("uncompress() failed, res=%d\n", res);
+            errprintf("inflate() failed, res=%d\n", res);
             return FSAERR_UNKNOWN;
     }
 }
+
+// must be called by the threads which used the functions above before they exit
+void release_context_gzip(void)
+{
+    if (g_gzcompinit==true)
+    {   deflateEnd(&g_gzcomp);
+        g_gzcompinit=false;
+    }
+    if (g_gzdecompinit==true)
+    {   inflateEnd(&g_gzdecomp);
+        g_gzdecompinit=false;
+    }
+}
@@ -20,5 +20,6 @@
 
 int compress_block_gzip(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u64 compbufsize, int level);
 int uncompress_block_gzip(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufsize, u8 *compbuf);
+void release_context_gzip(void);
 
 #endif // __COMPRESS_GZIP_H__
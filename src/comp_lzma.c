@@ -28,90 +28,88 @@
 
 #include <lzma.h>
 
+// each (de)compression thread keeps its lzma streams: liblzma reuses the memory
+// of the coder (the dictionary) when a stream is initialized again
+static __thread lzma_stream g_lzcomp=LZMA_STREAM_INIT;
+static __thread lzma_stream g_lzdecomp=LZMA_STREAM_INIT;
+static __thread u64 g_lzmemlimit=96*1024*1024;
+
 int compress_block_lzma(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u64 compbufsize, int level)
 {
-    lzma_stream lzma = LZMA_STREAM_INIT;
     int res;
     
-    // init lzma structures
-    lzma.next_in = origbuf;
-    lzma.avail_in = origsize;
-    lzma.next_out = compbuf;
-    lzma.avail_out = compbufsize;
-    
     // Initialize a coder to the lzma_stream
-    if ((res=lzma_easy_encoder(&lzma, level, LZMA_CHECK_CRC32))!=LZMA_OK)
+    if ((res=lzma_easy_encoder(&g_lzcomp, level, LZMA_CHECK_CRC32))!=LZMA_OK)
     {   switch (res)
         {
             case LZMA_MEM_ERROR:
                 errprintf("lzma_easy_encoder(%d): LZMA compression failed "
                     "with an out of memory error.\nYou should use a lower "
                     "compression level to reduce the memory requirement.\n", level);
-                lzma_end(&lzma);
+                release_context_lzma();
                 return FSAERR_ENOMEM;
             default:
                 errprintf("lzma_easy_encoder(%d) failed with res=%d\n", level, res);
-                lzma_end(&lzma);
+                release_context_lzma();
                 return FSAERR_UNKNOWN;
         }
     }
     
-    if ((res=lzma_code(&lzma, LZMA_RUN))!=LZMA_OK)
+    // init lzma structures
+    g_lzcomp.next_in = origbuf;
+    g_lzcomp.avail_in = origsize;
+    g_lzcomp.next_out = compbuf;
+    g_lzcomp.avail_out = compbufsize;
+    
+    if ((res=lzma_code(&g_lzcomp, LZMA_RUN))!=LZMA_OK)
     {   errprintf("lzma_code(LZMA_RUN) failed with res=%d\n", res);
-        lzma_end(&lzma);
         return FSAERR_UNKNOWN;
     }
     
-    if ((res=lzma_code(&lzma, LZMA_FINISH))!=LZMA_STREAM_END && res!=LZMA_OK)
+    if ((res=lzma_code(&g_lzcomp, LZMA_FINISH))!=LZMA_STREAM_END && res!=LZMA_OK)
     {   errprintf("lzma_code(LZMA_FINISH) failed with res=%d\n", res);
-        lzma_end(&lzma);
         return FSAERR_UNKNOWN;
     }
     
-    *compsize=(u64)(lzma.total_out);
-    lzma_end(&lzma);
+    *compsize=(u64)(g_lzcomp.total_out);
     return FSAERR_SUCCESS;
 }
 
 int uncompress_block_lzma(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufsize, u8 *compbuf)
 {
-    lzma_stream lzma = LZMA_STREAM_INIT;
     u64 maxmemlimit=3ULL*1024ULL*1024ULL*1024ULL;
-    u64 memlimit=96*1024*1024;
     int res;
     
-    // init lzma structures
-    lzma.next_in = compbuf;
-    lzma.avail_in = compsize;
-    lzma.next_out = origbuf;
-    lzma.avail_out = origbufsize;
-    
-    // Initialize a coder to the lzma_stream
-    if ((res=lzma_auto_decoder(&lzma, memlimit, 0))!=LZMA_OK)
+    // Initialize a coder to the lzma_stream (the memory limit raised for the previous blocks is kept)
+    if ((res=lzma_auto_decoder(&g_lzdecomp, g_lzmemlimit, 0))!=LZMA_OK)
     {   errprintf("lzma_auto_decoder() failed with res=%d\n", res);
-        lzma_end(&lzma);
+        release_context_lzma();
         return FSAERR_UNKNOWN;
     }
     
+    // init lzma structures
+    g_lzdecomp.next_in = compbuf;
+    g_lzdecomp.avail_in = compsize;
+    g_lzdecomp.next_out = origbuf;
+    g_lzdecomp.avail_out = origbufsize;
+    
     do // retry if lzma_code() returns LZMA_MEMLIMIT_ERROR (increase the memory limit)
     {   
-        if ((res=lzma_code(&lzma, LZMA_RUN)) != LZMA_STREAM_END) // if error
+        if ((res=lzma_code(&g_lzdecomp, LZMA_RUN)) != LZMA_STREAM_END) // if error
         {
             if (res == LZMA_MEMLIMIT_ERROR) // we have to raise the memory limit
-            {   memlimit+=64*1024*1024;
-                lzma_memlimit_set(&lzma, memlimit);
-                msgprintf(MSG_VERB2, "lzma_memlimit_set(%lld)\n", (long long)memlimit);
+            {   g_lzmemlimit+=64*1024*1024;
+                lzma_memlimit_set(&g_lzdecomp, g_lzmemlimit);
+                msgprintf(MSG_VERB2, "lzma_memlimit_set(%lld)\n", (long long)g_lzmemlimit);
             }
             else // another error
             {   errprintf("lzma_code(LZMA_RUN) failed with res=%d\n", res);
-                lzma_end(&lzma);
                 return FSAERR_UNKNOWN;
             }
         }
-    } while ((res == LZMA_MEMLIMIT_ERROR) && (memlimit < maxmemlimit));
+    } while ((res == LZMA_MEMLIMIT_ERROR) && (g_lzmemlimit < maxmemlimit));
     
-    *origsize=(u64)(lzma.total_out);
-    lzma_end(&lzma);
+    *origsize=(u64)(g_lzdecomp.total_out);
     
     switch (res)
     {
@@ -124,4 +122,11 @@ int uncompress_block_lzma(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufs
     }
 }
 
+// must be called by the threads which used the functions above before they exit
+void release_context_lzma(void)
+{
+    lzma_end(&g_lzcomp);
+    lzma_end(&g_lzdecomp);
+}
+
 #endif // OPTION_LZMA_SUPPORT
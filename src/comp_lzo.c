@@ -19,18 +19,27 @@
 #  include "config.h"
 #endif
 
+#include <stdlib.h>
+
 #include "fsarchiver.h"
 #include "comp_lzo.h"
 #include "error.h"
 
 #ifdef OPTION_LZO_SUPPORT
 
+// each compression thread allocates the work memory of lzo only once
+static __thread char *g_lzoworkmem=NULL;
+
 int compress_block_lzo(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u64 compbufsize, int level)
 {
     lzo_uint destsize=(lzo_uint)compbufsize;
-    char workmem[LZO1X_1_MEM_COMPRESS];
     
-    switch (lzo1x_1_compress((lzo_bytep)origbuf, (lzo_uint)origsize, (lzo_bytep)compbuf, (lzo_uintp)&destsize, (lzo_voidp)workmem))
+    if ((g_lzoworkmem==NULL) && ((g_lzoworkmem=malloc(LZO1X_1_MEM_COMPRESS))==NULL))
+    {   errprintf("malloc(%ld) failed: out of memory\n", (long)LZO1X_1_MEM_COMPRESS);
+        return FSAERR_ENOMEM;
+    }
+    
+    switch (lzo1x_1_compress((lzo_bytep)origbuf, (lzo_uint)origsize, (lzo_bytep)compbuf, (lzo_uintp)&destsize, (lzo_voidp)g_lzoworkmem))
     {
         case LZO_E_OK:
             *compsize=(u64)destsize;
@@ -64,4 +73,11 @@ int uncompress_block_lzo(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufsi
     return FSAERR_UNKNOWN;
 }
 
+// must be called by the threads which used the functions above before they exit
+void release_context_lzo(void)
+{
+    free(g_lzoworkmem);
+    g_lzoworkmem=NULL;
+}
+
 #endif // OPTION_LZO_SUPPORT
@@ -24,6 +24,7 @@
 
 int compress_block_lzo(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u64 compbufsize, int level);
 int uncompress_block_lzo(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufsize, u8 *compbuf);
+void release_context_lzo(void);
 
 #endif // OPTION_LZO_SUPPORT
 
@@ -27,31 +27,75 @@
 #include "common.h"
 #include "error.h"
 
+// mix the device and the inode numbers so that consecutive inodes are spread over the table
+static u64 dichl_hash(u64 key1, u64 key2)
+{
+    u64 h=key2^(key1*0x9E3779B97F4A7C15ULL);
+    h^=h>>33;
+    h*=0xFF51AFD7ED558CCDULL;
+    h^=h>>33;
+    return h;
+}
+
+// return the slot of the item or the empty slot where it must be inserted
+static cdichlitem *dichl_find(cdichlitem *items, u64 size, u64 key1, u64 key2)
+{
+    u64 pos=dichl_hash(key1, key2)&(size-1);
+    
+    while (items[pos].used==true && (items[pos].key1!=key1 || items[pos].key2!=key2))
+        pos=(pos+1)&(size-1);
+    return &items[pos];
+}
+
+static int dichl_grow(cdichl *d)
+{
+    cdichlitem *items;
+    cdichlitem *slot;
+    u64 size=d->size*2;
+    u64 i;
+    
+    if ((items=calloc(size, sizeof(cdichlitem)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)(size*sizeof(cdichlitem)));
+        return -1;
+    }
+    for (i=0; i < d->size; i++)
+    {   if (d->items[i].used==true)
+        {   slot=dichl_find(items, size, d->items[i].key1, d->items[i].key2);
+            *slot=d->items[i];
+        }
+    }
+    free(d->items);
+    d->items=items;
+    d->size=size;
+    return 0;
+}
+
 cdichl *dichl_alloc()
 {
     cdichl *d;
-    if ((d=malloc(sizeof(cdichl)))==NULL)
+    if ((d=calloc(1, sizeof(cdichl)))==NULL)
         return NULL;
-    d->head=NULL;
+    if ((d->items=calloc(DICHL_MINSIZE, sizeof(cdichlitem)))==NULL)
+    {   free(d);
+        return NULL;
+    }
+    if ((d->arena=malloc(DICHL_ARENASIZE))==NULL)
+    {   free(d->items);
+        free(d);
+        return NULL;
+    }
+    d->size=DICHL_MINSIZE;
+    d->arenasize=DICHL_ARENASIZE;
     return d;
 }
 
 int dichl_destroy(cdichl *d)
 {
-    cdichlitem *item, *next;
-    
     if (d==NULL)
         return -1;
     
-    item=d->head;
-    while (item!=NULL)
-    {
-        next=item->next;
-        free(item->str);
-        free(item);
-        item=next;
-    }
-    
+    free(d->items);
+    free(d->arena);
     free(d);
     
     return 0;
@@ -59,7 +103,9 @@ int dichl_destroy(cdichl *d)
 
 int dichl_add(cdichl *d, u64 key1, u64 key2, char *str)
 {
-    cdichlitem *item, *lnew, *last;
+    cdichlitem *slot;
+    u64 arenasize;
+    char *arena;
     int len;
     
     if (d==NULL || !str)
@@ -68,50 +114,44 @@ int dichl_add(cdichl *d, u64 key1, u64 key2, char *str)
     }
     len=strlen(str);
     
-    // allocate object
-    lnew=malloc(sizeof(cdichlitem));
-    if (!lnew)
-    {   errprintf("malloc(%ld) failed: out of memory\n", (long)sizeof(cdichlitem));
+    // keep the table at most half full so that the probe sequences remain short
+    if ((d->count+1)*2 > d->size && dichl_grow(d)!=0)
         return -1;
-    }
-    memset(lnew, 0, sizeof(cdichlitem));
-    lnew->str=malloc(len+1);
-    if (!lnew->str)
-    {   
-        free(lnew);
-        errprintf("malloc(%ld) failed: out of memory\n", (long)len+1);
+    
+    slot=dichl_find(d->items, d->size, key1, key2);
+    if (slot->used==true)
+    {   errprintf("dichl_add_internal(): item with key1=%ld and key2=%ld is already in dico\n", (long)key1, (long)key2);
         return -1;
     }
     
-    memcpy(lnew->str, str, len+1);
-    lnew->key1=key1;
-    lnew->key2=key2;
-    lnew->next=NULL;
-    
-    // go to the end of the item and check for duplicates
-    if (d->head==NULL) // item is empty
-    {   
-        d->head=lnew;
-    }
-    else // item is not empty
-    {   
-        for (item=d->head; item!=NULL; item=item->next)
-        {   
-            last=item;
-            if (item->key1==key1 && item->key2==key2)
-            {   errprintf("dichl_add_internal(): item with key1=%ld and key2=%ld is already in dico\n", (long)item->key1, (long)item->key2);
-                return -1;
-            }
+    // copy the string at the end of the arena
+    if (d->arenaused+len+1 > d->arenasize)
+    {   arenasize=d->arenasize*2;
+        while (d->arenaused+len+1 > arenasize)
+            arenasize*=2;
+        if ((arena=realloc(d->arena, arenasize))==NULL)
+        {   errprintf("realloc(%ld) failed: out of memory\n", (long)arenasize);
+            return -1;
         }
-        last->next=lnew;
+        d->arena=arena;
+        d->arenasize=arenasize;
     }
+    memcpy(d->arena+d->arenaused, str, len+1);
+    
+    slot->key1=key1;
+    slot->key2=key2;
+    slot->stroff=d->arenaused;
+    slot->used=true;
+    d->arenaused+=len+1;
+    d->count++;
     
     return 0;
 }
 
 int dichl_get(cdichl *d, u64 key1, u64 key2, char *buf, int bufsize)
 {
-    cdichlitem *item;
+    cdichlitem *slot;
+    char *str;
     int len;
     
     if (d==NULL || !buf)
@@ -119,17 +159,14 @@ int dichl_get(cdichl *d, u64 key1, u64 key2, char *buf, int bufsize)
         return -1;
     }
     
-    for (item=d->head; item!=NULL; item=item->next)
-    {   
-        if ((item!=NULL) && (item->key1==key1) && (item->key2==key2))
-        {
-            len=strlen(item->str);
-            if (bufsize<len+1)
-                return -2;
-            snprintf(buf, bufsize, "%s", item->str);
-            return 0;
-        }
-    }
+    slot=dichl_find(d->items, d->size, key1, key2);
+    if (slot->used==false)
+        return -3; // not found
     
-    return -3; // not found
+    str=d->arena+slot->stroff;
+    len=strlen(str);
+    if (bufsize<len+1)
+        return -2;
+    snprintf(buf, bufsize, "%s", str);
+    return 0;
 }
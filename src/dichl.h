@@ -20,22 +20,30 @@
 
 #include "types.h"
 
+#define DICHL_MINSIZE    1024       // initial number of slots in the hash table (power of two)
+#define DICHL_ARENASIZE  65536      // initial size of the buffer where the paths are stored
+
 struct s_dichl;
 typedef struct s_dichl cdichl;
 
 struct s_dichlitem;
 typedef struct s_dichlitem cdichlitem;
 
+// open-addressing hash table: the paths are stored one after the other in the arena
 struct s_dichl
-{
-    cdichlitem *head;
+{   cdichlitem  *items;     // slots of the hash table
+    u64         size;       // number of slots (power of two)
+    u64         count;      // number of slots used
+    char        *arena;     // buffer where the paths are stored
+    u64         arenasize;  // size of the arena
+    u64         arenaused;  // bytes used in the arena
 };
 
 struct s_dichlitem
 {   u64         key1;
     u64         key2;
-    char        *str;
-    cdichlitem  *next;
+    u64         stroff;     // offset of the path in the arena
+    bool        used;
 };
 
 cdichl *dichl_alloc();
@@ -61,6 +61,36 @@ int dico_destroy(cdico *d)
     return 0;
 }
 
+// how many bytes of memory are used by the dico (used to limit the size of the queue)
+u64 dico_memsize(cdico *d)
+{
+    cdicoitem *item;
+    u64 size;
+    
+    assert(d);
+    
+    size=sizeof(cdico);
+    for (item=d->head; item!=NULL; item=item->next)
+        size+=sizeof(cdicoitem)+item->size;
+    
+    return size;
+}
+
+// move the items of src at the end of d (the items of src must be in other sections), src is left empty
+int dico_append(cdico *d, cdico *src)
+{
+    cdicoitem **last;
+    
+    assert(d);
+    assert(src);
+    
+    for (last=&d->head; *last!=NULL; last=&(*last)->next);
+    *last=src->head;
+    src->head=NULL;
+    
+    return 0;
+}
+
 int dico_add_data(cdico *d, u8 section, u16 key, const void *data, u16 size)
 {
     return dico_add_generic(d, section, key, data, size, DICTYPE_DATA);
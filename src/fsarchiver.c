@@ -24,6 +24,7 @@
 #include <signal.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "fsarchiver.h"
 #include "dico.h"
@@ -39,6 +40,7 @@
 #include "logfile.h"
 #include "error.h"
 #include "queue.h"
+#include "blkbuf.h"
 
 char *valid_magic[]={FSA_MAGIC_MAIN, FSA_MAGIC_VOLH, FSA_MAGIC_VOLF, 
     FSA_MAGIC_FSIN, FSA_MAGIC_FSYB, FSA_MAGIC_DATF, FSA_MAGIC_OBJT, 
@@ -46,7 +48,7 @@ char *valid_magic[]={FSA_MAGIC_MAIN, FSA_MAGIC_VOLH, FSA_MAGIC_VOLF,
 
 void usage(char *progname, bool examples)
 {
-    int lzo, lzma;
+    int lzo, lzma, numa, uring;
 
 #ifdef OPTION_LZO_SUPPORT
     lzo=true;
@@ -58,6 +60,16 @@ void usage(char *progname, bool examples)
 #else
     lzma=false;
 #endif // OPTION_LZMA_SUPPORT
+#ifdef OPTION_NUMA_SUPPORT
+    numa=true;
+#else
+    numa=false;
+#endif // OPTION_NUMA_SUPPORT
+#ifdef OPTION_URING_SUPPORT
+    uring=true;
+#else
+    uring=false;
+#endif // OPTION_URING_SUPPORT
     
     msgprintf(MSG_FORCE, "====> fsarchiver version %s (%s) - http://www.fsarchiver.org <====\n", FSA_VERSION, FSA_RELDATE);
     msgprintf(MSG_FORCE, "Distributed under the GPL v2 license (GNU General Public License v2).\n");
@@ -81,11 +93,23 @@ void usage(char *progname, bool examples)
     msgprintf(MSG_FORCE, " -z <level>: compression level from 1 (very fast) to 9 (very good) default=3\n");
     msgprintf(MSG_FORCE, " -s <mbsize>: split the archive into several files of <mbsize> megabytes each\n");
     msgprintf(MSG_FORCE, " -j <count>: create more than one (de)compression thread. useful on multi-core cpu\n");
+    msgprintf(MSG_FORCE, " -j auto: use as many threads as available cpus and park the ones which are idle\n");
+    msgprintf(MSG_FORCE, " --queue-mem=<mbsize>: memory used to buffer data between threads (default=128 or more with -j)\n");
+    msgprintf(MSG_FORCE, " --numa: spread the (de)compression threads over numa nodes with their data blocks\n");
+    msgprintf(MSG_FORCE, " --hugepages: allocate the buffers used for the data blocks in huge pages\n");
+    msgprintf(MSG_FORCE, " --io-uring: read and write the archive with io_uring (several requests at the same time)\n");
+    msgprintf(MSG_FORCE, " --direct-io: write the archive with O_DIRECT so that it does not go through the page cache\n");
+    msgprintf(MSG_FORCE, " --mmap: map the archive in memory and decompress the blocks from the mapping\n");
+    msgprintf(MSG_FORCE, " --tee=<path>: write a copy of the archive to that path at the same time (can be repeated)\n");
+    msgprintf(MSG_FORCE, " --tee-optional=<path>: same as --tee but the archive is still written if the copy fails\n");
+    msgprintf(MSG_FORCE, " --read-threads=<count>: read the blocks of large files with that many threads when saving\n");
+    msgprintf(MSG_FORCE, " --walk-threads=<count>: read the directories, attributes and small files with that many threads when saving\n");
+    msgprintf(MSG_FORCE, " --disk-order: save the items of each directory in the order of their inodes and data on the disk\n");
     msgprintf(MSG_FORCE, " -c <password>: encrypt/decrypt data in archive, \"-c -\" for interactive password\n");
     msgprintf(MSG_FORCE, " -h: show help and information about how to use fsarchiver with examples\n");
     msgprintf(MSG_FORCE, " -V: show program version and exit\n");
     msgprintf(MSG_FORCE, "<information>\n");
-    msgprintf(MSG_FORCE, " * Support included for: lzo=%s, lzma=%s\n", (lzo==true)?"yes":"no", (lzma==true)?"yes":"no");
+    msgprintf(MSG_FORCE, " * Support included for: lzo=%s, lzma=%s, numa=%s, io_uring=%s\n", (lzo==true)?"yes":"no", (lzma==true)?"yes":"no", (numa==true)?"yes":"no", (uring==true)?"yes":"no");
     msgprintf(MSG_FORCE, " * Support for ntfs filesystems is unstable: don't use it for production.\n");
     
     if (examples==true)
@@ -123,11 +147,16 @@ void usage(char *progname, bool examples)
         msgprintf(MSG_FORCE, "   fsarchiver savefs -c - /data/myarchive1.fsa /dev/sda1\n");
         msgprintf(MSG_FORCE, " * \e[1mextract an archive made of simple files to /tmp/extract:\e[0m\n");
         msgprintf(MSG_FORCE, "   fsarchiver restdir /data/linux-sources.fsa /tmp/extract\n");
+        msgprintf(MSG_FORCE, " * \e[1msave a filesystem to another machine through ssh and restore it there (\"-\" is stdout/stdin):\e[0m\n");
+        msgprintf(MSG_FORCE, "   fsarchiver savefs - /dev/sda1 | ssh host fsarchiver restfs - id=0,dest=/dev/sdb1\n");
         msgprintf(MSG_FORCE, " * \e[1mshow information about an archive and its filesystems:\e[0m\n");
         msgprintf(MSG_FORCE, "   fsarchiver archinfo /data/myarchive2.fsa\n");
     }
 }
 
+// long options which have no short equivalent
+enum {LONGOPT_QUEUEMEM=256, LONGOPT_NUMA, LONGOPT_HUGEPAGES, LONGOPT_IOURING, LONGOPT_DIRECTIO, LONGOPT_MMAP, LONGOPT_TEE, LONGOPT_TEEOPTIONAL, LONGOPT_READTHREADS, LONGOPT_WALKTHREADS, LONGOPT_DISKORDER};
+
 static struct option const long_options[] =
 {
     {"overwrite", no_argument, NULL, 'o'},
@@ -144,6 +173,17 @@ static struct option const long_options[] =
     {"label", required_argument, NULL, 'L'},
     {"exclude", required_argument, NULL, 'e'},
     {"experimental", no_argument, NULL, 'x'},
+    {"queue-mem", required_argument, NULL, LONGOPT_QUEUEMEM},
+    {"numa", no_argument, NULL, LONGOPT_NUMA},
+    {"hugepages", no_argument, NULL, LONGOPT_HUGEPAGES},
+    {"io-uring", no_argument, NULL, LONGOPT_IOURING},
+    {"direct-io", no_argument, NULL, LONGOPT_DIRECTIO},
+    {"mmap", no_argument, NULL, LONGOPT_MMAP},
+    {"tee", required_argument, NULL, LONGOPT_TEE},
+    {"tee-optional", required_argument, NULL, LONGOPT_TEEOPTIONAL},
+    {"read-threads", required_argument, NULL, LONGOPT_READTHREADS},
+    {"walk-threads", required_argument, NULL, LONGOPT_WALKTHREADS},
+    {"disk-order", no_argument, NULL, LONGOPT_DISKORDER},
     {NULL, 0, NULL, 0}
 };
 
@@ -158,8 +198,11 @@ int process_cmdline(int argc, char **argv)
     char *archive=NULL;
     char tempbuf[1024];
     char *progname;
+    char *endptr;
+    long long mbsize;
     int fscount;
     int argcok;
+    s64 blkmax;
     int ret=0;
     int cmd;
     int c;
@@ -176,10 +219,13 @@ int process_cmdline(int argc, char **argv)
     g_options.verboselevel=0;
     g_options.debuglevel=0;
     g_options.compressjobs=1;
+    g_options.readjobs=1;
+    g_options.walkjobs=1;
     g_options.fsacomplevel=3; // fsa level 3 = "gzip -6"
     g_options.compressalgo=FSA_DEF_COMPRESS_ALGO;
     g_options.compresslevel=FSA_DEF_COMPRESS_LEVEL; // default level for gzip
     g_options.datablocksize=FSA_DEF_BLKSIZE;
+    g_options.queuemem=0; // depends on the number of jobs unless it is specified
     g_options.encryptalgo=ENCRYPT_NONE;
     snprintf(g_options.archlabel, sizeof(g_options.archlabel), "<none>");
     g_options.encryptpass[0]=0;
@@ -210,10 +256,17 @@ int process_cmdline(int argc, char **argv)
                 g_options.debuglevel++;
                 break;
             case 'j': // compression jobs
+                if (strcmp(optarg, "auto")==0) // as many threads as cpus, some of them are parked when idle
+                {   g_options.compressjobs=min(get_cpu_count(), FSA_MAX_COMPJOBS);
+                    g_options.autojobs=true;
+                    msgprintf(MSG_VERB1, "Using up to %d (de)compression threads\n", g_options.compressjobs);
+                    break;
+                }
                 g_options.compressjobs=atoi(optarg);
+                g_options.autojobs=false;
                 if (g_options.compressjobs<1 || g_options.compressjobs>FSA_MAX_COMPJOBS)
                 {
-                    errprintf("[%s] is not a valid number of jobs. Must be between 1 and %d\n", optarg, FSA_MAX_COMPJOBS);
+                    errprintf("[%s] is not a valid number of jobs. Must be between 1 and %d or auto\n", optarg, FSA_MAX_COMPJOBS);
                     usage(progname, false);
                     return 1;
                 }
@@ -235,6 +288,56 @@ int process_cmdline(int argc, char **argv)
                         (long long)g_options.splitsize, format_size(g_options.splitsize, tempbuf, sizeof(tempbuf), 'h'));
                 }
                 break;
+            case LONGOPT_QUEUEMEM: // memory used by the queue
+                mbsize=strtoll(optarg, &endptr, 10);
+                if ((endptr==optarg) || (*endptr!=0) || (mbsize<=0) || (mbsize>(LLONG_MAX>>20)) || 
+                    ((g_options.queuemem=((u64)mbsize)*((u64)1024LL*1024LL))<FSA_MIN_QUEUEMEM))
+                {
+                    errprintf("argument of option --queue-mem is invalid (%s). It must be a valid integer (megabytes)\n", optarg);
+                    usage(progname, false);
+                    return 1;
+                }
+                break;
+            case LONGOPT_NUMA: // bind threads and data blocks to numa nodes
+                g_options.numa=true;
+                break;
+            case LONGOPT_HUGEPAGES: // carve the buffers of the pool in huge pages
+                g_options.hugepages=true;
+                break;
+            case LONGOPT_IOURING: // read and write the archive with io_uring
+                g_options.iouring=true;
+                break;
+            case LONGOPT_DIRECTIO: // bypass the page cache when the archive is written
+                g_options.directio=true;
+                break;
+            case LONGOPT_MMAP: // borrow the blocks from the archive mapped in memory
+                g_options.mmapread=true;
+                break;
+            case LONGOPT_TEE: // copy of the archive written at the same time
+                strlist_add(&g_options.teepaths, optarg);
+                break;
+            case LONGOPT_TEEOPTIONAL: // copy of the archive which may fail
+                strlist_add(&g_options.teeoptional, optarg);
+                break;
+            case LONGOPT_READTHREADS: // threads which read the blocks of large files
+                g_options.readjobs=atoi(optarg);
+                if (g_options.readjobs<1 || g_options.readjobs>FSA_MAX_READJOBS)
+                {   errprintf("[%s] is not a valid number of read threads. Must be between 1 and %d\n", optarg, FSA_MAX_READJOBS);
+                    usage(progname, false);
+                    return 1;
+                }
+                break;
+            case LONGOPT_WALKTHREADS: // threads which read the directories in advance
+                g_options.walkjobs=atoi(optarg);
+                if (g_options.walkjobs<1 || g_options.walkjobs>FSA_MAX_WALKJOBS)
+                {   errprintf("[%s] is not a valid number of walker threads. Must be between 1 and %d\n", optarg, FSA_MAX_WALKJOBS);
+                    usage(progname, false);
+                    return 1;
+                }
+                break;
+            case LONGOPT_DISKORDER: // reduce the seeks on hard disks
+                g_options.diskorder=true;
+                break;
             case 'z': // compression level
                 g_options.fsacomplevel=atoi(optarg);
                 if (g_options.fsacomplevel<1 || g_options.fsacomplevel>9)
@@ -283,6 +386,13 @@ int process_cmdline(int argc, char **argv)
         command=*argv++, argc--;
     }
     
+    // the queue must contain enough blocks to feed all the compression threads
+    blkmax=max(FSA_MAX_QUEUESIZE, g_options.compressjobs*FSA_QUEUESIZE_PER_JOB);
+    if (g_options.queuemem==0)
+        g_options.queuemem=max(FSA_DEF_QUEUEMEM, (u64)blkmax*FSA_MAX_BLKSIZE);
+    msgprintf(MSG_DEBUG1, "Queue can contain up to %ld blocks and %lld bytes\n", (long)blkmax, (long long)g_options.queuemem);
+    queue_set_limits(&g_queue, blkmax, g_options.queuemem);
+    
     // calculate threshold for small files that are compressed together
     g_options.smallfilethresh=min(g_options.datablocksize/4, FSA_MAX_SMALLFILESIZE);
     msgprintf(MSG_DEBUG1, "Files smaller than %ld will be packed with other small files\n", (long)g_options.smallfilethresh);
@@ -389,6 +499,25 @@ int process_cmdline(int argc, char **argv)
             break;
     }
     
+    // the archive is written to stdout or read from stdin
+    if ((archive!=NULL) && (strcmp(archive, FSA_STREAM_PATH)==0))
+    {
+        if ((cmd==OPER_SAVEFS) || (cmd==OPER_SAVEDIR))
+        {   if (g_options.splitsize>0)
+            {   errprintf("an archive written to the standard output cannot be split into volumes\n");
+                return -1;
+            }
+            if (isatty(STDOUT_FILENO))
+            {   errprintf("the archive cannot be written to a terminal: redirect the standard output to a file or a pipe\n");
+                return -1;
+            }
+        }
+        else if (isatty(STDIN_FILENO))
+        {   errprintf("the archive cannot be read from a terminal: redirect the standard input from a file or a pipe\n");
+            return -1;
+        }
+    }
+    
     // list of partitions to backup/restore
     for (fscount=0; (fscount < argc) && (argv[fscount]); fscount++)
         partition[fscount]=argv[fscount];
@@ -457,6 +586,7 @@ int main(int argc, char **argv)
 
     // cleanup
     queue_destroy(&g_queue);
+    blkbuf_destroy_pool();
     options_destroy();
     
     // cleanup libgcrypt
@@ -86,6 +86,8 @@ enum {FSYSHEADKEY_NULL=0, FSYSHEADKEY_FILESYSTEM, FSYSHEADKEY_MNTPATH, FSYSHEADK
 
 enum {DIRSINFOKEY_NULL=0, DIRSINFOKEY_TOTALCOST};
 
+enum {DATAFOOTKEY_NULL=0, DATAFOOTKEY_TOTALCOST};
+
 // -------------------------------- fsarchiver errors ---------------------------------------------
 enum {FSAERR_SUCCESS=0,           // success
       FSAERR_UNKNOWN=-1,          // uknown error (default code that means error)
@@ -118,10 +120,37 @@ enum {OLDERR_FATAL=1,
 #define FSA_MAX_DEVLEN           256
 #define FSA_MAX_UUIDLEN          128
 #define FSA_MAX_BLKDEVICES       256
+#define FSA_STREAM_PATH          "-"            // archive path which means stdout on save and stdin on restore
 
 #define FSA_MAX_FSPERARCH        128
-#define FSA_MAX_COMPJOBS         32
-#define FSA_MAX_QUEUESIZE        32
+#define FSA_MAX_COMPJOBS         256
+#define FSA_MAX_READJOBS         64
+#define FSA_MAX_WALKJOBS         64
+#define FSA_MAX_QUEUESIZE        32             // minimum number of blocks in the queue before it is considered as full
+#define FSA_QUEUESIZE_PER_JOB    4              // the queue can store more blocks when there are many compression jobs
+#define FSA_DEF_QUEUEMEM         134217728      // memory which can be used by the items in the queue (blocks and headers)
+#define FSA_MIN_QUEUEMEM         1048576
+#define FSA_WRITER_BATCHSIZE     4194304        // the writer gathers that many bytes before it writes them with writev()
+#define FSA_WRITER_STAGESIZE     262144         // buffer where the headers are copied until they are written
+#define FSA_WRITER_MAXIOV        64             // how many separate buffers can be written with a single writev()
+#define FSA_WRITER_SYNCSIZE      33554432       // write-behind: the data are flushed to the disk by chunks of that size
+#define FSA_WRITER_MAXBATCH      4              // how many batches of data can be written at the same time with io_uring
+#define FSA_WRITER_DIRECTALIGN   4096           // alignment of the buffers, offsets and sizes written with O_DIRECT
+#define FSA_READER_BUFSIZE       1048576        // the reader reads the archive by chunks of that size and parses the headers in memory
+#define FSA_READER_MAPAHEAD      16777216       // the kernel is asked to read that many bytes of a mapped volume in advance
+#define FSA_READER_MAXHEADER     16777216       // headers bigger than that are not considered when the reader searches the next header
+#define FSA_READER_PREFETCH      33554432       // the next volume is opened and read in advance when the current one has less than that
+#define FSA_READER_SEGSIZE       1048576        // the reader asks io_uring for that many bytes per request
+#define FSA_READER_SEGCOUNT      4              // how many segments of the archive are read in advance with io_uring
+#define FSA_READAHEAD_WINDOW     67108864       // how many bytes of the next files to save are read in advance
+#define FSA_READAHEAD_MAXFILES   256            // how many of the next files to save the readahead thread knows
+#define FSA_BLKREAD_MINBLOCKS    16             // files with fewer data blocks than that are read by the main thread
+#define FSA_BLKREAD_SLOTSPERJOB  2              // how many blocks of a file can be read in advance per read thread
+#define FSA_WALKER_DIRSPERJOB    4              // how many directories can be read in advance per walker thread
+#define FSA_WALKER_MAXPENDING    64             // how many directories can wait for the walker threads per thread
+#define FSA_WALKER_MAXDATA       4194304        // how many bytes of small files are read in advance per directory
+#define FSA_DISKORDER_WINDOW     1024           // --disk-order: how many entries of a directory are sorted by the position of their data
+#define FSA_GETDENTS_BUFSIZE     65536          // buffer where the entries of a directory are read with getdents64
 #define FSA_MAX_BLKSIZE          921600
 #define FSA_DEF_BLKSIZE          262144
 #define FSA_DEF_COMPRESS_ALGO    COMPRESS_GZIP  // compress using gzip by default
@@ -129,6 +158,7 @@ enum {OLDERR_FATAL=1,
 #define FSA_MAX_SMALLFILECOUNT   512            // there can be up to FSA_MAX_SMALLFILECOUNT files copied in a single data block 
 #define FSA_MAX_SMALLFILESIZE    131072         // files smaller than that will be grouped with other small files in a single data block
 #define FSA_COST_PER_FILE        16384          // how much it cost to copy an empty file/dir/link: used to eval the progress bar
+#define FSA_COST_MINITEMS        1024           // how many items must be saved before the estimated cost of a filesystem is refined
 
 #define FSA_MAX_LABELLEN         512
 #define FSA_MIN_PASSLEN          6
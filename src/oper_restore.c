@@ -54,6 +54,7 @@
 #include "error.h"
 #include "datafile.h"
 #include "queue.h"
+#include "blkbuf.h"
 
 typedef struct s_extractar
 {   carchreader ai;
@@ -645,7 +646,7 @@ int extractar_restore_obj_regfile_multi(cextractar *exar, char *destdir, cdico *
     {   errprintf("regmulti_rest_setdatablock() failed\n");
         return -1;
     }
-    free(blkinfo.blkdata); // free memory allocated by the thread_io_reader
+    blkbuf_free(blkinfo.blkdata); // free memory allocated by the thread_io_reader
     
     // ---- create the set of small files using the regmulti structure
     for (i=0; i < filescount; i++)
@@ -807,21 +808,21 @@ int extractar_restore_obj_regfile_unique(cextractar *exar, char *fullpath, char
         if (blkinfo.blkoffset!=filepos)
         {   errprintf("file offset do not match for file(%s) failed: filepos=%lld, blkinfo.blkoffset=%lld, blkinfo.blkrealsize=%lld\n", 
                 relpath, (long long)filepos, (long long)blkinfo.blkoffset, (long long)blkinfo.blkrealsize);
-            free(blkinfo.blkdata);
+            blkbuf_free(blkinfo.blkdata);
             delfile=true;
             minorerr=true;
             break;
         }
         
         if (datafile_write(datafile, blkinfo.blkdata, blkinfo.blkrealsize)!=FSAERR_SUCCESS)
-        {   free(blkinfo.blkdata);
+        {   blkbuf_free(blkinfo.blkdata);
             delfile=true;
             minorerr=true;
             fatalerr=true;
             break;
         }
         
-        free(blkinfo.blkdata);
+        blkbuf_free(blkinfo.blkdata);
     }
     
     if ((minorerr==false) && (datafile_close(datafile, md5sumcalc, sizeof(md5sumcalc))!=0))
@@ -1187,6 +1188,8 @@ int extractar_filesystem_extract(cextractar *exar, cdico *dicofs, cstrdico *dico
     char mntbuf[PATH_MAX];
     u64 fsbytestotal;
     u64 fsbytesused;
+    u64 realcost;
+    u64 fscost;
     char optbuf[128];
     int readwrite;
     int errors=0;
@@ -1326,6 +1329,10 @@ int extractar_filesystem_extract(cextractar *exar, cdico *dicofs, cstrdico *dico
         ret=-1;
         goto filesystem_extract_umount;
     }
+    // the cost of the filesystem header is an estimate: the real cost is known at the end (fsarchiver >= 0.8.2)
+    if ((exar->cost_global>0) && (dico_get_u64(dicofs, 0, FSYSHEADKEY_TOTALCOST, &fscost)==0) 
+        && (dico_get_u64(dicoend, 0, DATAFOOTKEY_TOTALCOST, &realcost)==0) && (exar->cost_global>=fscost))
+        exar->cost_global=exar->cost_global-fscost+realcost;
     dico_destroy(dicoend);
     
     if ((get_interrupted()==false) && (memcmp(magic, FSA_MAGIC_DATF, FSA_SIZEOF_MAGIC)!=0))
@@ -1348,7 +1355,7 @@ int oper_restore(char *archive, int argc, char **argv, int oper)
 {
     cdico *dicofsinfo[FSA_MAX_FSPERARCH];
     cstrdico *dicoargv[FSA_MAX_FSPERARCH];
-    pthread_t thread_decomp[FSA_MAX_COMPJOBS];
+    pthread_t *thread_decomp;
     char magic[FSA_SIZEOF_MAGIC+1];
     cdico *dicomainhead=NULL;
     cdico *dirsinfo=NULL;
@@ -1369,19 +1376,24 @@ int oper_restore(char *archive, int argc, char **argv, int oper)
     exar.cost_current=0;
     archreader_init(&exar.ai);
     
+    // the number of decompression threads is only known at run time
+    if ((thread_decomp=calloc(g_options.compressjobs, sizeof(pthread_t)))==NULL)
+    {   errprintf("calloc(%d) failed: out of memory\n", g_options.compressjobs);
+        return -1;
+    }
+    
     // init misc data struct to zero
     for (i=0; i<FSA_MAX_FSPERARCH; i++)
         dicoargv[i]=NULL;
     for (i=0; i<FSA_MAX_FSPERARCH; i++)
         dicofsinfo[i]=NULL;
-    for (i=0; i<FSA_MAX_COMPJOBS; i++)
-        thread_decomp[i]=0;
     for (i=0; i<FSA_MAX_FSPERARCH; i++)
         g_fsbitmap[i]=0;
     thread_reader=0;
     
     // set archive path
     snprintf(exar.ai.basepath, PATH_MAX, "%s", archive);
+    exar.ai.stream=(strcmp(archive, FSA_STREAM_PATH)==0);
     
     // convert the command line arguments to dicos and init g_fsbitmap
     switch (oper)
@@ -1403,9 +1415,17 @@ int oper_restore(char *archive, int argc, char **argv, int oper)
     }
 
     // create decompression threads
-    for (i=0; (i<g_options.compressjobs) && (i<FSA_MAX_COMPJOBS); i++)
+    if (g_options.numa==true) // one todo ring per node in the queue
+        queue_set_todo_rings(&g_queue, blkbuf_init_numa());
+    if (blkbuf_init_pool(g_options.hugepages, g_options.queuemem)!=0)
+    {   errprintf("cannot create the pool of buffers\n");
+        ret=-1;
+        goto do_extract_error;
+    }
+    thread_comp_init_pool(g_options.compressjobs, g_options.autojobs);
+    for (i=0; i<g_options.compressjobs; i++)
     {
-        if (pthread_create(&thread_decomp[i], NULL, thread_decomp_fct, NULL) != 0)
+        if (pthread_create(&thread_decomp[i], NULL, thread_decomp_fct, (void*)(long)i) != 0)
         {   errprintf("pthread_create(thread_decomp_fct) failed\n");
             goto do_extract_error;
         }
@@ -1608,9 +1628,10 @@ do_extract_success:
     msgprintf(MSG_DEBUG1, "THREAD-MAIN2: queue is now empty\n");
     // the queue is empty, so thread_compress should now exit
     
-    for (i=0; (i<g_options.compressjobs) && (i<FSA_MAX_COMPJOBS); i++)
+    for (i=0; i<g_options.compressjobs; i++)
         if (thread_decomp[i] && pthread_join(thread_decomp[i], NULL) != 0)
             errprintf("pthread_join(thread_decomp) failed\n");
+    free(thread_decomp);
     
     if (thread_reader && pthread_join(thread_reader, NULL) != 0)
         errprintf("pthread_join(thread_reader) failed\n");
@@ -29,7 +29,10 @@
 #include <sys/param.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <attr/xattr.h>
+#include <linux/fiemap.h>
 #include <zlib.h>
 #include <assert.h>
 #include <gcrypt.h>
@@ -58,19 +61,59 @@
 #include "crypto.h"
 #include "error.h"
 #include "queue.h"
+#include "blkbuf.h"
+#include "readahead.h"
+#include "blkread.h"
+#include "walker.h"
 
 typedef struct s_savear
 {   carchwriter ai;
     cregmulti   regmulti;
     cdichl      *dichardlinks;
     cstats      stats;
+    creadahead  readahead;
+    cblkread    blkread;
+    cwalker     walker;
     int         fstype;
     int         fsid;
     u64         objectid;
     u64         cost_global;
     u64         cost_current;
+    u64         cost_start; // cost_current when the current filesystem or directory has been started
+    u64         cost_estimate; // estimated cost of the current filesystem or directory (included in cost_global)
+    u64         inodes_used; // inodes used on the current filesystem (0 when the estimate is not refined)
+    u64         items_done; // items of the current filesystem or directory which have been saved
 } csavear;
 
+// entry of a directory which has been read before its items are saved
+typedef struct s_direntry
+{   char        *name;
+    struct stat64 statbuf;
+    cwalkjob    *job; // sub-directory which is read by a walker thread
+    cdico       *attrdico; // xattr and winattr sections when they have been read with the directory
+    int         attrerrors; // how many errors happened when attrdico was read
+    char        *data; // contents of a small file which has been read by a walker thread
+    int         datares; // result of createar_read_smallfile() for data
+    u8          md5sum[16]; // checksum of data
+    u64         ino; // inode number given by readdir
+    u64         physpos; // position of the first extent of a regular file on the disk (0 if unknown)
+    s64         raseq; // sequence number of the file in the readahead thread (0 if it has not been given to it)
+} cdirentry;
+
+enum {DIRSCAN_SUCCESS=0, DIRSCAN_EOPEN, DIRSCAN_ESTAT, DIRSCAN_EENTRY};
+
+// directory which has been read by the main thread or by a walker thread
+typedef struct s_dirscan
+{   char        *root;
+    char        *path;
+    bool        evaluation; // only the cost of the items is required
+    bool        prepare; // read the small files in advance (walker threads)
+    int         result; // DIRSCAN_xxx
+    struct stat64 statbuf; // attributes of the directory itself
+    cdirentry   *entries;
+    int         count;
+} cdirscan;
+
 typedef struct s_devinfo
 {   char        devpath[PATH_MAX];
     char        partmount[PATH_MAX];
@@ -78,28 +121,27 @@ typedef struct s_devinfo
     int         fstype;
 } cdevinfo;
 
-int createar_obj_regfile_multi(csavear *save, cdico *header, char *relpath, char *fullpath, u64 filesize)
+// release the data of a small file which has been read in advance (it's counted in the memory of the queue)
+static void createar_entry_free_data(cdirentry *entry)
+{
+    if (entry->data!=NULL)
+    {   queue_release_bytes(&g_queue, entry->statbuf.st_size);
+        free(entry->data);
+        entry->data=NULL;
+    }
+}
+
+// read a small file and its checksum: returns 1 when it has been truncated (padded with zeros) and -1 on errors
+int createar_read_smallfile(int fd, char *relpath, u64 filesize, char *databuf, u8 *md5sum)
 {
-    char databuf[FSA_MAX_SMALLFILESIZE];
-    u8 md5sum[16];
     int ret=0;
     int res;
-    int fd;
-    
-    // The checksum will be in the obj-header not in a file footer
-    if ((fd=open64(fullpath, O_RDONLY|O_LARGEFILE))<0)
-    {   sysprintf("Cannot open small file %s for reading\n", relpath);
-        return -1;
-    }
-    
-    msgprintf(MSG_DEBUG1, "backup_obj_regfile_multi(file=%s, size=%lld)\n", relpath, (long long)filesize);
     
     res=read(fd, databuf, (long)filesize);
-    close(fd);
     if (res!=filesize)
     {   
         if (res>=0 && res<filesize) // file has been truncated: pad with zeros
-        {   ret=-1;
+        {   ret=1;
             errprintf("file [%s] has been truncated to %lld bytes (original size: %lld): padding with zeros\n", 
                 relpath, (long long)res, (long long)filesize);
             memset(databuf+res, 0, filesize-res); // zero out remaining bytes
@@ -111,6 +153,39 @@ int createar_obj_regfile_multi(csavear *save, cdico *header, char *relpath, char
     }
     
     gcry_md_hash_buffer(GCRY_MD_MD5, md5sum, databuf, filesize);
+    return ret;
+}
+
+int createar_obj_regfile_multi(csavear *save, cdico *header, char *relpath, char *fullpath, u64 filesize, cdirentry *entry)
+{
+    char databuf[FSA_MAX_SMALLFILESIZE];
+    char *data=databuf;
+    u8 md5sum[16];
+    int ret=0;
+    int res;
+    int fd;
+    
+    msgprintf(MSG_DEBUG1, "backup_obj_regfile_multi(file=%s, size=%lld)\n", relpath, (long long)filesize);
+    
+    // The checksum will be in the obj-header not in a file footer
+    if ((entry!=NULL) && (entry->data!=NULL)) // the file has already been read by a walker thread
+    {   data=entry->data;
+        res=entry->datares;
+        memcpy(md5sum, entry->md5sum, 16);
+    }
+    else
+    {   if ((fd=open64(fullpath, O_RDONLY|O_LARGEFILE))<0)
+        {   sysprintf("Cannot open small file %s for reading\n", relpath);
+            return -1;
+        }
+        res=createar_read_smallfile(fd, relpath, filesize, databuf, md5sum);
+        close(fd);
+    }
+    if (res<0)
+        return -1;
+    if (res>0) // file has been truncated: it has been padded with zeros
+        ret=-1;
+    
     dico_add_data(header, 0, DISKITEMKEY_MD5SUM, md5sum, 16);
     
     // if shared-block with many small files is full, push it to queue and make a new one
@@ -125,7 +200,10 @@ int createar_obj_regfile_multi(csavear *save, cdico *header, char *relpath, char
     }
     
     // copy current small file to the shared-block
-    if (regmulti_save_addfile(&save->regmulti, header, databuf, filesize)!=0)
+    res=regmulti_save_addfile(&save->regmulti, header, data, filesize);
+    if (entry!=NULL) // the memory of the file which has been read in advance is not needed anymore
+        createar_entry_free_data(entry);
+    if (res!=0)
     {   errprintf("Cannot add small-file %s to regmulti structure\n", relpath);
         return -1;
     }
@@ -135,14 +213,18 @@ int createar_obj_regfile_multi(csavear *save, cdico *header, char *relpath, char
 
 int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, char *fullpath, u64 filesize) // large or empty files
 {
+    struct s_blkreadslot slot;
     cdico *footerdico=NULL;
     struct s_blockinfo blkinfo;
     gcry_md_hd_t md5ctx;
+    bool parallel=false;
+    u64 blocknum;
     u32 curblocksize;
     bool eof=false;
     u64 remaining;
     char text[256];
     u8 *origblock;
+    int blknode;
     u8 *md5tmp;
     u8 md5sum[16];
     u64 filepos;
@@ -157,6 +239,7 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
     
     if ((fd=open64(fullpath, O_RDONLY|O_LARGEFILE))<0)
     {   sysprintf("Cannot open %s for reading\n", relpath);
+        gcry_md_close(md5ctx);
         return -1;
     }
     
@@ -164,22 +247,43 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
     queue_add_header(&g_queue, header, FSA_MAGIC_OBJT, save->fsid);
     
     msgprintf(MSG_DEBUG1, "backup_obj_regfile_unique(file=%s, size=%lld)\n", relpath, (long long)filesize);
-    for (filepos=0; (filesize>0) && (filepos < filesize) && (get_interrupted()==false); filepos+=curblocksize)
+    
+    // large files are read by several threads at the same time, the blocks are still taken in order
+    if ((save->blkread.threadcount>0) && (filesize >= (u64)g_options.datablocksize*FSA_BLKREAD_MINBLOCKS))
+    {   parallel=true;
+        blkread_start(&save->blkread, fd, filesize, g_options.datablocksize);
+    }
+    
+    for (blocknum=0, filepos=0; (filesize>0) && (filepos < filesize) && (get_interrupted()==false); filepos+=curblocksize, blocknum++)
     {
         remaining=filesize-filepos;
         curblocksize=min(remaining, g_options.datablocksize);
         msgprintf(MSG_DEBUG2, "----> filepos=%lld, remaining=%lld, curblocksize=%lld\n", (long long)filepos, (long long)remaining, (long long)curblocksize);
         
-        origblock=malloc(curblocksize);
+        if (parallel==true) // the block has been read with pread() by a read thread
+        {   if (blkread_take(&save->blkread, blocknum, &slot)!=0)
+            {   ret=-1;
+                goto backup_obj_regfile_unique_error;
+            }
+            blknode=slot.node;
+            origblock=(u8*)slot.data;
+            res=slot.res;
+            errno=slot.err;
+        }
+        else
+        {   blknode=blkbuf_pick_node(); // the block will be processed by a thread running on that node
+            origblock=(u8*)blkbuf_alloc(curblocksize, blknode);
+            res=((origblock!=NULL) && (eof==false))?read(fd, origblock, (long)curblocksize):0;
+        }
         if (!origblock)
-        {   errprintf("malloc(%ld) failed: cannot allocate data block\n", (long)origblock);
+        {   errprintf("blkbuf_alloc(%ld) failed: cannot allocate data block\n", (long)curblocksize);
             ret=-1;
             goto backup_obj_regfile_unique_error;
         }
         
-        if (eof==false) // file has not been truncated: read the next block
+        if (eof==false) // file has not been truncated: check the block which has been read
         {
-            if ((res=read(fd, origblock, (long)curblocksize))!=curblocksize)
+            if (res!=curblocksize)
             {   ret=-1;
                 if (res>=0 && res<curblocksize) // file has been truncated: pad with zeros
                 {   errprintf("file [%s] has been truncated to %lld bytes (original size: %lld): padding with zeros\n", 
@@ -187,8 +291,9 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
                     eof=true; // set oef to true so that we don't try to read the next blocks
                     memset(origblock+res, 0, curblocksize-res); // zero out remaining bytes
                 }
-                else if (res<0) // read error
+                else if (res<0) // read error: the block is not given to the queue
                 {   sysprintf("Cannot read data block from %s, block=%ld and res=%ld\n", relpath, (long)curblocksize, (long)res);
+                    blkbuf_free((char*)origblock);
                     ret=-1;
                     goto backup_obj_regfile_unique_error;
                 }
@@ -207,6 +312,7 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
         blkinfo.blkdata=(char*)origblock;
         blkinfo.blkoffset=filepos;
         blkinfo.blkfsid=save->fsid;
+        blkinfo.blknode=blknode;
         if (queue_add_block(&g_queue, &blkinfo, QITEM_STATUS_TODO)!=0)
         {   sysprintf("queue_add_block(%s) failed\n", relpath);
             ret=-1;
@@ -228,6 +334,7 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
     }
     memcpy(md5sum, md5tmp, 16);
     gcry_md_close(md5ctx);
+    md5ctx=NULL;
     
     msgprintf(MSG_DEBUG1, "--> finished loop for file=%s, size=%lld, md5=[%s]\n", relpath, (long long)filesize, format_md5(text, sizeof(text), md5sum));
     
@@ -249,16 +356,20 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
     }
     
 backup_obj_regfile_unique_error:
+    if (md5ctx!=NULL)
+        gcry_md_close(md5ctx);
+    if (parallel==true) // the read threads must not use the file anymore
+        blkread_finish(&save->blkread);
     close(fd);
     return ret;
 }
 
-int createar_item_xattr(csavear *save, char *root, char *relpath, struct stat64 *statbuf, cdico *d)
+// the xattrs are read through xattrpath when it is set (path relative to the descriptor of the parent directory)
+int createar_item_xattr(csavear *save, char *root, char *relpath, struct stat64 *statbuf, cdico *d, char *xattrpath)
 {
     char fullpath[PATH_MAX];
-    char *valbuf=NULL;
+    char valbuf[65536];
     char buffer[4096];
-    s64 attrsize;
     int valsize=0;
     int listlen;
     u64 attrcnt;
@@ -267,7 +378,10 @@ int createar_item_xattr(csavear *save, char *root, char *relpath, struct stat64
     int len;
     
     // init
-    concatenate_paths(fullpath, sizeof(fullpath), root, relpath);
+    if (xattrpath!=NULL)
+        snprintf(fullpath, sizeof(fullpath), "%s", xattrpath);
+    else
+        concatenate_paths(fullpath, sizeof(fullpath), root, relpath);
     attrcnt=0;
     
     memset(buffer, 0, sizeof(buffer));
@@ -277,56 +391,44 @@ int createar_item_xattr(csavear *save, char *root, char *relpath, struct stat64
     for (pos=0; (pos<listlen) && (pos<sizeof(buffer)); pos+=len)
     {
         len=strlen(buffer+pos)+1;
-        attrsize=lgetxattr(fullpath, buffer+pos, NULL, 0);
-        msgprintf(MSG_VERB2, "            xattr:file=[%s], attrid=%d, name=[%s], size=%ld\n", relpath, (int)attrcnt, buffer+pos, (long)attrsize);
-        if (attrsize>65535LL)
-        {   errprintf("file [%s] has an xattr [%s] with data too big (size=%ld, maxsize=64k)\n", relpath, buffer+pos, (long)attrsize);
-            ret=-1;
-            continue; // copy the next xattr
-        }
+        // the value is read in a buffer which is big enough for any valid xattr: no need to ask for its size first
         errno=0;
-        if ((valbuf=malloc(attrsize+1))==NULL)
-        {   sysprintf("malloc(%ld) failed\n", (long)(attrsize+1));
+        valsize=lgetxattr(fullpath, buffer+pos, valbuf, sizeof(valbuf));
+        msgprintf(MSG_VERB2, "            xattr:file=[%s], attrid=%d, name=[%s], size=%ld\n", relpath, (int)attrcnt, buffer+pos, (long)valsize);
+        if ((valsize>65535) || ((valsize<0) && (errno==ERANGE)))
+        {   errprintf("file [%s] has an xattr [%s] with data too big (maxsize=64k)\n", relpath, buffer+pos);
             ret=-1;
-            continue; // ignore the current xattr
+            continue; // copy the next xattr
         }
-        errno=0;
-        valsize=lgetxattr(fullpath, buffer+pos, valbuf, attrsize);
-        msgprintf(MSG_VERB2, "            xattr:lgetxattr(%s,%s)=%d\n", relpath, buffer+pos, valsize);
         if (valsize>=0)
         {
             msgprintf(MSG_VERB2,  "            xattr:lgetxattr(%s,%s)=%d: [%s]\n", relpath, buffer+pos, valsize, buffer+pos);
-            msgprintf(MSG_DEBUG2, "            xattr:lgetxattr(%s)=%d: [%s]=[%s]\n", relpath, valsize, buffer+pos, valbuf);
             msgprintf(MSG_DEBUG2, "            xattr:dico_add_string(%s, xattr): key=%d, name=[%s]\n", relpath, (int)(2*attrcnt)+0, buffer+pos);
             dico_add_string(d, DICO_OBJ_SECTION_XATTR, (2*attrcnt)+0, buffer+pos);
             msgprintf(MSG_DEBUG2, "            xattr:dico_add_data(%s, xattr): key=%d, data (size=[%d])\n", relpath, (int)(2*attrcnt)+1, valsize);
             dico_add_data(d, DICO_OBJ_SECTION_XATTR, (2*attrcnt)+1, valbuf, valsize);
             attrcnt++;
-            free(valbuf);
         }
         else if (errno!=ENOATTR) // if the attribute exists and we cannot read it
         {
             sysprintf("            xattr:lgetxattr(%s,%s)=%d\n", relpath, buffer+pos, valsize);
             ret=-1;
-            free(valbuf);
             continue; // copy the next xattr
         }
         else // errno==ENOATTR hence the attribute does not exist
         {
             msgprintf(MSG_VERB2, "            xattr:lgetxattr-win(%s,%s)=-1: errno==ENOATTR\n", relpath, buffer+pos);
-            free(valbuf);
         }
     }
     
     return ret;
 }
 
-int createar_item_winattr(csavear *save, char *root, char *relpath, struct stat64 *statbuf, cdico *d)
+int createar_item_winattr(csavear *save, char *root, char *relpath, struct stat64 *statbuf, cdico *d, char *xattrpath)
 {
     char fullpath[PATH_MAX];
-    char *valbuf=NULL;
+    char valbuf[65536];
     int valsize=0;
-    s64 attrsize;
     u64 attrcnt;
     int ret=0;
     int i;
@@ -334,7 +436,10 @@ int createar_item_winattr(csavear *save, char *root, char *relpath, struct stat6
     char *winattr[]= {"system.ntfs_acl", "system.ntfs_attrib", "system.ntfs_reparse_data", "system.ntfs_times", "system.ntfs_dos_name", NULL};
     
     // init
-    concatenate_paths(fullpath, sizeof(fullpath), root, relpath);
+    if (xattrpath!=NULL)
+        snprintf(fullpath, sizeof(fullpath), "%s", xattrpath);
+    else
+        concatenate_paths(fullpath, sizeof(fullpath), root, relpath);
     attrcnt=0;
     
     for (i=0; winattr[i]; i++)
@@ -343,51 +448,31 @@ int createar_item_winattr(csavear *save, char *root, char *relpath, struct stat6
             continue;
         
         errno=0;
-        if ((attrsize=lgetxattr(fullpath, winattr[i], NULL, 0)) < 0) // get the size of the attribute
-        {
-            if (errno!=ENOATTR)
-            {
-                sysprintf("           winattr:lgetxattr(%s,%s): returned negative attribute size\n", relpath, winattr[i]); // output if there are any other error
-                ret=-1;
-            }
-            continue; // ignore the current xattr
-        }
-        msgprintf(MSG_VERB2, "            winattr:file=[%s], attrcnt=%d, name=[%s], size=%ld\n", relpath, (int)attrcnt, winattr[i], (long)attrsize);
-        if (attrsize>65535LL)
-        {
-            errprintf("file [%s] has an xattr [%s] with data size=%ld too big (max xattr size is 65535)\n", relpath, winattr[i], (long)attrsize);
-            ret=-1;
-            continue; // ignore the current xattr
-        }
-        errno=0;
-        if ((valbuf=malloc(attrsize+1))==NULL)
+        valsize=lgetxattr(fullpath, winattr[i], valbuf, sizeof(valbuf));
+        msgprintf(MSG_VERB2, "            winattr:lgetxattr-win(%s,%s)=%d\n", relpath, winattr[i], valsize);
+        if ((valsize>65535) || ((valsize<0) && (errno==ERANGE)))
         {
-            sysprintf("malloc(%d) failed\n", (int)(attrsize+1));
+            errprintf("file [%s] has an xattr [%s] with data too big (max xattr size is 65535)\n", relpath, winattr[i]);
             ret=-1;
             continue; // ignore the current xattr
         }
-        valsize=lgetxattr(fullpath, winattr[i], valbuf, attrsize);
-        msgprintf(MSG_VERB2, "            winattr:lgetxattr-win(%s,%s)=%d\n", relpath, winattr[i], valsize);
         if (valsize>=0)
         {
             msgprintf(MSG_VERB2, "            winattr:dico_add_string(%s, winattr): key=%d, name=[%s]\n", relpath, (int)(2*attrcnt)+0, winattr[i]);
             dico_add_string(d, DICO_OBJ_SECTION_WINATTR, (2*attrcnt)+0, winattr[i]);
             msgprintf(MSG_VERB2, "            winattr:dico_add_data(%s, winattr): key=%d, data (size=[%d])\n", relpath, (int)(2*attrcnt)+1, valsize);
             dico_add_data(d, DICO_OBJ_SECTION_WINATTR, (2*attrcnt)+1, valbuf, valsize);
-            free(valbuf);
             attrcnt++;
         }
         else if (errno!=ENOATTR) // if the attribute exists and we cannot read it
         {
             sysprintf("            winattr:lgetxattr(%s,%s)=%d\n", relpath, winattr[i], valsize);
             ret=-1;
-            free(valbuf);
             continue; // ignore the current xattr
         }
         else // errno==ENOATTR hence the attribute does not exist
         {
             msgprintf(MSG_VERB2, "            winattr:lgetxattr-win(%s,%s)=-1: errno==ENOATTR\n", relpath, winattr[i]);
-            free(valbuf);
         }
     }
     
@@ -570,7 +655,26 @@ int createar_item_stdattr(csavear *save, char *root, char *relpath, struct stat6
     return 0;
 }
 
-int createar_save_file(csavear *save, char *root, char *relpath, struct stat64 *statbuf, u64 *costeval)
+// the estimate of statvfs includes the metadata of the filesystem and the excluded items: once enough items have
+// been saved, the cost of the items which remain is extrapolated from the average cost of the items already saved
+static void createar_refine_cost(csavear *save)
+{
+    u64 estimate;
+    u64 done;
+    
+    save->items_done++;
+    if ((save->inodes_used==0) || (save->items_done < FSA_COST_MINITEMS))
+        return;
+    
+    done=save->cost_current-save->cost_start;
+    estimate=done;
+    if (save->inodes_used > save->items_done)
+        estimate+=(done/save->items_done)*(save->inodes_used-save->items_done);
+    save->cost_global=save->cost_global-save->cost_estimate+estimate;
+    save->cost_estimate=estimate;
+}
+
+int createar_save_file(csavear *save, char *root, char *relpath, struct stat64 *statbuf, cdirentry *entry)
 {
     char fullpath[PATH_MAX];
     char strprogress[256];
@@ -602,25 +706,25 @@ int createar_save_file(csavear *save, char *root, char *relpath, struct stat64 *
         attrerrors++;
     }
     
-    // --- cost required for the progression info
-    if (costeval!=NULL) 
-    {   *costeval+=filecost;
-        dico_destroy(dicoattr);
-        return 0;
-    }
-    
     // ---- backup other file attributes (xattr + winattr)
-    if (createar_item_xattr(save, root, relpath, statbuf, dicoattr)!=0)
-    {   msgprintf(MSG_STACK, "backup_item_xattr() failed: cannot prepare xattr-dico for item %s\n", relpath);
-        attrerrors++;
+    if ((entry!=NULL) && (entry->attrdico!=NULL)) // they have already been read with the directory
+    {   dico_append(dicoattr, entry->attrdico);
+        attrerrors+=entry->attrerrors;
     }
-    
-    if (filesys[save->fstype].winattr==true)
-    {
-        if (createar_item_winattr(save, root, relpath, statbuf, dicoattr)!=0)
-        {   msgprintf(MSG_STACK, "backup_item_winattr() failed: cannot prepare winattr-dico for item %s\n", relpath);
+    else
+    {   
+        if (createar_item_xattr(save, root, relpath, statbuf, dicoattr, NULL)!=0)
+        {   msgprintf(MSG_STACK, "backup_item_xattr() failed: cannot prepare xattr-dico for item %s\n", relpath);
             attrerrors++;
         }
+        
+        if (filesys[save->fstype].winattr==true)
+        {
+            if (createar_item_winattr(save, root, relpath, statbuf, dicoattr, NULL)!=0)
+            {   msgprintf(MSG_STACK, "backup_item_winattr() failed: cannot prepare winattr-dico for item %s\n", relpath);
+                attrerrors++;
+            }
+        }
     }
     
     // ---- file details and progress bar
@@ -629,6 +733,7 @@ int createar_save_file(csavear *save, char *root, char *relpath, struct stat64 *
         memset(strprogress, 0, sizeof(strprogress));
         if (save->cost_global>0)
         {   save->cost_current+=filecost;
+            createar_refine_cost(save);
             progress=((save->cost_current)*100)/(save->cost_global);
             if (progress>=0 && progress<=100)
                 snprintf(strprogress, sizeof(strprogress), "[%3d%%]", (int)progress);
@@ -711,7 +816,7 @@ int createar_save_file(csavear *save, char *root, char *relpath, struct stat64 *
                 dico_destroy(dicoattr);
                 return 0; // error is not fatal, operation must continue
             }
-            if ((res=createar_obj_regfile_multi(save, dicoattr, relpath, fullpath, statbuf->st_size))!=0)
+            if ((res=createar_obj_regfile_multi(save, dicoattr, relpath, fullpath, statbuf->st_size, entry))!=0)
             {   msgprintf(MSG_STACK, "backup_obj_regfile_multi(%s)=%d failed\n", relpath, res);
                 save->stats.err_regfile++;
                 return 0; // not a fatal error, oper must continue
@@ -729,89 +834,457 @@ int createar_save_file(csavear *save, char *root, char *relpath, struct stat64 *
     return 0;
 }
 
-int createar_save_directory(csavear *save, char *root, char *path, u64 *costeval)
+// give the next regular files of the directory to the readahead thread, as many as it can take, and
+// then the directory which is saved after them (*next is count+1 when it has been given too)
+static void createar_readahead_feed(csavear *save, char *fulldirpath, cdirentry *entries, int count, int *next, char *nextdir)
 {
-    char fulldirpath[PATH_MAX];
     char fullpath[PATH_MAX];
+    s64 seq;
+    
+    for (; *next < count; (*next)++)
+    {
+        if ((!S_ISREG(entries[*next].statbuf.st_mode)) || (entries[*next].statbuf.st_size==0))
+            continue;
+        concatenate_paths(fullpath, sizeof(fullpath), fulldirpath, entries[*next].name);
+        if ((seq=readahead_add(&save->readahead, fullpath, entries[*next].statbuf.st_size, false))<0)
+            return;
+        entries[*next].raseq=seq;
+    }
+    if ((*next==count) && (nextdir!=NULL) && (readahead_add(&save->readahead, nextdir, 0, true)>0))
+        (*next)++;
+}
+
+static cdirscan *createar_scan_alloc(char *root, char *path, bool evaluation, bool prepare)
+{
+    cdirscan *scan;
+    
+    if ((scan=calloc(1, sizeof(cdirscan)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(cdirscan));
+        return NULL;
+    }
+    if ((scan->path=strdup(path))==NULL)
+    {   errprintf("strdup(%s) failed: out of memory\n", path);
+        free(scan);
+        return NULL;
+    }
+    scan->root=root;
+    scan->evaluation=evaluation;
+    scan->prepare=prepare;
+    return scan;
+}
+
+// the sub-directories which have not been taken are cancelled: the walker threads stop reading them
+static void createar_scan_free(void *ctx, void *data)
+{
+    csavear *save=(csavear *)ctx;
+    cdirscan *scan=(cdirscan *)data;
+    int i;
+    
+    for (i=0; i < scan->count; i++)
+    {   if (scan->entries[i].job!=NULL)
+            walker_cancel(&save->walker, scan->entries[i].job);
+        free(scan->entries[i].name);
+        createar_entry_free_data(&scan->entries[i]);
+        if (scan->entries[i].attrdico!=NULL)
+            dico_destroy(scan->entries[i].attrdico);
+    }
+    free(scan->entries);
+    free(scan->path);
+    free(scan);
+}
+
+// read the attributes of the entries relative to the descriptor of the directory (through /proc/self/fd so
+// that the path is not resolved again), only the small files which are read in advance are opened
+static void createar_prepare_entries(csavear *save, cdirscan *scan, int dirfd)
+{
+    char xattrpath[PATH_MAX];
     char relpath[PATH_MAX];
+    char dirpath[64];
+    cdirentry *entry;
+    u64 datasize=0;
+    bool useproc;
+    int fd;
+    int i;
+    
+    // the full path is used when /proc is not mounted
+    snprintf(dirpath, sizeof(dirpath), "/proc/self/fd/%d", dirfd);
+    useproc=(access(dirpath, X_OK)==0);
+    
+    for (i=0; (i < scan->count) && (get_interrupted()==false); i++)
+    {
+        entry=&scan->entries[i];
+        concatenate_paths(relpath, sizeof(relpath), scan->path, entry->name);
+        
+        if ((entry->attrdico=dico_alloc())==NULL)
+        {   errprintf("dico_alloc() failed\n");
+            return; // the main thread will read them
+        }
+        if (useproc==true)
+            concatenate_paths(xattrpath, sizeof(xattrpath), dirpath, entry->name);
+        
+        if (createar_item_xattr(save, scan->root, relpath, &entry->statbuf, entry->attrdico, (useproc==true)?xattrpath:NULL)!=0)
+        {   msgprintf(MSG_STACK, "backup_item_xattr() failed: cannot prepare xattr-dico for item %s\n", relpath);
+            entry->attrerrors++;
+        }
+        if (filesys[save->fstype].winattr==true)
+        {
+            if (createar_item_winattr(save, scan->root, relpath, &entry->statbuf, entry->attrdico, (useproc==true)?xattrpath:NULL)!=0)
+            {   msgprintf(MSG_STACK, "backup_item_winattr() failed: cannot prepare winattr-dico for item %s\n", relpath);
+                entry->attrerrors++;
+            }
+        }
+        
+        // files which will be packed with other small files are read as long as the directory does not use too much
+        // memory, and this memory is counted in the budget of the queue (the file is read later if there is no room)
+        if ((scan->prepare==true) && (S_ISREG(entry->statbuf.st_mode)) && (entry->statbuf.st_size > 0) 
+            && (entry->statbuf.st_size < g_options.smallfilethresh) && (entry->statbuf.st_nlink==1) 
+            && (datasize+entry->statbuf.st_size <= FSA_WALKER_MAXDATA) && (queue_reserve_bytes(&g_queue, entry->statbuf.st_size)==0))
+        {
+            fd=openat(dirfd, entry->name, O_RDONLY|O_LARGEFILE|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC);
+            if ((fd>=0) && ((entry->data=malloc(entry->statbuf.st_size))!=NULL))
+            {   datasize+=entry->statbuf.st_size;
+                entry->datares=createar_read_smallfile(fd, relpath, entry->statbuf.st_size, entry->data, entry->md5sum);
+            }
+            else // the main thread will read it
+            {   queue_release_bytes(&g_queue, entry->statbuf.st_size);
+            }
+            if (fd>=0)
+                close(fd);
+        }
+    }
+}
+
+#ifndef FS_IOC_FIEMAP
+#define FS_IOC_FIEMAP _IOWR('f', 11, struct fiemap)
+#endif
+
+// position of the first extent of a file on the disk (0 if the filesystem does not support FIEMAP)
+static u64 createar_first_extent(int dirfd, char *name)
+{
+    u64 buffer[(sizeof(struct fiemap)+sizeof(struct fiemap_extent))/sizeof(u64)+1];
+    struct fiemap *fm=(struct fiemap *)buffer;
+    u64 physpos=0;
+    int fd;
+    
+    if ((fd=openat(dirfd, name, O_RDONLY|O_LARGEFILE|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC))<0)
+        return 0;
+    memset(buffer, 0, sizeof(buffer));
+    fm->fm_start=0;
+    fm->fm_length=FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count=1;
+    if ((ioctl(fd, FS_IOC_FIEMAP, fm)==0) && (fm->fm_mapped_extents>0))
+        physpos=fm->fm_extents[0].fe_physical;
+    close(fd);
+    return physpos;
+}
+
+static int createar_cmp_ino(const void *a, const void *b)
+{
+    const cdirentry *e1=(const cdirentry *)a;
+    const cdirentry *e2=(const cdirentry *)b;
+    
+    if (e1->ino!=e2->ino)
+        return (e1->ino < e2->ino)?-1:1;
+    return 0;
+}
+
+static int createar_cmp_physpos(const void *a, const void *b)
+{
+    const cdirentry *e1=(const cdirentry *)a;
+    const cdirentry *e2=(const cdirentry *)b;
+    
+    if (e1->physpos!=e2->physpos)
+        return (e1->physpos < e2->physpos)?-1:1;
+    return createar_cmp_ino(a, b);
+}
+
+// the files of each window of entries are read in the order of their data on the disk, and the windows
+// stay in the order of the inodes so that the reading of the data does not scatter the reading of the inodes
+static void createar_sort_physical(cdirscan *scan, int dirfd)
+{
+    int i;
+    
+    for (i=0; (i < scan->count) && (get_interrupted()==false); i++)
+    {
+        if ((!S_ISREG(scan->entries[i].statbuf.st_mode)) || (scan->entries[i].statbuf.st_size==0))
+            continue;
+        scan->entries[i].physpos=createar_first_extent(dirfd, scan->entries[i].name);
+    }
+    
+    for (i=0; i < scan->count; i+=FSA_DISKORDER_WINDOW)
+        qsort(&scan->entries[i], min(FSA_DISKORDER_WINDOW, scan->count-i), sizeof(cdirentry), createar_cmp_physpos);
+}
+
+// entry returned by getdents64
+struct s_dirent64
+{   u64            d_ino;
+    s64            d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+// read the attributes of a directory and of all its entries: the entries are read through the descriptor
+// of the directory so that the kernel does not have to resolve the full path of each entry
+static void createar_read_directory(csavear *save, cdirscan *scan)
+{
+    char fulldirpath[PATH_MAX];
+    char relpath[PATH_MAX];
+    struct s_dirent64 *dent;
     struct stat64 statbuf;
-    struct dirent *dir;
-    DIR *dirdesc;
-    int ret=0;
+    cdirentry *newentries;
+    cdirentry *entry;
+    char *dentbuf=NULL;
+    int maxcount=0;
+    int dirfd;
+    int count;
+    long len;
+    long pos;
+    int i;
     
     // init
-    concatenate_paths(fulldirpath, sizeof(fulldirpath), root, path);
+    concatenate_paths(fulldirpath, sizeof(fulldirpath), scan->root, scan->path);
     
-    if (!(dirdesc=opendir(fulldirpath)))
+    if ((dirfd=open64(fulldirpath, O_RDONLY|O_DIRECTORY|O_CLOEXEC))<0)
     {   sysprintf("cannot open directory %s\n", fulldirpath);
-        return 0; // not a fatal error, oper must continue
+        scan->result=DIRSCAN_EOPEN; // not a fatal error, oper must continue
+        return;
     }
     
-    // backup the directory itself (important for the root of the filesystem)
-    if (lstat64(fulldirpath, &statbuf)!=0)
-    {   sysprintf("cannot lstat64(%s)\n", fulldirpath);
-        ret=-1;
-        goto backup_dir_err;
+    // the directory itself (important for the root of the filesystem)
+    if (fstat64(dirfd, &scan->statbuf)!=0)
+    {   sysprintf("cannot fstat64(%s)\n", fulldirpath);
+        scan->result=DIRSCAN_ESTAT;
+        goto read_dir_err;
     }
     
-    // save info about the directory itself
-    if (createar_save_file(save, root, path, &statbuf, costeval)!=0)
-    {   errprintf("createar_save_file(%s,%s) failed\n", root, path);
-        ret=-1;
-        goto backup_dir_err;
+    if ((dentbuf=malloc(FSA_GETDENTS_BUFSIZE))==NULL)
+    {   errprintf("malloc(%ld) failed: out of memory\n", (long)FSA_GETDENTS_BUFSIZE);
+        scan->result=DIRSCAN_EENTRY;
+        goto read_dir_err;
     }
     
-    while (((dir = readdir(dirdesc)) != NULL) && (get_interrupted()==false))
+    // read all the entries first so that the next files are known while the current one is saved
+    while ((get_interrupted()==false) && ((len=syscall(SYS_getdents64, dirfd, dentbuf, FSA_GETDENTS_BUFSIZE)) > 0))
     {
-        // ---- ignore "." and ".." and ignore mount-points
-        if (strcmp(dir->d_name,".")==0 || strcmp(dir->d_name,"..")==0)
-            continue; // ignore "." and ".."
-        
-        // ---- calculate paths
-        concatenate_paths(relpath, sizeof(relpath), path, dir->d_name);
-        concatenate_paths(fullpath, sizeof(fullpath), fulldirpath, dir->d_name);
+        for (pos=0; pos < len; pos+=dent->d_reclen)
+        {
+            dent=(struct s_dirent64 *)(dentbuf+pos);
+            
+            // ---- ignore "." and ".." and ignore mount-points
+            if (strcmp(dent->d_name,".")==0 || strcmp(dent->d_name,"..")==0)
+                continue; // ignore "." and ".."
+            
+            if (scan->count==maxcount)
+            {   maxcount=max(64, maxcount*2);
+                if ((newentries=realloc(scan->entries, maxcount*sizeof(cdirentry)))==NULL)
+                {   errprintf("realloc(%ld) failed: out of memory\n", (long)(maxcount*sizeof(cdirentry)));
+                    scan->result=DIRSCAN_EENTRY;
+                    goto read_dir_err;
+                }
+                scan->entries=newentries;
+            }
+            memset(&scan->entries[scan->count], 0, sizeof(cdirentry));
+            if ((scan->entries[scan->count].name=strdup(dent->d_name))==NULL)
+            {   errprintf("strdup(%s) failed: out of memory\n", dent->d_name);
+                scan->result=DIRSCAN_EENTRY;
+                goto read_dir_err;
+            }
+            scan->entries[scan->count++].ino=dent->d_ino;
+        }
+    }
+    if ((get_interrupted()==false) && (len < 0))
+    {   sysprintf("cannot read the entries of directory %s\n", fulldirpath);
+        scan->result=DIRSCAN_EENTRY;
+        goto read_dir_err;
+    }
+    
+    // the inodes are read in the order they are stored on the disk
+    if (g_options.diskorder==true)
+        qsort(scan->entries, scan->count, sizeof(cdirentry), createar_cmp_ino);
+    
+    for (i=0, count=0; (i < scan->count) && (get_interrupted()==false); i++)
+    {
+        entry=&scan->entries[i];
+        concatenate_paths(relpath, sizeof(relpath), scan->path, entry->name);
         
         // ---- get details about current file
-        if (lstat64(fullpath, &statbuf)!=0)
-        {   sysprintf("cannot lstat64(%s)\n", fullpath);
-            ret=-1;
-            goto backup_dir_err;
+        if (fstatat64(dirfd, entry->name, &statbuf, AT_SYMLINK_NOFOLLOW)!=0)
+        {   sysprintf("cannot fstatat64(%s)\n", relpath);
+            scan->result=DIRSCAN_EENTRY;
+            goto read_dir_err;
         }
         
         // check the list of excluded files/dirs
-        if ((exclude_check(&g_options.exclude, dir->d_name)==true) // is filename excluded ?
+        if ((exclude_check(&g_options.exclude, entry->name)==true) // is filename excluded ?
             || (exclude_check(&g_options.exclude, relpath)==true)) // is filepath excluded ?
         {
-            if (costeval==NULL) // dont log twice (eval + real)
+            if (scan->evaluation==false) // dont log twice (eval + real)
                 msgprintf(MSG_VERB2, "file/dir=[%s] excluded\n", relpath);
+            free(entry->name);
+            entry->name=NULL;
             continue;
         }
         
-        // backup contents before the directory itself so that the dir-attributes are written after the dir contents
-        if (S_ISDIR(statbuf.st_mode))
-        { 
-            if (createar_save_directory(save, root, relpath, costeval)!=0)
-            {   msgprintf(MSG_STACK, "createar_save_directory(%s) failed\n", relpath);
-                ret=-1;
-                goto backup_dir_err;
-            }
+        entry->statbuf=statbuf;
+        if (count < i) // the entries which are kept are packed at the beginning
+        {   scan->entries[count]=*entry;
+            entry->name=NULL;
         }
-        else // not a directory
+        count++;
+    }
+    for (; i < scan->count; i++) // the operation has been interrupted
+        free(scan->entries[i].name);
+    scan->count=count;
+    
+    if ((g_options.diskorder==true) && (scan->evaluation==false))
+        createar_sort_physical(scan, dirfd);
+    
+    if (scan->evaluation==false)
+        createar_prepare_entries(save, scan, dirfd);
+    
+read_dir_err:
+    free(dentbuf);
+    close(dirfd);
+}
+
+// walker thread: read a directory and give its sub-directories to the walker threads
+static void createar_walk_directory(void *ctx, void *data)
+{
+    csavear *save=(csavear *)ctx;
+    cdirscan *scan=(cdirscan *)data;
+    char relpath[PATH_MAX];
+    cdirscan *subscan;
+    int room;
+    int last;
+    int i;
+    
+    createar_read_directory(save, scan);
+    if (scan->result!=DIRSCAN_SUCCESS)
+        return;
+    
+    // only the first sub-directories are added when the list of the jobs is almost full (the main thread
+    // reads the other ones), the last one is added first so that the threads read them in the order they will be saved
+    room=walker_get_room(&save->walker);
+    for (last=0; (last < scan->count) && (room > 0); last++)
+    {   if (S_ISDIR(scan->entries[last].statbuf.st_mode))
+            room--;
+    }
+    for (i=last-1; (i >= 0) && (get_interrupted()==false); i--)
+    {
+        if (!S_ISDIR(scan->entries[i].statbuf.st_mode))
+            continue;
+        concatenate_paths(relpath, sizeof(relpath), scan->path, scan->entries[i].name);
+        if ((subscan=createar_scan_alloc(scan->root, relpath, scan->evaluation, scan->prepare))==NULL)
+            continue; // the main thread will read it
+        if ((scan->entries[i].job=walker_add(&save->walker, subscan))==NULL)
+            createar_scan_free(save, subscan);
+    }
+}
+
+// following is the full path of the directory which is saved after this one and its sub-directories (or NULL)
+int createar_save_directory(csavear *save, char *root, char *path, cdirentry *entry, char *following)
+{
+    char fulldirpath[PATH_MAX];
+    char firstdir[PATH_MAX];
+    char nextdir[PATH_MAX];
+    char relpath[PATH_MAX];
+    char *subfollowing;
+    cdirentry *entries;
+    cdirscan *scan;
+    int next=0;
+    int ret=0;
+    int pass;
+    int i, j;
+    
+    // init
+    concatenate_paths(fulldirpath, sizeof(fulldirpath), root, path);
+    
+    // the directory is read by a walker thread when there are walker threads
+    if ((entry!=NULL) && (entry->job!=NULL))
+    {   scan=(cdirscan *)walker_take(&save->walker, entry->job);
+        entry->job=NULL;
+    }
+    else if ((scan=createar_scan_alloc(root, path, false, (save->walker.threadcount>0)))!=NULL)
+    {   if (save->walker.threadcount>0)
+            createar_walk_directory(save, scan);
+        else
+            createar_read_directory(save, scan);
+    }
+    if (scan==NULL)
+        return -1;
+    entries=scan->entries;
+    
+    if (scan->result==DIRSCAN_EOPEN) // not a fatal error, oper must continue
+        goto backup_dir_err;
+    if (scan->result==DIRSCAN_ESTAT)
+    {   ret=-1;
+        goto backup_dir_err;
+    }
+    
+    // save info about the directory itself (its attributes have been read with its parent)
+    if (createar_save_file(save, root, path, &scan->statbuf, entry)!=0)
+    {   errprintf("createar_save_file(%s,%s) failed\n", root, path);
+        ret=-1;
+        goto backup_dir_err;
+    }
+    
+    if (scan->result==DIRSCAN_EENTRY)
+    {   ret=-1;
+        goto backup_dir_err;
+    }
+    
+    // the readahead thread goes on with the first sub-directory (or the following directory) after the files
+    firstdir[0]=0;
+    for (i=0; (i < scan->count) && (!S_ISDIR(entries[i].statbuf.st_mode)); i++);
+    if (i < scan->count)
+        concatenate_paths(firstdir, sizeof(firstdir), fulldirpath, entries[i].name);
+    else if (following!=NULL)
+        snprintf(firstdir, sizeof(firstdir), "%s", following);
+    
+    // files first (read in advance by the readahead thread) and then the sub-directories: the order of
+    // the entries in a directory does not matter, and the contents of a directory are saved after its attributes
+    for (pass=0; (pass < 2) && (get_interrupted()==false); pass++)
+    {
+        for (i=0; (i < scan->count) && (get_interrupted()==false); i++)
         {
-            if (createar_save_file(save, root, relpath, &statbuf, costeval)!=0)
-            {   msgprintf(MSG_STACK, "createar_save_directory(%s) failed\n", relpath);
-                ret=-1;
-                goto backup_dir_err;
+            if (S_ISDIR(entries[i].statbuf.st_mode)!=(pass==1))
+                continue;
+            concatenate_paths(relpath, sizeof(relpath), path, entries[i].name);
+            
+            if (S_ISDIR(entries[i].statbuf.st_mode))
+            {
+                for (j=i+1; (j < scan->count) && (!S_ISDIR(entries[j].statbuf.st_mode)); j++);
+                subfollowing=following;
+                if (j < scan->count)
+                {   concatenate_paths(nextdir, sizeof(nextdir), fulldirpath, entries[j].name);
+                    subfollowing=nextdir;
+                }
+                if (createar_save_directory(save, root, relpath, &entries[i], subfollowing)!=0)
+                {   msgprintf(MSG_STACK, "createar_save_directory(%s) failed\n", relpath);
+                    ret=-1;
+                    goto backup_dir_err;
+                }
+            }
+            else // not a directory
+            {
+                createar_readahead_feed(save, fulldirpath, entries, scan->count, &next, (firstdir[0]!=0)?firstdir:NULL);
+                readahead_consume(&save->readahead, entries[i].raseq);
+                if (createar_save_file(save, root, relpath, &entries[i].statbuf, &entries[i])!=0)
+                {   msgprintf(MSG_STACK, "createar_save_directory(%s) failed\n", relpath);
+                    ret=-1;
+                    goto backup_dir_err;
+                }
             }
         }
     }
     
 backup_dir_err:
-    closedir(dirdesc);
+    createar_scan_free(save, scan);
     return ret;
 }
 
-int createar_save_directory_wrapper(csavear *save, char *root, char *path, u64 *costeval)
+int createar_save_directory_wrapper(csavear *save, char *root, char *path)
 {
     int ret;
     
@@ -825,7 +1298,11 @@ int createar_save_directory_wrapper(csavear *save, char *root, char *path, u64 *
         return -1;
     }
     
-    ret=createar_save_directory(save, root, path, costeval);
+    if ((g_options.walkjobs>1) && (walker_init(&save->walker, g_options.walkjobs, createar_walk_directory, createar_scan_free, save)!=0))
+        msgprintf(MSG_VERB1, "the directories will be read by the main thread\n");
+    
+    ret=createar_save_directory(save, root, path, NULL, NULL);
+    walker_destroy(&save->walker);
     
     // put all small files that are in the last block to the queue
     if (regmulti_save_enqueue(&save->regmulti, &g_queue, save->fsid)!=0)
@@ -839,6 +1316,58 @@ int createar_save_directory_wrapper(csavear *save, char *root, char *path, u64 *
     return ret;
 }
 
+// count the cost of a directory which is not the root of a filesystem (statvfs cannot be used): the entries are
+// only listed and stat'ed, no object is built, and the sub-directories are read by the walker threads if any
+static u64 createar_count_directory(csavear *save, char *root, char *path, cdirentry *entry)
+{
+    char relpath[PATH_MAX];
+    u64 cost=FSA_COST_PER_FILE;
+    struct stat64 *statbuf;
+    cdirscan *scan;
+    int i;
+    
+    if ((entry!=NULL) && (entry->job!=NULL))
+    {   scan=(cdirscan *)walker_take(&save->walker, entry->job);
+        entry->job=NULL;
+    }
+    else if ((scan=createar_scan_alloc(root, path, true, false))!=NULL)
+    {   if (save->walker.threadcount>0)
+            createar_walk_directory(save, scan);
+        else
+            createar_read_directory(save, scan);
+    }
+    if (scan==NULL)
+        return cost;
+    
+    for (i=0; (i < scan->count) && (get_interrupted()==false); i++)
+    {
+        statbuf=&scan->entries[i].statbuf;
+        if (S_ISDIR(statbuf->st_mode))
+        {   concatenate_paths(relpath, sizeof(relpath), path, scan->entries[i].name);
+            cost+=createar_count_directory(save, root, relpath, &scan->entries[i]);
+        }
+        else if (S_ISREG(statbuf->st_mode)) // the data of a file which has hard links is saved once
+            cost+=FSA_COST_PER_FILE+statbuf->st_size/max(statbuf->st_nlink, 1);
+        else
+            cost+=FSA_COST_PER_FILE;
+    }
+    
+    createar_scan_free(save, scan);
+    return cost;
+}
+
+u64 createar_count_directory_wrapper(csavear *save, char *root)
+{
+    u64 cost;
+    
+    if ((g_options.walkjobs>1) && (walker_init(&save->walker, g_options.walkjobs, createar_walk_directory, createar_scan_free, save)!=0))
+        msgprintf(MSG_VERB1, "the directories will be read by the main thread\n");
+    
+    cost=createar_count_directory(save, root, "/", NULL);
+    walker_destroy(&save->walker);
+    return cost;
+}
+
 int createar_write_mainhead(csavear *save, int archtype, int fscount)
 {
     u8 bufcheckclear[FSA_CHECKPASSBUF_SIZE+8];
@@ -1115,7 +1644,7 @@ int createar_oper_savefs(csavear *save, cdevinfo *devinfo)
     save->fstype=devinfo->fstype;
     
     // main task
-    ret=createar_save_directory_wrapper(save, devinfo->partmount, "/", NULL);
+    ret=createar_save_directory_wrapper(save, devinfo->partmount, "/");
     
     // write "end of filesystem" header
     if ((dicoend=dico_alloc())==NULL)
@@ -1123,7 +1652,8 @@ int createar_oper_savefs(csavear *save, cdevinfo *devinfo)
         return -1;
     }
     
-    // TODO: add stats about files count in that dico
+    // the real cost replaces the estimate of the filesystem header when the archive is restored
+    dico_add_u64(dicoend, 0, DATAFOOTKEY_TOTALCOST, save->cost_current-save->cost_start);
     queue_add_header(&g_queue, dicoend, FSA_MAGIC_DATF, save->fsid);
     
     return ret;
@@ -1137,24 +1667,77 @@ int createar_oper_savedir(csavear *save, char *rootdir)
     if (rootdir[0]=='/') // absolute path
     {
         snprintf(fullpath, sizeof(fullpath), "%s", rootdir);
-        createar_save_directory_wrapper(save, "/", fullpath, NULL);
+        createar_save_directory_wrapper(save, "/", fullpath);
     }
     else // relative path
     {
         concatenate_paths(fullpath, sizeof(fullpath), getcwd(currentdir, sizeof(currentdir)), rootdir);
-        createar_save_directory_wrapper(save, ".", rootdir, NULL);
+        createar_save_directory_wrapper(save, ".", rootdir);
     }
     
     return 0;
 }
 
+// estimate the cost of saving a whole filesystem from the bytes and the inodes which are used on it, this
+// estimate is refined while the filesystem is saved using the number of inodes (0 if it's not known)
+u64 createar_estimate_cost(char *path, u64 *inodes)
+{
+    struct statvfs64 svfs;
+    u64 cost;
+    
+    *inodes=0;
+    if (statvfs64(path, &svfs)!=0)
+    {   sysprintf("statvfs64(%s) failed: the progress will not be displayed\n", path);
+        return 0;
+    }
+    
+    cost=((u64)(svfs.f_blocks-svfs.f_bfree))*((u64)svfs.f_frsize);
+    if (svfs.f_files > svfs.f_ffree) // some filesystems do not report how many inodes are used
+    {   *inodes=(u64)(svfs.f_files-svfs.f_ffree);
+        cost+=(*inodes)*FSA_COST_PER_FILE;
+    }
+    msgprintf(MSG_DEBUG1, "estimated cost for [%s]: %lld\n", path, (long long)cost);
+    return cost;
+}
+
+// the progress of the filesystem or directory which is started is based on its estimated cost
+static void createar_start_cost(csavear *save, u64 estimate, u64 inodes)
+{
+    save->cost_start=save->cost_current;
+    save->cost_estimate=estimate;
+    save->inodes_used=inodes;
+    save->items_done=0;
+}
+
+// the estimate is replaced with the real cost so that the progress of the next filesystems is right
+static void createar_finish_cost(csavear *save)
+{
+    if (save->cost_global>0)
+        save->cost_global=save->cost_global-save->cost_estimate+(save->cost_current-save->cost_start);
+    save->cost_estimate=save->cost_current-save->cost_start;
+}
+
+// true when the directory is the root of a filesystem (its cost can be estimated with statvfs)
+bool createar_is_fsroot(char *path)
+{
+    char parent[PATH_MAX];
+    struct stat64 stparent;
+    struct stat64 st;
+    
+    concatenate_paths(parent, sizeof(parent), path, "..");
+    if ((stat64(path, &st)!=0) || (stat64(parent, &stparent)!=0))
+        return false;
+    return (st.st_dev!=stparent.st_dev) || (st.st_ino==stparent.st_ino);
+}
+
 int oper_save(char *archive, int argc, char **argv, int archtype)
 {
-    pthread_t thread_comp[FSA_MAX_COMPJOBS];
+    pthread_t *thread_comp;
     cdico *dicofsinfo[FSA_MAX_FSPERARCH];
     cdevinfo devinfo[FSA_MAX_FSPERARCH];
+    u64 costestim[FSA_MAX_FSPERARCH];
+    u64 inodesused[FSA_MAX_FSPERARCH];
     pthread_t thread_writer;
-    u64 cost_evalfs=0;
     u64 totalerr=0;
     cdico *dicoend=NULL;
     cdico *dirsinfo=NULL;
@@ -1167,19 +1750,25 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
     memset(&save, 0, sizeof(save));
     save.cost_global=0;
     
+    // the number of compression threads is only known at run time
+    if ((thread_comp=calloc(g_options.compressjobs, sizeof(pthread_t)))==NULL)
+    {   errprintf("calloc(%d) failed: out of memory\n", g_options.compressjobs);
+        return -1;
+    }
+    
     // init archive
     archwriter_init(&save.ai);
     archwriter_generate_id(&save.ai);
     
     // pass options to archive
-    path_force_extension(save.ai.basepath, PATH_MAX, archive, ".fsa");
+    save.ai.stream=(strcmp(archive, FSA_STREAM_PATH)==0);
+    if (save.ai.stream==true)
+        snprintf(save.ai.basepath, PATH_MAX, "%s", archive);
+    else
+        path_force_extension(save.ai.basepath, PATH_MAX, archive, ".fsa");
     
     // init misc data struct to zero
     thread_writer=0;
-    for (i=0; i<FSA_MAX_COMPJOBS; i++)
-    {
-        thread_comp[i]=0;
-    }
     for (i=0; i<FSA_MAX_FSPERARCH; i++)
     {
         memset(&devinfo[i], 0, sizeof(cdevinfo));
@@ -1208,10 +1797,24 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
         }
     }
     
+    // the next files are read in advance while the current one is saved
+    if (readahead_init(&save.readahead)!=0)
+        msgprintf(MSG_VERB1, "the files will not be read in advance\n");
+    if ((g_options.readjobs>1) && (blkread_init(&save.blkread, g_options.readjobs)!=0))
+        msgprintf(MSG_VERB1, "the large files will be read by the main thread\n");
+    
     // create compression threads
-    for (i=0; (i<g_options.compressjobs) && (i<FSA_MAX_COMPJOBS); i++)
+    if (g_options.numa==true) // one todo ring per node in the queue
+        queue_set_todo_rings(&g_queue, blkbuf_init_numa());
+    if (blkbuf_init_pool(g_options.hugepages, g_options.queuemem)!=0)
+    {   errprintf("cannot create the pool of buffers\n");
+        ret=-1;
+        goto do_create_error;
+    }
+    thread_comp_init_pool(g_options.compressjobs, g_options.autojobs);
+    for (i=0; i<g_options.compressjobs; i++)
     {
-        if (pthread_create(&thread_comp[i], NULL, thread_comp_fct, NULL) != 0)
+        if (pthread_create(&thread_comp[i], NULL, thread_comp_fct, (void*)(long)i) != 0)
         {   errprintf("pthread_create(thread_comp_fct) failed\n");
             ret=-1;
             goto do_create_error;
@@ -1256,18 +1859,14 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
         // analyse each filesystem and write its dico
         for (i=0; (i < argc) && (argv[i]); i++)
         {
-            // evaluate the cost of the operation
-            cost_evalfs=0;
+            // estimate the cost of the operation without reading all the directories twice
             msgprintf(MSG_VERB1, "Analysing filesystem on %s...\n", devinfo[i].devpath);
-            if (createar_save_directory_wrapper(&save, devinfo[i].partmount, "/", &cost_evalfs)!=0)
-            {   sysprintf("cannot run evaluation createar_save_directory(%s)\n", devinfo[i].partmount);
-                goto do_create_error;
-            }
-            if (dico_add_u64(dicofsinfo[i], 0, FSYSHEADKEY_TOTALCOST, cost_evalfs)!=0)
+            costestim[i]=createar_estimate_cost(devinfo[i].partmount, &inodesused[i]);
+            if (dico_add_u64(dicofsinfo[i], 0, FSYSHEADKEY_TOTALCOST, costestim[i])!=0)
             {   errprintf("dico_add_u64(FSYSHEADKEY_TOTALCOST) failed\n");
                 goto do_create_error;
             }
-            save.cost_global+=cost_evalfs;
+            save.cost_global+=costestim[i];
             
             // write filesystem header
             if (queue_add_header(&g_queue, dicofsinfo[i], FSA_MAGIC_FSIN, FSA_FILESYSID_NULL)!=0)
@@ -1284,13 +1883,14 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
         // analyse each directory to eval the cost of the operation
         for (i=0; (i < argc) && (argv[i]); i++)
         {
-            cost_evalfs=0;
             msgprintf(MSG_VERB1, "Analysing directory %s...\n", argv[i]);
-            if (createar_save_directory_wrapper(&save, argv[i], "/", &cost_evalfs)!=0)
-            {   sysprintf("cannot run evaluation createar_save_directory(%s)\n", argv[i]);
-                goto do_create_error;
+            if (createar_is_fsroot(argv[i])==true) // the whole filesystem is saved: statvfs is enough
+                costestim[i]=createar_estimate_cost(argv[i], &inodesused[i]);
+            else // the cost which is counted is exact: it does not have to be refined
+            {   costestim[i]=createar_count_directory_wrapper(&save, argv[i]);
+                inodesused[i]=0;
             }
-            save.cost_global+=cost_evalfs;
+            save.cost_global+=costestim[i];
         }
         
         // write dirsinfo header
@@ -1323,10 +1923,12 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
                 msgprintf(MSG_VERB1, "============= archiving filesystem %s =============\n", devinfo[i].devpath);
                 save.fsid=i;
                 memset(&save.stats, 0, sizeof(save.stats));
+                createar_start_cost(&save, costestim[i], inodesused[i]);
                 if (createar_oper_savefs(&save, &devinfo[i])!=0)
                 {   errprintf("archive_filesystem(%s) failed\n", devinfo[i].devpath);
                     goto do_create_error;
                 }
+                createar_finish_cost(&save);
                 if (get_interrupted()==false)
                     stats_show(save.stats, i);
                 totalerr+=stats_errcount(save.stats);
@@ -1342,10 +1944,12 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
             for (i=0; (i < argc) && (argv[i]!=NULL) && (get_interrupted()==false); i++)
             {
                 msgprintf(MSG_VERB1, "============= archiving directory %s =============\n", argv[i]);
+                createar_start_cost(&save, costestim[i], inodesused[i]);
                 if (createar_oper_savedir(&save, argv[i])!=0)
                 {   errprintf("archive_filesystem(%s) failed\n", argv[i]);
                     goto do_create_error;
                 }
+                createar_finish_cost(&save);
             }
             if (get_interrupted()==false)
                 stats_show(save.stats, 0);
@@ -1356,7 +1960,8 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
                 goto do_create_error;
             }
             
-            // TODO: add stats about files count in that dico
+            // the real cost of all the directories
+            dico_add_u64(dicoend, 0, DATAFOOTKEY_TOTALCOST, save.cost_current);
             queue_add_header(&g_queue, dicoend, FSA_MAGIC_DATF, FSA_FILESYSID_NULL);
             break;
             
@@ -1391,13 +1996,18 @@ do_create_success:
     
     queue_set_end_of_queue(&g_queue, true); // other threads must not wait for more data from this thread
     
-    for (i=0; (i<g_options.compressjobs) && (i<FSA_MAX_COMPJOBS); i++)
+    for (i=0; i<g_options.compressjobs; i++)
         if (thread_comp[i] && pthread_join(thread_comp[i], NULL) != 0)
             errprintf("pthread_join(thread_comp[%d]) failed\n", i);
+    free(thread_comp);
     
     if (thread_writer && pthread_join(thread_writer, NULL) != 0)
         errprintf("pthread_join(thread_writer) failed\n");
     
+    // the writer thread may have failed to write the end of the archive after all the data were queued
+    if (get_stopfillqueue()==true)
+        ret=-1;
+    
     if (ret!=0)
         archwriter_remove(&save.ai);
     
@@ -1405,6 +2015,8 @@ do_create_success:
     if (totalerr>0)
         ret=-1;
     
+    readahead_destroy(&save.readahead);
+    blkread_destroy(&save.blkread);
     archwriter_destroy(&save.ai);
     return ret;
 }
@@ -32,6 +32,10 @@ int options_init()
     memset(&g_options, 0, sizeof(coptions));
     if (strlist_init(&g_options.exclude)!=0)
         return -1;
+    if (strlist_init(&g_options.teepaths)!=0)
+        return -1;
+    if (strlist_init(&g_options.teeoptional)!=0)
+        return -1;
     return 0;
 }
 
@@ -39,6 +43,10 @@ int options_destroy()
 {
     if (strlist_destroy(&g_options.exclude)!=0)
         return -1;
+    if (strlist_destroy(&g_options.teepaths)!=0)
+        return -1;
+    if (strlist_destroy(&g_options.teeoptional)!=0)
+        return -1;
     memset(&g_options, 0, sizeof(coptions));
     return 0;
 }
@@ -33,15 +33,27 @@ struct s_options
     int      debuglevel;
     int      compresslevel;
     int      compressjobs;
+    int      readjobs;
+    int      walkjobs;
+    bool     autojobs;
+    bool     numa;
+    bool     hugepages;
+    bool     iouring;
+    bool     directio;
+    bool     mmapread;
+    bool     diskorder;
     u16      compressalgo;
     u32      datablocksize;
     u32      smallfilethresh;
     u64      splitsize;
+    u64      queuemem;
     u16      encryptalgo;
     u16      fsacomplevel;
 	char     archlabel[FSA_MAX_LABELLEN];
     u8       encryptpass[FSA_MAX_PASSLEN+1];
     cstrlist exclude;
+    cstrlist teepaths;
+    cstrlist teeoptional;
 };
 
 extern coptions g_options;
@@ -34,13 +34,48 @@
 #include "common.h"
 #include "syncthread.h"
 #include "error.h"
+#include "blkbuf.h"
 
-struct timespec get_timeout()
+#define QUEUE_MIN_RINGSIZE 64
+
+static u64 queue_roundup_pow2(u64 val)
+{
+    u64 res=QUEUE_MIN_RINGSIZE;
+    while (res < val)
+        res<<=1;
+    return res;
+}
+
+static void queue_free_todo_rings(cqueue *q)
 {
-    struct timespec t;
-    clock_gettime(CLOCK_REALTIME, &t);
-    t.tv_sec++;
-    return t;
+    int i;
+    
+    for (i=0; (q->todo!=NULL) && (i < q->todorings); i++)
+        free(q->todo[i].items);
+    free(q->todo);
+    q->todo=NULL;
+    q->todorings=0;
+}
+
+static int queue_alloc_todo_rings(cqueue *q, int count)
+{
+    int i;
+    
+    if ((q->todo=calloc(count, sizeof(struct s_todoring)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)(count*sizeof(struct s_todoring)));
+        return FSAERR_ENOMEM;
+    }
+    q->todorings=count;
+    for (i=0; i < count; i++)
+    {
+        q->todo[i].size=queue_roundup_pow2(q->blkmax+1);
+        if ((q->todo[i].items=calloc(q->todo[i].size, sizeof(struct s_todoitem)))==NULL)
+        {   errprintf("calloc(%ld) failed: out of memory\n", (long)(q->todo[i].size*sizeof(struct s_todoitem)));
+            queue_free_todo_rings(q);
+            return FSAERR_ENOMEM;
+        }
+    }
+    return FSAERR_SUCCESS;
 }
 
 s64 queue_init(cqueue *q, s64 blkmax)
@@ -53,22 +88,44 @@ s64 queue_init(cqueue *q, s64 blkmax)
     }
     
     // ---- init default attributes
-    q->head=NULL;
+    q->headnum=1;
     q->curitemnum=1;
     q->itemcount=0;
     q->blkcount=0;
+    q->blktodo=0;
     q->blkmax=blkmax;
+    q->bytesused=0;
+    q->bytesmax=0;
     q->endofqueue=false;
+    q->headwaiters=0;
+    q->spacewaiters=0;
+    q->headwaitns=0;
+    q->todowaitns=0;
+    q->todoend=false;
+    q->todowaiters=0;
+    
+    // ---- the rings grow when required, start with enough room for a full queue
+    q->ringsize=queue_roundup_pow2(2*(blkmax+1));
+    if ((q->ring=calloc(q->ringsize, sizeof(cqueueitem)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)(q->ringsize*sizeof(cqueueitem)));
+        return FSAERR_ENOMEM;
+    }
+    q->todo=NULL;
+    q->todorings=0;
+    if (queue_alloc_todo_rings(q, 1)!=FSAERR_SUCCESS)
+    {   free(q->ring);
+        return FSAERR_ENOMEM;
+    }
     
     // ---- init pthread structures
     assert(pthread_mutexattr_init(&attr)==0);
     assert(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK)==0);
-    if (pthread_mutex_init(&q->mutex, &attr)!=0)
+    if (pthread_mutex_init(&q->mutex, &attr)!=0 || pthread_mutex_init(&q->todomutex, &attr)!=0)
     {   msgprintf(3, "pthread_mutex_init failed\n");
         return FSAERR_UNKNOWN;
     }
     
-    if (pthread_cond_init(&q->cond,NULL)!=0)
+    if (pthread_cond_init(&q->condhead,NULL)!=0 || pthread_cond_init(&q->condspace,NULL)!=0 || pthread_cond_init(&q->condtodo,NULL)!=0)
     {   msgprintf(3, "pthread_cond_init failed\n");
         return FSAERR_UNKNOWN;
     }
@@ -78,28 +135,260 @@ s64 queue_init(cqueue *q, s64 blkmax)
 
 s64 queue_destroy(cqueue *q)
 {
-    cqueueitem *cur;
-    cqueueitem *next;
+    if (!q)
+    {   errprintf("q is NULL\n");
+        return FSAERR_EINVAL;
+    }
     
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    free(q->ring);
+    q->ring=NULL;
+    q->itemcount=0;
+    queue_free_todo_rings(q);
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    
+    assert(pthread_mutex_destroy(&q->mutex)==0);
+    assert(pthread_mutex_destroy(&q->todomutex)==0);
+    assert(pthread_cond_destroy(&q->condhead)==0);
+    assert(pthread_cond_destroy(&q->condspace)==0);
+    assert(pthread_cond_destroy(&q->condtodo)==0);
+    
+    return FSAERR_SUCCESS;
+}
+
+// change the limits which say when the queue is full
+s64 queue_set_limits(cqueue *q, s64 blkmax, u64 bytesmax)
+{
     if (!q)
     {   errprintf("q is NULL\n");
         return FSAERR_EINVAL;
     }
     
     assert(pthread_mutex_lock(&q->mutex)==0);
+    q->blkmax=blkmax;
+    q->bytesmax=bytesmax;
+    if (q->spacewaiters>0)
+        pthread_cond_broadcast(&q->condspace);
+    assert(pthread_mutex_unlock(&q->mutex)==0);
     
-    for (cur=q->head; cur!=NULL; cur=next)
-    {
-        next=cur->next;
-        free(cur);
+    return FSAERR_SUCCESS;
+}
+
+// use one todo ring per numa node: must be called when the queue is empty (before the threads are created)
+s64 queue_set_todo_rings(cqueue *q, int count)
+{
+    s64 res=FSAERR_SUCCESS;
+    
+    if (!q || count<1)
+    {   errprintf("a parameter is invalid\n");
+        return FSAERR_EINVAL;
     }
-    q->head=NULL;
-    q->itemcount=0;
     
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    assert(pthread_mutex_lock(&q->todomutex)==0);
+    if (q->itemcount>0)
+    {   errprintf("cannot change the todo rings when the queue is not empty\n");
+        res=FSAERR_EINVAL;
+    }
+    else if (count!=q->todorings)
+    {   queue_free_todo_rings(q);
+        res=queue_alloc_todo_rings(q, count);
+    }
+    assert(pthread_mutex_unlock(&q->todomutex)==0);
     assert(pthread_mutex_unlock(&q->mutex)==0);
     
-    assert(pthread_mutex_destroy(&q->mutex)==0);
-    assert(pthread_cond_destroy(&q->cond)==0);
+    return res;
+}
+
+// ---- helpers which run with q->mutex locked
+
+static inline cqueueitem *queuelocked_get_item(cqueue *q, s64 itemnum)
+{
+    return &q->ring[itemnum & (q->ringsize-1)];
+}
+
+static inline cqueueitem *queuelocked_get_head(cqueue *q)
+{
+    return (q->itemcount>0)?queuelocked_get_item(q, q->headnum):NULL;
+}
+
+static bool queuelocked_get_end_of_queue(cqueue *q)
+{
+    return ((q->itemcount<1) && (q->endofqueue==true));
+}
+
+// returns true if the first item in queue is a dico or a block which is ready
+static bool queuelocked_is_first_item_ready(cqueue *q)
+{
+    cqueueitem *cur;
+    
+    if ((cur=queuelocked_get_head(q))==NULL)
+        return false; // list empty
+    else if (cur->type==QITEM_TYPE_HEADER)
+        return true; // a dico is always ready
+    else if ((cur->type==QITEM_TYPE_BLOCK) && (cur->status==QITEM_STATUS_DONE))
+        return true; // a block which has been prepared is ready
+    else // other cases: block not yet prepared
+        return false;
+}
+
+// wait until the first item is ready or the end of the queue has been reached
+static void queuelocked_wait_first_item(cqueue *q)
+{
+    u64 start;
+    
+    while ((queuelocked_is_first_item_ready(q)==false) && (queuelocked_get_end_of_queue(q)==false))
+    {   // only measure the time lost because the compression threads are too slow
+        start=(q->itemcount>0)?get_time_ns():0;
+        q->headwaiters++;
+        pthread_cond_wait(&q->condhead, &q->mutex);
+        q->headwaiters--;
+        if (start>0)
+            q->headwaitns+=get_time_ns()-start;
+    }
+}
+
+// the queue is full when there are too many blocks or when the new items would use too much memory
+// an empty queue always accepts new items so that a single big item cannot block the producer forever
+static bool queuelocked_is_full(cqueue *q, u64 newbytes)
+{
+    if (q->blkcount > q->blkmax)
+        return true;
+    if ((q->bytesmax>0) && (q->itemcount>0) && (q->bytesused+newbytes > q->bytesmax))
+        return true;
+    return false;
+}
+
+// wait while (queue-is-full) to let the other threads remove items first
+static void queuelocked_wait_space(cqueue *q, u64 newbytes)
+{
+    while (queuelocked_is_full(q, newbytes) && (q->endofqueue==false))
+    {   q->spacewaiters++;
+        pthread_cond_wait(&q->condspace, &q->mutex);
+        q->spacewaiters--;
+    }
+}
+
+// remove the first item from the ring and wake up the threads which are waiting for it
+static void queuelocked_remove_first(cqueue *q)
+{
+    cqueueitem *cur=queuelocked_get_head(q);
+    
+    if (cur->type==QITEM_TYPE_BLOCK)
+        q->blkcount--;
+    q->bytesused-=cur->itemsize;
+    memset(cur, 0, sizeof(cqueueitem));
+    q->headnum++;
+    q->itemcount--;
+    
+    // the producer knows how much memory it needs: let it check again
+    if ((q->spacewaiters>0) && (q->blkcount <= q->blkmax))
+        pthread_cond_broadcast(&q->condspace);
+    if ((q->headwaiters>0) && queuelocked_is_first_item_ready(q))
+        pthread_cond_signal(&q->condhead);
+}
+
+// double the size of the reorder ring when all its slots are used
+static int queuelocked_grow_ring(cqueue *q)
+{
+    cqueueitem *newring;
+    u64 newsize=q->ringsize*2;
+    s64 num;
+    
+    if ((newring=calloc(newsize, sizeof(cqueueitem)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)(newsize*sizeof(cqueueitem)));
+        return FSAERR_ENOMEM;
+    }
+    for (num=q->headnum; num < q->curitemnum; num++)
+        newring[num & (newsize-1)]=q->ring[num & (q->ringsize-1)];
+    free(q->ring);
+    q->ring=newring;
+    q->ringsize=newsize;
+    return FSAERR_SUCCESS;
+}
+
+// runs with q->todomutex locked: double the size of a todo ring when it is full
+static int todolocked_grow_ring(struct s_todoring *ring)
+{
+    struct s_todoitem *newitems;
+    u64 newsize=ring->size*2;
+    u64 i;
+    
+    if ((newitems=calloc(newsize, sizeof(struct s_todoitem)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)(newsize*sizeof(struct s_todoitem)));
+        return FSAERR_ENOMEM;
+    }
+    for (i=0; i < ring->count; i++)
+        newitems[i]=ring->items[(ring->first+i) & (ring->size-1)];
+    free(ring->items);
+    ring->items=newitems;
+    ring->size=newsize;
+    ring->first=0;
+    return FSAERR_SUCCESS;
+}
+
+// blocks are processed by the threads running on the numa node where their buffer has been allocated
+static inline struct s_todoring *todolocked_get_ring(cqueue *q, int node)
+{
+    return &q->todo[(node>0)?(node % q->todorings):0];
+}
+
+// append items at the end of the ring and give the blocks to process to the compression threads
+static s64 queuelocked_append(cqueue *q, cqueueitem *items, int count)
+{
+    struct s_todoring *ring;
+    struct s_todoitem *todo;
+    cqueueitem *item;
+    bool wasempty;
+    int todoadded=0;
+    int i;
+    
+    while (q->itemcount+count > q->ringsize)
+    {   if (queuelocked_grow_ring(q)!=FSAERR_SUCCESS)
+            return FSAERR_ENOMEM;
+    }
+    
+    wasempty=(q->itemcount==0);
+    assert(pthread_mutex_lock(&q->todomutex)==0);
+    for (i=0; i < count; i++)
+    {
+        item=queuelocked_get_item(q, q->curitemnum);
+        *item=items[i];
+        item->itemnum=q->curitemnum++;
+        q->itemcount++;
+        q->bytesused+=item->itemsize;
+        if (item->type==QITEM_TYPE_HEADER)
+        {   item->status=QITEM_STATUS_DONE;
+            continue;
+        }
+        q->blkcount++;
+        if (item->status==QITEM_STATUS_DONE)
+            continue;
+        
+        // the block has to be processed: give a copy to the compression threads
+        ring=todolocked_get_ring(q, item->blkinfo.blknode);
+        if ((ring->count==ring->size) && (todolocked_grow_ring(ring)!=FSAERR_SUCCESS))
+        {   assert(pthread_mutex_unlock(&q->todomutex)==0);
+            return FSAERR_ENOMEM;
+        }
+        todo=&ring->items[(ring->first+ring->count) & (ring->size-1)];
+        todo->itemnum=item->itemnum;
+        todo->blkinfo=item->blkinfo;
+        ring->count++;
+        q->blktodo++;
+        todoadded++;
+    }
+    if ((todoadded>0) && (q->todowaiters>0))
+    {   if (todoadded>1)
+            pthread_cond_broadcast(&q->condtodo);
+        else
+            pthread_cond_signal(&q->condtodo);
+    }
+    assert(pthread_mutex_unlock(&q->todomutex)==0);
+    
+    // the consumer may be waiting for any first item (queue_destroy_first_item() can cancel todo blocks)
+    if (wasempty && (q->headwaiters>0))
+        pthread_cond_signal(&q->condhead);
     
     return FSAERR_SUCCESS;
 }
@@ -113,8 +402,13 @@ s64 queue_set_end_of_queue(cqueue *q, bool state)
 
     assert(pthread_mutex_lock(&q->mutex)==0);
     q->endofqueue=state;
+    assert(pthread_mutex_lock(&q->todomutex)==0);
+    q->todoend=state;
+    pthread_cond_broadcast(&q->condtodo);
+    assert(pthread_mutex_unlock(&q->todomutex)==0);
+    pthread_cond_broadcast(&q->condhead);
+    pthread_cond_broadcast(&q->condspace);
     assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
     return FSAERR_SUCCESS;
 }
 
@@ -127,12 +421,48 @@ bool queue_get_end_of_queue(cqueue *q)
     }
 
     assert(pthread_mutex_lock(&q->mutex)==0);
-    res=((q->itemcount<1) && (q->endofqueue==true));
+    res=queuelocked_get_end_of_queue(q);
     assert(pthread_mutex_unlock(&q->mutex)==0);
     return res;
 }
 
-bool queuelocked_get_end_of_queue(cqueue *q)
+// memory used outside of the queue (small files read in advance) which is counted in its budget: it's refused
+// without waiting when it would use more than half of the budget, so that the producer can still add items
+s64 queue_reserve_bytes(cqueue *q, u64 size)
+{
+    s64 ret=FSAERR_SUCCESS;
+    
+    if (!q)
+    {   errprintf("q is NULL\n");
+        return FSAERR_EINVAL;
+    }
+    
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    if ((q->bytesmax>0) && (q->bytesused+size > q->bytesmax/2))
+        ret=FSAERR_ENOMEM;
+    else
+        q->bytesused+=size;
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    return ret;
+}
+
+s64 queue_release_bytes(cqueue *q, u64 size)
+{
+    if (!q)
+    {   errprintf("q is NULL\n");
+        return FSAERR_EINVAL;
+    }
+    
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    q->bytesused-=size;
+    if (q->spacewaiters>0)
+        pthread_cond_broadcast(&q->condspace);
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    return FSAERR_SUCCESS;
+}
+
+// true when no more items will be added, even if the queue is not empty yet
+bool queue_get_end_of_input(cqueue *q)
 {
     bool res;
     if (!q)
@@ -140,7 +470,9 @@ bool queuelocked_get_end_of_queue(cqueue *q)
         return FSAERR_EINVAL;
     }
 
-    res=((q->itemcount<1) && (q->endofqueue==true));
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    res=q->endofqueue;
+    assert(pthread_mutex_unlock(&q->mutex)==0);
     return res;
 }
 
@@ -166,6 +498,7 @@ s64 queue_count_status(cqueue *q, int status)
 {
     cqueueitem *cur;
     int count=0;
+    s64 num;
     
     if (!q)
     {   errprintf("q is NULL\n");
@@ -174,8 +507,9 @@ s64 queue_count_status(cqueue *q, int status)
 
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    for (cur=q->head; cur!=NULL; cur=cur->next)
+    for (num=q->headnum; num < q->curitemnum; num++)
     {
+        cur=queuelocked_get_item(q, num);
         if (status==QITEM_STATUS_NULL || cur->status==status)
             count++;
     }
@@ -185,62 +519,66 @@ s64 queue_count_status(cqueue *q, int status)
     return count;
 }
 
-// add a block at the end of the queue
-s64 queue_add_block(cqueue *q, cblockinfo *blkinfo, int status)
+// add several items at the end of the queue at once (blocks use items[i].status, headers are always ready)
+s64 queue_add_items(cqueue *q, cqueueitem *items, int count)
 {
-    cqueueitem *item;
-    cqueueitem *cur;
+    u64 newbytes=0;
+    s64 res;
+    int i;
     
-    if (!q || !blkinfo)
-    {   errprintf("a parameter is NULL\n");
+    if (!q || !items || count<1)
+    {   errprintf("a parameter is invalid\n");
         return FSAERR_EINVAL;
     }
     
-    // create the new item in memory
-    item=malloc(sizeof(cqueueitem));
-    if (!item)
-    {   errprintf("malloc(%ld) failed: out of memory\n", (long)sizeof(cqueueitem));
-        return FSAERR_ENOMEM;
+    // the items are not shared yet: measure them before the queue is locked
+    for (i=0; i < count; i++)
+    {
+        if (items[i].type==QITEM_TYPE_BLOCK)
+            items[i].itemsize=sizeof(cqueueitem)+items[i].blkinfo.blkrealsize;
+        else if (items[i].headinfo.dico!=NULL)
+            items[i].itemsize=sizeof(cqueueitem)+dico_memsize(items[i].headinfo.dico);
+        else
+            items[i].itemsize=sizeof(cqueueitem);
+        newbytes+=items[i].itemsize;
     }
-    item->type=QITEM_TYPE_BLOCK;
-    item->status=status;
-    item->blkinfo=*blkinfo;
-    item->next=NULL;
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
     // does not make sense to add item on a queue where endofqueue is true
     if (q->endofqueue==true)
-    {   free (item);
-        assert(pthread_mutex_unlock(&q->mutex)==0);
+    {   assert(pthread_mutex_unlock(&q->mutex)==0);
         return FSAERR_ENDOFFILE;
     }
     
-    // wait while (queue-is-full) to let the other threads remove items first
-    while (q->blkcount > q->blkmax)
-    {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
+    queuelocked_wait_space(q, newbytes);
+    if (q->endofqueue==true)
+    {   assert(pthread_mutex_unlock(&q->mutex)==0);
+        return FSAERR_ENDOFFILE;
     }
     
-    if (q->head==NULL) // if list empty: item is head
-    {
-        q->head=item;
-    }
-    else // list not empty: add items at the end
-    {
-        for (cur=q->head; (cur!=NULL) && (cur->next!=NULL); cur=cur->next);
-        cur->next=item;
-    }
+    res=queuelocked_append(q, items, count);
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    
+    return res;
+}
+
+// add a block at the end of the queue
+s64 queue_add_block(cqueue *q, cblockinfo *blkinfo, int status)
+{
+    cqueueitem item;
     
-    q->blkcount++;
-    q->itemcount++;
-    item->itemnum=q->curitemnum++;
+    if (!q || !blkinfo)
+    {   errprintf("a parameter is NULL\n");
+        return FSAERR_EINVAL;
+    }
     
-    assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
+    memset(&item, 0, sizeof(item));
+    item.type=QITEM_TYPE_BLOCK;
+    item.status=status;
+    item.blkinfo=*blkinfo;
     
-    return FSAERR_SUCCESS;
+    return queue_add_items(q, &item, 1);
 }
 
 s64 queue_add_header(cqueue *q, cdico *d, char *magic, u16 fsid)
@@ -262,58 +600,19 @@ s64 queue_add_header(cqueue *q, cdico *d, char *magic, u16 fsid)
 
 s64 queue_add_header_internal(cqueue *q, cheadinfo *headinfo)
 {
-    cqueueitem *item;
-    cqueueitem *cur;
+    cqueueitem item;
     
     if (!q || !headinfo)
     {   errprintf("parameter is null\n");
         return FSAERR_EINVAL;
     }
     
-    // create the new item in memory
-    item=malloc(sizeof(cqueueitem));
-    if (!item)
-    {   errprintf("malloc(%ld) failed: out of memory 1\n", (long)sizeof(cqueueitem));
-        return FSAERR_ENOMEM;
-    }
-    
-    item->headinfo=*headinfo;
-    item->type=QITEM_TYPE_HEADER;
-    item->status=QITEM_STATUS_DONE;
-    item->next=NULL;
-    
-    assert(pthread_mutex_lock(&q->mutex)==0);
-    
-    // does not make sense to add item on a queue where endofqueue is true
-    if (q->endofqueue==true)
-    {   free(item);
-        assert(pthread_mutex_unlock(&q->mutex)==0);
-        return FSAERR_ENDOFFILE;
-    }
-    
-    // wait while (queue-is-full) to let the other threads remove items first
-    while (q->blkcount > q->blkmax)
-    {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
-    }
-    
-    item->itemnum=q->curitemnum++;
-    if (q->head==NULL) // if list empty
-    {
-        q->head=item;
-    }
-    else // list not empty
-    {
-        for (cur=q->head; (cur!=NULL) && (cur->next!=NULL); cur=cur->next);
-        cur->next=item;
-    }
+    memset(&item, 0, sizeof(item));
+    item.type=QITEM_TYPE_HEADER;
+    item.status=QITEM_STATUS_DONE;
+    item.headinfo=*headinfo;
     
-    q->itemcount++;
-    assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
-    
-    return FSAERR_SUCCESS;
+    return queue_add_items(q, &item, 1);
 }
 
 // function called by the compression thread when a block has been compressed
@@ -328,33 +627,30 @@ s64 queue_replace_block(cqueue *q, s64 itemnum, cblockinfo *blkinfo, int newstat
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    if (q->head==NULL)
+    if ((itemnum < q->headnum) || (itemnum >= q->curitemnum) || 
+        ((cur=queuelocked_get_item(q, itemnum))->itemnum!=itemnum) || (cur->type!=QITEM_TYPE_BLOCK))
     {   assert(pthread_mutex_unlock(&q->mutex)==0);
-        msgprintf(MSG_DEBUG1, "q->head is NULL: list is empty\n");
+        msgprintf(MSG_DEBUG1, "item %ld not found in the queue\n", (long)itemnum);
         return FSAERR_ENOENT; // item not found
     }
     
-    for (cur=q->head; cur!=NULL; cur=cur->next)
-    {
-        if (cur->itemnum==itemnum) // block found
-        {
-            cur->status=newstatus;
-            cur->blkinfo=*blkinfo;
-            assert(pthread_mutex_unlock(&q->mutex)==0);
-            pthread_cond_broadcast(&q->cond);
-            return FSAERR_SUCCESS;
-        }
-    }
+    if ((cur->status!=QITEM_STATUS_DONE) && (newstatus==QITEM_STATUS_DONE))
+        q->blktodo--;
+    cur->status=newstatus;
+    cur->blkinfo=*blkinfo;
+    
+    // only the consumer cares about this block, and only when it is the first one
+    if ((itemnum==q->headnum) && (q->headwaiters>0))
+        pthread_cond_signal(&q->condhead);
     
     assert(pthread_mutex_unlock(&q->mutex)==0);
-    return FSAERR_ENOENT; // not found
+    return FSAERR_SUCCESS;
 }
 
 // get number of items to be processed
 s64 queue_count_items_todo(cqueue *q)
 {
-    cqueueitem *cur;
-    s64 count=0;
+    s64 count;
     
     if (!q)
     {   errprintf("a parameter is null\n");
@@ -362,71 +658,87 @@ s64 queue_count_items_todo(cqueue *q)
     }
     
     assert(pthread_mutex_lock(&q->mutex)==0);
+    count=q->blktodo;
+    assert(pthread_mutex_unlock(&q->mutex)==0);
     
-    for (cur=q->head; cur!=NULL; cur=cur->next)
-    {
-        if ((cur->type==QITEM_TYPE_BLOCK) && (cur->status!=QITEM_STATUS_DONE))
-            count++;
+    return count;
+}
+
+// how long the threads have been waiting on the queue since it was initialized
+s64 queue_get_wait_stats(cqueue *q, u64 *headwaitns, u64 *todowaitns)
+{
+    if (!q || !headwaitns || !todowaitns)
+    {   errprintf("a parameter is null\n");
+        return FSAERR_EINVAL;
     }
     
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    *headwaitns=q->headwaitns;
+    assert(pthread_mutex_lock(&q->todomutex)==0);
+    *todowaitns=q->todowaitns;
+    assert(pthread_mutex_unlock(&q->todomutex)==0);
     assert(pthread_mutex_unlock(&q->mutex)==0);
     
-    return count;
+    return FSAERR_SUCCESS;
 }
 
 // the compression thread requires the first block which has not yet been compressed
-s64 queue_get_first_block_todo(cqueue *q, cblockinfo *blkinfo)
+// it takes blocks from the ring of its numa node first, and from the other rings when its ring is empty
+s64 queue_get_first_block_todo(cqueue *q, cblockinfo *blkinfo, int node)
 {
-    cqueueitem *cur;
-    s64 itemfound=-1;
-    int res;
+    struct s_todoring *ring;
+    struct s_todoitem *todo;
+    s64 itemfound;
+    u64 start;
+    int first;
+    int i;
     
     if (!q || !blkinfo)
     {   errprintf("a parameter is null\n");
         return FSAERR_EINVAL;
     }
     
-    assert(pthread_mutex_lock(&q->mutex)==0);
+    assert(pthread_mutex_lock(&q->todomutex)==0);
     
-    while (queuelocked_get_end_of_queue(q)==false)
+    for (;;)
     {
-        for (cur=q->head; cur!=NULL; cur=cur->next)
+        // take the oldest entry and skip the ones which have been cancelled
+        first=(node>0)?(node % q->todorings):0;
+        for (i=0; i < q->todorings; i++)
         {
-            if ((cur->type==QITEM_TYPE_BLOCK) && (cur->status==QITEM_STATUS_TODO))
+            ring=&q->todo[(first+i) % q->todorings];
+            while (ring->count>0)
             {
-                *blkinfo=cur->blkinfo;
-                cur->status=QITEM_STATUS_PROGRESS;
-                itemfound=cur->itemnum;
-                assert(pthread_mutex_unlock(&q->mutex)==0);
-                pthread_cond_broadcast(&q->cond);
-                return itemfound; // ">0" means item found
+                todo=&ring->items[ring->first];
+                ring->first=(ring->first+1) & (ring->size-1);
+                ring->count--;
+                if ((itemfound=todo->itemnum)>0)
+                {   *blkinfo=todo->blkinfo;
+                    assert(pthread_mutex_unlock(&q->todomutex)==0);
+                    return itemfound; // ">0" means item found
+                }
             }
         }
         
-        struct timespec t=get_timeout();
-        if ((res=pthread_cond_timedwait(&q->cond, &q->mutex, &t))!=0 && res!=ETIMEDOUT)
-        {   assert(pthread_mutex_unlock(&q->mutex)==0);
-            return FSAERR_UNKNOWN;
+        // nothing more will come
+        if (q->todoend==true)
+        {   assert(pthread_mutex_unlock(&q->todomutex)==0);
+            return FSAERR_ENDOFFILE;
         }
         
+        start=get_time_ns();
+        q->todowaiters++;
+        pthread_cond_wait(&q->condtodo, &q->todomutex);
+        q->todowaiters--;
+        q->todowaitns+=get_time_ns()-start;
     }
-    
-    // if it failed at the other end of the queue
-    assert(pthread_mutex_unlock(&q->mutex)==0);
-    
-    if (queuelocked_get_end_of_queue(q))
-        return FSAERR_ENDOFFILE;
-    else
-        return FSAERR_UNKNOWN;
 }
 
 // the writer thread requires the first block of the queue if it ready to go
-//s64 queue_dequeue_first(cqueue *q, int *type, char *magic, cdico **dico, cblockinfo *blkinfo)
 s64 queue_dequeue_first(cqueue *q, int *type, cheadinfo *headinfo, cblockinfo *blkinfo)
 {
-    cqueueitem *cur=NULL;
-    s64 itemfound=-1;
-    int ret;
+    cqueueitem *cur;
+    s64 itemfound;
     
     if (!q || !headinfo || !blkinfo)
     {   errprintf("a parameter is null\n");
@@ -435,52 +747,50 @@ s64 queue_dequeue_first(cqueue *q, int *type, cheadinfo *headinfo, cblockinfo *b
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    while (queuelocked_get_end_of_queue(q)==false)
+    queuelocked_wait_first_item(q);
+    
+    // if it failed at the other end of the queue
+    if (queuelocked_get_end_of_queue(q))
+    {   assert(pthread_mutex_unlock(&q->mutex)==0);
+        return FSAERR_ENDOFFILE;
+    }
+    
+    cur=queuelocked_get_head(q);
+    switch (cur->type)
     {
-        if (((cur=q->head)!=NULL) && (cur->status==QITEM_STATUS_DONE))
-        {
-            if (cur->type==QITEM_TYPE_BLOCK) // item to dequeue is a block
-            {
-                q->blkcount--;
-                *type=cur->type;
-                itemfound=cur->itemnum;
-                *blkinfo=cur->blkinfo;
-                q->head=cur->next;
-                free(cur);
-                q->itemcount--;
-                assert(pthread_mutex_unlock(&q->mutex)==0);
-                pthread_cond_broadcast(&q->cond);
-                return itemfound; // ">0" means item found
-            }
-            else if (cur->type==QITEM_TYPE_HEADER) // item to dequeue is a dico
-            {
-                *headinfo=cur->headinfo;
-                *type=cur->type;
-                itemfound=cur->itemnum;
-                q->head=cur->next;
-                free(cur);
-                q->itemcount--;
-                assert(pthread_mutex_unlock(&q->mutex)==0);
-                pthread_cond_broadcast(&q->cond);
-                return itemfound; // ">0" means item found
-            }
-            else
-            {
-                errprintf("invalid item type in queue\n");
-                assert(pthread_mutex_unlock(&q->mutex)==0);
-                return FSAERR_EINVAL;
-            }
-        }
-        
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
+        case QITEM_TYPE_BLOCK: // item to dequeue is a block
+            *blkinfo=cur->blkinfo;
+            break;
+        case QITEM_TYPE_HEADER: // item to dequeue is a dico
+            *headinfo=cur->headinfo;
+            break;
+        default:
+            errprintf("invalid item type in queue\n");
+            assert(pthread_mutex_unlock(&q->mutex)==0);
+            return FSAERR_EINVAL;
     }
     
-    // if it failed at the other end of the queue
-    ret=(queuelocked_get_end_of_queue(q)==true)?FSAERR_ENDOFFILE:FSAERR_UNKNOWN;
+    *type=cur->type;
+    itemfound=cur->itemnum;
+    queuelocked_remove_first(q);
     assert(pthread_mutex_unlock(&q->mutex)==0);
+    return itemfound; // ">0" means item found
+}
+
+// tells whether queue_dequeue_first() would return an item without waiting
+bool queue_is_first_item_ready(cqueue *q)
+{
+    bool res;
     
-    return ret;
+    if (!q)
+    {   errprintf("q is NULL\n");
+        return false;
+    }
+    
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    res=queuelocked_is_first_item_ready(q);
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    return res;
 }
 
 // the extract function wants to read headers from the queue
@@ -496,12 +806,7 @@ s64 queue_dequeue_block(cqueue *q, cblockinfo *blkinfo)
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    // while ((first-item-of-the-queue-is-not-ready) && (not-at-the-end-of-the-queue))
-    while ( (((cur=q->head)==NULL) || (cur->status!=QITEM_STATUS_DONE)) && (queuelocked_get_end_of_queue(q)==false) )
-    {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
-    }
+    queuelocked_wait_first_item(q);
     
     // if it failed at the other end of the queue
     if (queuelocked_get_end_of_queue(q))
@@ -509,29 +814,20 @@ s64 queue_dequeue_block(cqueue *q, cblockinfo *blkinfo)
         return FSAERR_ENDOFFILE;
     }
     
-    cur=q->head;
-    assert(cur!=NULL); // queuelocked_is_first_block_ready means there is at least one block in the queue
+    cur=queuelocked_get_head(q);
     
     // test the first item
-    if ((cur->type==QITEM_TYPE_BLOCK) && (cur->status==QITEM_STATUS_DONE))
-    {
-        *blkinfo=cur->blkinfo;
-        q->head=cur->next;
-        itemnum=cur->itemnum;
-        free(cur);
-        q->blkcount--;
-        q->itemcount--;
+    if (cur->type!=QITEM_TYPE_BLOCK)
+    {   errprintf("dequeue - wrong type of data in the queue: wanted a block, found an header\n");
         assert(pthread_mutex_unlock(&q->mutex)==0);
-        pthread_cond_broadcast(&q->cond);
-        return itemnum;
-    }
-    else
-    {
-        errprintf("dequeue - wrong type of data in the queue: wanted a block, found an header\n");
-        assert(pthread_mutex_unlock(&q->mutex)==0);
-        pthread_cond_broadcast(&q->cond);
         return FSAERR_WRONGTYPE;  // ok but not found
     }
+    
+    *blkinfo=cur->blkinfo;
+    itemnum=cur->itemnum;
+    queuelocked_remove_first(q);
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    return itemnum;
 }
 
 s64 queue_dequeue_header(cqueue *q, cdico **d, char *magicbuf, u16 *fsid)
@@ -568,12 +864,7 @@ s64 queue_dequeue_header_internal(cqueue *q, cheadinfo *headinfo)
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    // while ((first-item-of-the-queue-is-not-ready) && (not-at-the-end-of-the-queue))
-    while ( (((cur=q->head)==NULL) || (cur->status!=QITEM_STATUS_DONE)) && (queuelocked_get_end_of_queue(q)==false) )
-    {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
-    }
+    queuelocked_wait_first_item(q);
     
     // if it failed at the other end of the queue
     if (queuelocked_get_end_of_queue(q))
@@ -581,54 +872,28 @@ s64 queue_dequeue_header_internal(cqueue *q, cheadinfo *headinfo)
         return FSAERR_ENDOFFILE;
     }
     
-    cur=q->head;
-    assert (cur!=NULL); // queuelocked_is_first_block_ready means there is at least one block in the queue
+    cur=queuelocked_get_head(q);
     
     // test the first item
     switch (cur->type)
     {
         case QITEM_TYPE_HEADER:
-            q->head=cur->next;
             *headinfo=cur->headinfo;
             itemnum=cur->itemnum;
-            free(cur);
-            q->itemcount--;
+            queuelocked_remove_first(q);
             assert(pthread_mutex_unlock(&q->mutex)==0);
-            pthread_cond_broadcast(&q->cond);
             return itemnum;
         case QITEM_TYPE_BLOCK:
             errprintf("dequeue - wrong type of data in the queue: expected a dico and found a block\n");
             assert(pthread_mutex_unlock(&q->mutex)==0);
-            pthread_cond_broadcast(&q->cond);
             return FSAERR_WRONGTYPE;  // ok but not found
         default: // should never happen
             errprintf("dequeue - wrong type of data in the queue: expected a dico and found an unknown item\n");
             assert(pthread_mutex_unlock(&q->mutex)==0);
-            pthread_cond_broadcast(&q->cond);
             return FSAERR_WRONGTYPE;  // ok but not found
     }
 }
 
-// returns true if the first item in queue is a dico or a block which is ready
-bool queuelocked_is_first_item_ready(cqueue *q)
-{
-    cqueueitem *cur;
-    
-    if (!q)
-    {   errprintf("a parameter is null\n");
-        return false; // not found
-    }
-    
-    if ((cur=q->head)==NULL)
-        return false; // list empty
-    else if (cur->type==QITEM_TYPE_HEADER)
-        return true; // a dico is always ready
-    else if ((cur->type==QITEM_TYPE_BLOCK) && (cur->status==QITEM_STATUS_DONE))
-        return true; // a block which has been prepared is ready
-    else // other cases: block not yet prepared
-        return false;
-}
-
 // say what the next item which is ready in the queue is but do not remove it
 s64 queue_check_next_item(cqueue *q, int *type, char *magic)
 {
@@ -644,12 +909,7 @@ s64 queue_check_next_item(cqueue *q, int *type, char *magic)
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    // while ((first-item-of-the-queue-is-not-ready) && (not-at-the-end-of-the-queue))
-    while ( (((cur=q->head)==NULL) || (cur->status!=QITEM_STATUS_DONE)) && (queuelocked_get_end_of_queue(q)==false) )
-    {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
-    }
+    queuelocked_wait_first_item(q);
     
     // if it failed at the other end of the queue
     if (queuelocked_get_end_of_queue(q))
@@ -658,40 +918,52 @@ s64 queue_check_next_item(cqueue *q, int *type, char *magic)
     }
     
     // test the first item
-    if (((cur=q->head)!=NULL) && (cur->status==QITEM_STATUS_DONE))
+    cur=queuelocked_get_head(q);
+    if (cur->type==QITEM_TYPE_BLOCK) // item to dequeue is a block
     {
-        if (cur->type==QITEM_TYPE_BLOCK) // item to dequeue is a block
-        {
-            *type=cur->type;
-            memset(magic, 0, FSA_SIZEOF_MAGIC);
-            assert(pthread_mutex_unlock(&q->mutex)==0);
-            return FSAERR_SUCCESS;
-        }
-        else if (cur->type==QITEM_TYPE_HEADER) // item to dequeue is a dico
-        {
-            memcpy(magic, cur->headinfo.magic, FSA_SIZEOF_MAGIC); // header contents
-            *type=cur->type;
-            assert(pthread_mutex_unlock(&q->mutex)==0);
-            return FSAERR_SUCCESS;
-        }
-        else
-        {
-            errprintf("invalid item type in queue: type=%d\n", cur->type);
-            assert(pthread_mutex_unlock(&q->mutex)==0);
-            return FSAERR_EINVAL;
-        }
+        *type=cur->type;
+        assert(pthread_mutex_unlock(&q->mutex)==0);
+        return FSAERR_SUCCESS;
     }
+    else if (cur->type==QITEM_TYPE_HEADER) // item to dequeue is a dico
+    {
+        memcpy(magic, cur->headinfo.magic, FSA_SIZEOF_MAGIC); // header contents
+        *type=cur->type;
+        assert(pthread_mutex_unlock(&q->mutex)==0);
+        return FSAERR_SUCCESS;
+    }
+    else
+    {
+        errprintf("invalid item type in queue: type=%d\n", cur->type);
+        assert(pthread_mutex_unlock(&q->mutex)==0);
+        return FSAERR_EINVAL;
+    }
+}
+
+// runs with both mutexes locked: remove a block from the todo ring if no compression thread took it yet
+static bool todolocked_cancel(cqueue *q, cqueueitem *item)
+{
+    struct s_todoring *ring;
+    struct s_todoitem *todo;
+    u64 i;
     
-    assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
-    
-    return FSAERR_ENOENT;  // not found
+    ring=todolocked_get_ring(q, item->blkinfo.blknode);
+    for (i=0; i < ring->count; i++)
+    {
+        todo=&ring->items[(ring->first+i) & (ring->size-1)];
+        if (todo->itemnum==item->itemnum)
+        {   todo->itemnum=0; // the compression threads will skip this entry
+            return true;
+        }
+    }
+    return false;
 }
 
 // destroy the first item in the queue (similar to dequeue but do not read it)
 s64 queue_destroy_first_item(cqueue *q)
 {
     cqueueitem *cur;
+    bool cancelled;
     
     if (!q)
     {   errprintf("a parameter is null\n");
@@ -700,36 +972,45 @@ s64 queue_destroy_first_item(cqueue *q)
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    // while ((first-item-of-the-queue-is-not-ready or first-item-is-being-processed-by-comp-thread) && (not-at-the-end-of-the-queue))
-    while ( (((cur=q->head)==NULL) || (cur->status==QITEM_STATUS_PROGRESS)) && (queuelocked_get_end_of_queue(q)==false) )
-    {   struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
-    }
-    
-    // if it failed at the other end of the queue
-    if (queuelocked_get_end_of_queue(q))
-    {   assert(pthread_mutex_unlock(&q->mutex)==0);
-        return FSAERR_ENDOFFILE;
+    for (;;)
+    {
+        // if it failed at the other end of the queue
+        if (queuelocked_get_end_of_queue(q))
+        {   assert(pthread_mutex_unlock(&q->mutex)==0);
+            return FSAERR_ENDOFFILE;
+        }
+        
+        if (queuelocked_is_first_item_ready(q))
+            break;
+        
+        // a block which is still in the todo ring can be destroyed, else it is being processed by a comp-thread
+        if ((cur=queuelocked_get_head(q))!=NULL)
+        {   assert(pthread_mutex_lock(&q->todomutex)==0);
+            cancelled=todolocked_cancel(q, cur);
+            assert(pthread_mutex_unlock(&q->todomutex)==0);
+            if (cancelled)
+            {   q->blktodo--;
+                break;
+            }
+        }
+        
+        q->headwaiters++;
+        pthread_cond_wait(&q->condhead, &q->mutex);
+        q->headwaiters--;
     }
     
-    cur=q->head;
-    assert(cur!=NULL); // queuelocked_is_first_block_ready means there is at least one block in the queue
-    
+    cur=queuelocked_get_head(q);
     switch (cur->type)
     {
         case QITEM_TYPE_BLOCK:
-            q->blkcount--;
-            free(cur->blkinfo.blkdata);
+            blkbuf_release_block(&cur->blkinfo);
             break;
         case QITEM_TYPE_HEADER:
             dico_destroy(cur->headinfo.dico);
             break;
     }
     
-    q->head=cur->next;
-    free(cur);
-    q->itemcount--;
+    queuelocked_remove_first(q);
     assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
     return FSAERR_SUCCESS;
 }
@@ -47,6 +47,8 @@ struct s_blockinfo // used when (type==QITEM_TYPE_BLOCK)
     u32                  blkcompsize; // size of the block after compression and before encryption
     u16                  blkcryptalgo; // algo used to compressed the block
     u16                  blkfsid; // id of filesystem to which the block belongs
+    s16                  blknode; // numa node where blkdata has been allocated (-1 if not bound to a node)
+    struct s_blkmap      *blkmap; // mapping where blkdata is borrowed from (NULL when blkdata has been allocated)
     bool                 blklocked; // true if locked (being processed in the compress/crypt thread)
 };
 
@@ -60,20 +62,48 @@ struct s_queueitem
 {   int                  type; // QITEM_TYPE_BLOCK or QITEM_TYPE_HEADER
     int                  status; // compressed, being-compressed, not-yet-compressed
     s64                  itemnum; // unique identifier of the item in the queue
-    cqueueitem           *next; // next block in the linked list
+    u64                  itemsize; // bytes of memory accounted for this item in bytesused
     cblockinfo           blkinfo; // used when type==QITEM_TYPE_BLOCK (for blocks only)
     cheadinfo            headinfo; // used when type==QITEM_TYPE_HEADER (for headers only)
 };
 
+struct s_todoitem // entry of the work queue where the compression threads take blocks from
+{   s64                  itemnum; // item the block belongs to in the reorder ring (0 if the entry has been cancelled)
+    cblockinfo           blkinfo; // copy of the block to be processed
+};
+
+struct s_todoring // fifo of blocks waiting for a compression thread (one per numa node)
+{   struct s_todoitem    *items;
+    u64                  size; // number of slots in the ring (always a power of two)
+    u64                  first; // index of the first entry in the ring
+    u64                  count; // number of entries in the ring (including cancelled ones)
+};
+
 struct s_queue
-{   cqueueitem           *head; // head of the queue: first item
-    pthread_mutex_t      mutex; // pthread mutex for data protection
-    pthread_cond_t       cond; // condition for pthread synchronization
+{   cqueueitem           *ring; // reorder ring: item number N is stored at ring[N & (ringsize-1)]
+    u64                  ringsize; // number of slots in the ring (always a power of two)
+    s64                  headnum; // itemnum of the first item of the queue (next to be dequeued)
     s64                  curitemnum; // unique id given to every new item (block or header)
     u64                  itemcount; // how many items there are (headers + blocks)
     u64                  blkcount; // how many blocks items there are (items where type==QITEM_TYPE_BLOCK only)
+    u64                  blktodo; // how many blocks have not been processed by the compression threads yet
     u64                  blkmax; // how many blocks items there can be before the queue is considered as full
+    u64                  bytesused; // memory used by the items in the queue (block buffers and dicos)
+    u64                  bytesmax; // how many bytes the items can use before the queue is considered as full (0=no limit)
     bool                 endofqueue; // set to true when no more data to put in queue (like eof): reader must stop
+    pthread_mutex_t      mutex; // protects the reorder ring (always locked before todomutex)
+    pthread_cond_t       condhead; // signaled when the first item becomes ready or at the end of the queue
+    pthread_cond_t       condspace; // signaled when items leave a full queue
+    int                  headwaiters; // how many threads are waiting on condhead
+    int                  spacewaiters; // how many threads are waiting on condspace
+    u64                  headwaitns; // time spent by the consumer waiting for a block which was not processed yet
+    struct s_todoring    *todo; // work queue: blocks go to the ring of the numa node where their buffer is
+    int                  todorings; // number of todo rings (number of numa nodes used, or 1)
+    bool                 todoend; // copy of endofqueue for the compression threads
+    pthread_mutex_t      todomutex; // protects the todo ring
+    pthread_cond_t       condtodo; // signaled when blocks are added to the todo ring or at the end of the queue
+    int                  todowaiters; // how many threads are waiting on condtodo
+    u64                  todowaitns; // time spent by the compression threads waiting for blocks to process
 };
 
 // ----return status
@@ -84,27 +114,34 @@ struct s_queue
 // init and destroy
 s64  queue_init(cqueue *l, s64 blkmax);
 s64  queue_destroy(cqueue *l);
+s64  queue_set_limits(cqueue *q, s64 blkmax, u64 bytesmax);
+s64  queue_set_todo_rings(cqueue *q, int count);
 
 // information functions
 s64  queue_count(cqueue *l);
 s64  queue_count_status(struct s_queue *l, int status);
-s64  queue_is_first_item_ready(struct s_queue *q);
 s64  queue_check_next_item(cqueue *q, int *type, char *magic);
 s64  queue_count_items_todo(cqueue *q);
+s64  queue_get_wait_stats(cqueue *q, u64 *headwaitns, u64 *todowaitns);
 
 // modification functions
 s64  queue_add_block(cqueue *q, cblockinfo *blkinfo, int status);
 s64  queue_add_header(cqueue *q, struct s_dico *d, char *magic, u16 fsid);
 s64  queue_add_header_internal(cqueue *q, cheadinfo *headinfo);
+s64  queue_add_items(cqueue *q, cqueueitem *items, int count);
 s64  queue_replace_block(cqueue *q, s64 itemnum, cblockinfo *blkinfo, int newstatus);
 s64  queue_destroy_first_item(cqueue *q);
+s64  queue_reserve_bytes(cqueue *q, u64 size);
+s64  queue_release_bytes(cqueue *q, u64 size);
 
 // end of queue functions
 s64  queue_set_end_of_queue(cqueue *q, bool state);
 bool queue_get_end_of_queue(cqueue *q);
+bool queue_get_end_of_input(cqueue *q);
 
 // get item from queue functions
-s64  queue_get_first_block_todo(cqueue *q, cblockinfo *blkinfo);
+bool queue_is_first_item_ready(cqueue *q);
+s64  queue_get_first_block_todo(cqueue *q, cblockinfo *blkinfo, int node);
 s64  queue_dequeue_header(cqueue *q, struct s_dico **d, char *magicbuf, u16 *fsid);
 s64  queue_dequeue_header_internal(cqueue *q, cheadinfo *headinfo);
 s64  queue_dequeue_block(cqueue *q, cblockinfo *blkinfo);
@@ -0,0 +1,214 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include "fsarchiver.h"
+#include "readahead.h"
+#include "common.h"
+#include "error.h"
+
+// read the first files of a directory in advance (in the order of readdir), returns how many bytes have been read
+static u64 readahead_directory(char *path, u64 maxsize)
+{
+    struct dirent *dent;
+    struct stat64 st;
+    u64 total=0;
+    DIR *dir;
+    int fd;
+    
+    if ((dir=opendir(path))==NULL)
+        return 0;
+    while ((total < maxsize) && ((dent=readdir(dir))!=NULL))
+    {
+        if ((fstatat64(dirfd(dir), dent->d_name, &st, AT_SYMLINK_NOFOLLOW)!=0) || (!S_ISREG(st.st_mode)) || (st.st_size==0))
+            continue;
+        if ((fd=openat(dirfd(dir), dent->d_name, O_RDONLY|O_LARGEFILE|O_NOFOLLOW))>=0)
+        {   posix_fadvise(fd, 0, min((u64)st.st_size, maxsize-total), POSIX_FADV_WILLNEED);
+            total+=min((u64)st.st_size, maxsize-total);
+            close(fd);
+        }
+    }
+    closedir(dir);
+    return total;
+}
+
+// thread which asks the kernel to read the next files, up to FSA_READAHEAD_WINDOW bytes ahead of the saved file
+static void *readahead_fct(void *args)
+{
+    creadahead *ra=(creadahead *)args;
+    struct s_raitem *item;
+    char path[PATH_MAX];
+    bool isdir;
+    u64 size;
+    s64 seq;
+    int fd;
+    
+    pthread_mutex_lock(&ra->mutex);
+    for (;;)
+    {
+        while ((ra->stop==false) && ((ra->issued==ra->count) || (ra->ahead >= FSA_READAHEAD_WINDOW)))
+            pthread_cond_wait(&ra->cond, &ra->mutex);
+        if (ra->stop==true)
+            break;
+        item=&ra->items[(ra->first+ra->issued) % FSA_READAHEAD_MAXFILES];
+        snprintf(path, sizeof(path), "%s", item->path);
+        isdir=item->isdir;
+        size=isdir?(FSA_READAHEAD_WINDOW-ra->ahead):item->size;
+        seq=item->seq;
+        ra->issued++;
+        if (isdir==false)
+            ra->ahead+=size;
+        pthread_mutex_unlock(&ra->mutex);
+        
+        // the kernel reads the data in the background: the file does not have to stay open
+        if (isdir==true)
+        {   size=readahead_directory(path, size);
+        }
+        else if ((fd=open64(path, O_RDONLY|O_LARGEFILE))>=0)
+        {   posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+        
+        pthread_mutex_lock(&ra->mutex);
+        // the size of a directory is only known now: it's counted if the directory is still in the window
+        if ((isdir==true) && (ra->count>0) && (seq >= ra->items[ra->first].seq))
+        {   ra->items[(ra->first+(seq-ra->items[ra->first].seq)) % FSA_READAHEAD_MAXFILES].size=size;
+            ra->ahead+=size;
+        }
+    }
+    pthread_mutex_unlock(&ra->mutex);
+    
+    return NULL;
+}
+
+int readahead_init(creadahead *ra)
+{
+    assert(ra);
+    memset(ra, 0, sizeof(creadahead));
+    ra->nextseq=1;
+    
+    if ((ra->items=calloc(FSA_READAHEAD_MAXFILES, sizeof(struct s_raitem)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)(FSA_READAHEAD_MAXFILES*sizeof(struct s_raitem)));
+        return -1;
+    }
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    
+    if (pthread_create(&ra->thread, NULL, readahead_fct, (void*)ra)!=0)
+    {   errprintf("pthread_create() failed: the files are not read in advance\n");
+        readahead_destroy(ra);
+        return -1;
+    }
+    ra->started=true;
+    
+    return 0;
+}
+
+int readahead_destroy(creadahead *ra)
+{
+    assert(ra);
+    
+    if (ra->started==true)
+    {   pthread_mutex_lock(&ra->mutex);
+        ra->stop=true;
+        pthread_cond_signal(&ra->cond);
+        pthread_mutex_unlock(&ra->mutex);
+        pthread_join(ra->thread, NULL);
+        ra->started=false;
+    }
+    if (ra->items!=NULL)
+    {   pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->mutex);
+        free(ra->items);
+        ra->items=NULL;
+    }
+    
+    return 0;
+}
+
+// add a file (or a directory whose files have to be read) which will be saved after the ones which
+// have already been added, returns its sequence number (>0) or -1 if there is no room
+s64 readahead_add(creadahead *ra, char *path, u64 size, bool isdir)
+{
+    struct s_raitem *item;
+    s64 seq;
+    
+    assert(ra);
+    
+    if (ra->started==false)
+        return -1;
+    
+    pthread_mutex_lock(&ra->mutex);
+    if (ra->count==FSA_READAHEAD_MAXFILES)
+    {   pthread_mutex_unlock(&ra->mutex);
+        return -1;
+    }
+    item=&ra->items[(ra->first+ra->count) % FSA_READAHEAD_MAXFILES];
+    snprintf(item->path, sizeof(item->path), "%s", path);
+    item->size=isdir?0:min(size, FSA_READAHEAD_WINDOW);
+    item->isdir=isdir;
+    item->seq=seq=ra->nextseq++;
+    ra->count++;
+    pthread_cond_signal(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    
+    return seq;
+}
+
+// the file which has that sequence number is being saved: the window moves after it (the files
+// before it will not be saved), the items are in the order of their sequence numbers
+int readahead_consume(creadahead *ra, s64 seq)
+{
+    struct s_raitem *item;
+    s64 found=-1;
+    s64 i;
+    
+    assert(ra);
+    
+    if ((ra->started==false) || (seq<=0))
+        return 0;
+    
+    pthread_mutex_lock(&ra->mutex);
+    if ((ra->count>0) && (seq >= ra->items[ra->first].seq))
+        found=min(seq-ra->items[ra->first].seq, ra->count-1);
+    for (i=0; i <= found; i++)
+    {
+        item=&ra->items[ra->first];
+        if (ra->issued>0)
+        {   ra->ahead-=item->size;
+            ra->issued--;
+        }
+        ra->first=(ra->first+1) % FSA_READAHEAD_MAXFILES;
+        ra->count--;
+    }
+    if (found>=0)
+        pthread_cond_signal(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+#include <limits.h>
+#include <pthread.h>
+
+// file (or directory) which will be saved soon
+struct s_raitem
+{   char   path[PATH_MAX]; // full path of the file
+    u64    size; // how many bytes have to be read in advance (read in the files of a directory)
+    s64    seq; // sequence number returned by readahead_add()
+    bool   isdir; // true when the files of a directory have to be read
+};
+
+struct s_readahead;
+typedef struct s_readahead creadahead;
+
+// thread which asks the kernel to read the next files while the current one is saved
+struct s_readahead
+{   pthread_t thread; // thread which opens the files and calls posix_fadvise(POSIX_FADV_WILLNEED)
+    pthread_mutex_t mutex; // protects all the other fields
+    pthread_cond_t cond; // signaled when a file is added, when the window moves or when the thread has to stop
+    struct s_raitem *items; // ring of the next files in the order where they will be saved
+    int    first; // index of the file which is saved now (or which will be saved next)
+    int    count; // how many files there are in items
+    int    issued; // how many files from first have been read in advance
+    s64    nextseq; // sequence number of the next file which is added
+    u64    ahead; // how many bytes have been read in advance in the files which have not been saved yet
+    bool   started; // true when the thread is running
+    bool   stop; // true when the thread has to exit
+};
+
+int readahead_init(creadahead *ra);
+int readahead_destroy(creadahead *ra);
+s64 readahead_add(creadahead *ra, char *path, u64 size, bool isdir);
+int readahead_consume(creadahead *ra, s64 seq);
+
+#endif // __READAHEAD_H__
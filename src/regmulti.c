@@ -28,6 +28,7 @@
 #include "regmulti.h"
 #include "common.h"
 #include "queue.h"
+#include "blkbuf.h"
 #include "error.h"
 
 int regmulti_empty(cregmulti *m)
@@ -111,8 +112,10 @@ int regmulti_save_addfile(cregmulti *m, cdico *header, char *data, u32 datsize)
 // add headers and datblock at the end of the queue
 int regmulti_save_enqueue(cregmulti *m, cqueue *q, int fsid)
 {
-    cblockinfo blkinfo;
+    cqueueitem *items;
+    cblockinfo *blkinfo;
     char *dynblock;
+    int blknode;
     u32 offset=0;
     u64 filesize;
     int i;
@@ -126,56 +129,73 @@ int regmulti_save_enqueue(cregmulti *m, cqueue *q, int fsid)
     if (m->count==0)
         return 0;
     
+    // all the headers and the shared block are added to the queue in a single operation
+    if ((items=calloc(m->count+1, sizeof(cqueueitem)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)((m->count+1)*sizeof(cqueueitem)));
+        return -1;
+    }
+    
     for (i=0; i < m->count; i++)
     {
         if (m->objhead[i]==NULL)
         {   errprintf("error: objhead[%d]==NULL\n", i);
+            free(items);
             return -1;
         }
         
         // get file size from header
         if (dico_get_u64(m->objhead[i], DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_SIZE, &filesize)!=0)
         {   errprintf("Cannot read filesize DISKITEMKEY_SIZE from archive\n");
+            free(items);
             return -1;
         }
         
         // the extraction function needs to know how many small-files are packed together
         if (dico_add_u32(m->objhead[i], DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_MULTIFILESCOUNT, (u32)m->count)!=0)
         {   errprintf("dico_add_u32(DISKITEMKEY_MULTIFILESCOUNT) failed\n");
+            free(items);
             return -1;
         }
         
         // the extraction function needs to know where the data for this file are in the block
         if (dico_add_u32(m->objhead[i], DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_MULTIFILESOFFSET, (u32)offset)!=0)
         {   errprintf("dico_add_u32(DISKITEMKEY_MULTIFILESCOUNT) failed\n");
+            free(items);
             return -1;
         }
         offset+=(u32)filesize;
         
-        if (queue_add_header(q, m->objhead[i], FSA_MAGIC_OBJT, fsid)!=0)
-        {   errprintf("queue_add_header() failed\n");
-            return -1;
-        }
+        items[i].type=QITEM_TYPE_HEADER;
+        memcpy(items[i].headinfo.magic, FSA_MAGIC_OBJT, FSA_SIZEOF_MAGIC);
+        items[i].headinfo.fsid=fsid;
+        items[i].headinfo.dico=m->objhead[i];
     }
     
     // make a copy of the static block to dynamic memory
-    if ((dynblock=malloc(m->usedsize)) == NULL)
-    {   errprintf("malloc(%ld) failed: out of memory\n", (long)m->usedsize);
+    blknode=blkbuf_pick_node();
+    if ((dynblock=blkbuf_alloc(m->usedsize, blknode)) == NULL)
+    {   errprintf("blkbuf_alloc(%ld) failed: out of memory\n", (long)m->usedsize);
+        free(items);
         return -1;
     }
     memcpy(dynblock, m->data, m->usedsize);
     
-    memset(&blkinfo, 0, sizeof(blkinfo));
-    blkinfo.blkrealsize=m->usedsize;
-    blkinfo.blkdata=(char*)dynblock;
-    blkinfo.blkoffset=0; // no meaning for multi-regfiles
-    blkinfo.blkfsid=fsid;
-    if (queue_add_block(q, &blkinfo, QITEM_STATUS_TODO)!=0)
-    {   errprintf("queue_add_block() failed\n");
+    items[m->count].type=QITEM_TYPE_BLOCK;
+    items[m->count].status=QITEM_STATUS_TODO;
+    blkinfo=&items[m->count].blkinfo;
+    blkinfo->blkrealsize=m->usedsize;
+    blkinfo->blkdata=(char*)dynblock;
+    blkinfo->blkoffset=0; // no meaning for multi-regfiles
+    blkinfo->blkfsid=fsid;
+    blkinfo->blknode=blknode;
+    if (queue_add_items(q, items, m->count+1)!=0)
+    {   errprintf("queue_add_items() failed\n");
+        free(items);
         return -1;
     }
     
-     return 0;
+    free(items);
+    return 0;
 }
 
 int regmulti_rest_addheader(cregmulti *m, cdico *header)
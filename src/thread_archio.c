@@ -62,6 +62,12 @@ void *thread_writer_fct(void *args)
     
     while (queue_get_end_of_queue(&g_queue)==false)
     {
+        // write the pending data instead of waiting for the compression threads with data in memory
+        if (archwriter_has_pending(ai) && (queue_is_first_item_ready(&g_queue)==false) && (archwriter_flush(ai)!=0))
+        {   msgprintf(MSG_STACK, "archwriter_flush() failed\n");
+            goto thread_writer_fct_error;
+        }
+        
         if ((blknum=queue_dequeue_first(&g_queue, &type, &headinfo, &blkinfo))<0 && blknum!=FSAERR_ENDOFFILE) // error
         {   msgprintf(MSG_STACK, "queue_dequeue_first()=%ld=%s failed\n", (long)blknum, error_int_to_string(blknum));
             goto thread_writer_fct_error;
@@ -75,7 +81,6 @@ void *thread_writer_fct(void *args)
                     {   msgprintf(MSG_STACK, "archive_dowrite_block() failed\n");
                         goto thread_writer_fct_error;
                     }
-                    free(blkinfo.blkdata);
                     break;
                 case QITEM_TYPE_HEADER:
                     if (archwriter_dowrite_header(ai, &headinfo)!=0)
@@ -96,7 +101,10 @@ void *thread_writer_fct(void *args)
     {   msgprintf(MSG_STACK, "cannot write volume footer: archio_write_volfooter() failed\n");
         goto thread_writer_fct_error;
     }
-    archwriter_close(ai);
+    if (archwriter_close(ai)!=0)
+    {   msgprintf(MSG_STACK, "cannot complete the archive: archwriter_close() failed\n");
+        goto thread_writer_fct_error;
+    }
     msgprintf(MSG_DEBUG1, "THREAD-WRITER: exit success\n");
     dec_secthreads();
     return NULL;
@@ -197,6 +205,10 @@ void *thread_reader_fct(void *args)
                 goto thread_reader_fct_error;
             }
             msgprintf(MSG_VERB2, "End of volume [%s]\n", ai->volpath);
+            if ((endofarchive!=true) && (ai->stream==true))
+            {   errprintf("the archive read from the standard input has several volumes, it must be restored from the files\n");
+                goto thread_reader_fct_error;
+            }
             if (endofarchive!=true)
             {
                 archreader_incvolume(ai, false);
@@ -23,7 +23,7 @@
 #include <time.h>
 #include <pthread.h>
 #include <string.h>
-#include <pthread.h>
+#include <assert.h>
 
 #include "fsarchiver.h"
 #include "common.h"
@@ -37,6 +37,85 @@
 #include "thread_comp.h"
 #include "error.h"
 #include "queue.h"
+#include "blkbuf.h"
+
+#define POOL_TUNE_INTERVAL_NS   1000000000LL   // how often the number of active threads is adjusted with -j auto
+#define POOL_UNPARK_HEADWAIT    5              // unpark threads when the consumer waits more than 5% of the time
+#define POOL_PARK_IDLETIME      50             // park a thread when the active ones are idle more than 50% of the time
+
+// with -j auto the threads which have (index >= g_poolactive) are parked (they wait on g_poolcond)
+static pthread_mutex_t g_poolmutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_poolcond=PTHREAD_COND_INITIALIZER;
+static int  g_pooltotal=0; // how many threads have been created
+static int  g_poolactive=0; // how many threads are allowed to process blocks
+static bool g_poolautotune=false;
+
+// must be called before the compression threads are created
+void thread_comp_init_pool(int count, bool autotune)
+{
+    assert(pthread_mutex_lock(&g_poolmutex)==0);
+    g_pooltotal=count;
+    g_poolactive=count;
+    g_poolautotune=autotune;
+    assert(pthread_mutex_unlock(&g_poolmutex)==0);
+}
+
+// wait until this thread is allowed to process blocks
+static void pool_wait_unparked(int index)
+{
+    assert(pthread_mutex_lock(&g_poolmutex)==0);
+    while (index >= g_poolactive)
+        pthread_cond_wait(&g_poolcond, &g_poolmutex);
+    assert(pthread_mutex_unlock(&g_poolmutex)==0);
+}
+
+// called when the first thread exits: the other ones must not stay parked
+static void pool_unpark_all(void)
+{
+    assert(pthread_mutex_lock(&g_poolmutex)==0);
+    g_poolactive=g_pooltotal;
+    g_poolautotune=false;
+    pthread_cond_broadcast(&g_poolcond);
+    assert(pthread_mutex_unlock(&g_poolmutex)==0);
+}
+
+// run by the first thread (which is never parked): compare the time the consumer of the queue
+// waited for blocks being processed with the time the active threads waited for blocks to process
+static void pool_autotune(void)
+{
+    static u64 lasttime=0, lasthead=0, lasttodo=0;
+    u64 now, elapsed, headwait, todowait;
+    int active;
+    
+    now=get_time_ns();
+    if (lasttime==0)
+    {   lasttime=now;
+        queue_get_wait_stats(&g_queue, &lasthead, &lasttodo);
+        return;
+    }
+    if ((elapsed=now-lasttime) < POOL_TUNE_INTERVAL_NS)
+        return;
+    
+    queue_get_wait_stats(&g_queue, &headwait, &todowait);
+    assert(pthread_mutex_lock(&g_poolmutex)==0);
+    active=g_poolactive;
+    if (((headwait-lasthead)*100 > elapsed*POOL_UNPARK_HEADWAIT) && (active < g_pooltotal))
+    {   // the consumer is waiting for the compression threads: use more threads
+        g_poolactive=min(g_pooltotal, active+max(1, active/4));
+        pthread_cond_broadcast(&g_poolcond);
+    }
+    else if (((todowait-lasttodo)*100 > elapsed*active*POOL_PARK_IDLETIME) && (active > 1))
+    {   // the threads are waiting for data (slow source or destination): use fewer threads
+        g_poolactive=active-1;
+    }
+    if (g_poolactive!=active)
+        msgprintf(MSG_DEBUG1, "THREAD-COMP: %d active threads out of %d\n", g_poolactive, g_pooltotal);
+    assert(pthread_mutex_unlock(&g_poolmutex)==0);
+    
+    lasttime=now;
+    lasthead=headwait;
+    lasttodo=todowait;
+}
 
 int compress_block_generic(struct s_blockinfo *blkinfo)
 {
@@ -49,8 +128,8 @@ int compress_block_generic(struct s_blockinfo *blkinfo)
     int res;
     
     bufsize = (blkinfo->blkrealsize) + (blkinfo->blkrealsize / 16) + 64 + 3; // alloc bigger buffer else lzo will crash
-    if ((bufcomp=malloc(bufsize))==NULL)
-    {   errprintf("malloc(%ld) failed: out of memory\n", (long)bufsize);
+    if ((bufcomp=blkbuf_alloc(bufsize, blkinfo->blknode))==NULL)
+    {   errprintf("blkbuf_alloc(%ld) failed: out of memory\n", (long)bufsize);
         return -1;
     }
     
@@ -84,7 +163,7 @@ int compress_block_generic(struct s_blockinfo *blkinfo)
                 break;
 #endif // OPTION_LZMA_SUPPORT
             default:
-                free(bufcomp);
+                blkbuf_free(bufcomp);
                 msgprintf(2, "invalid compression level: %d\n", (int)compalgo);
                 return -1;
         }
@@ -101,16 +180,14 @@ int compress_block_generic(struct s_blockinfo *blkinfo)
     
     // check compression status and efficiency
     if ((res==FSAERR_SUCCESS) && (compsize < blkinfo->blkrealsize)) // compression worked and saved space
-    {   free(blkinfo->blkdata); // free old buffer (with uncompressed data)
+    {   blkbuf_free(blkinfo->blkdata); // free old buffer (with uncompressed data)
         blkinfo->blkdata=bufcomp; // new buffer (with compressed data)
         blkinfo->blkcompsize=compsize; // size after compression and before encryption
         blkinfo->blkarsize=compsize; // in case there is no encryption to set this
         //errprintf ("COMP_DBG: block successfully compressed using %s\n", compress_algo_int_to_string(compalgo));
     }
     else // compressed version is bigger or compression failed: keep the original block
-    {   memcpy(bufcomp, blkinfo->blkdata, blkinfo->blkrealsize);
-        free(blkinfo->blkdata); // free old buffer
-        blkinfo->blkdata=bufcomp; // new buffer
+    {   blkbuf_free(bufcomp); // the original buffer is written as it is
         blkinfo->blkcompsize=blkinfo->blkrealsize; // size after compression and before encryption
         blkinfo->blkarsize=blkinfo->blkrealsize;  // in case there is no encryption to set this
         blkinfo->blkcompalgo=COMPRESS_NONE;
@@ -121,16 +198,16 @@ int compress_block_generic(struct s_blockinfo *blkinfo)
     char *bufcrypt=NULL;
     if (g_options.encryptalgo==ENCRYPT_BLOWFISH)
     {
-        if ((bufcrypt=malloc(bufsize+8))==NULL)
-        {   errprintf("malloc(%ld) failed: out of memory\n", (long)bufsize+8);
+        if ((bufcrypt=blkbuf_alloc(bufsize+8, blkinfo->blknode))==NULL)
+        {   errprintf("blkbuf_alloc(%ld) failed: out of memory\n", (long)bufsize+8);
             return -1;
         }
-        if ((res=crypto_blowfish(blkinfo->blkcompsize, &cryptsize, (u8*)bufcomp, (u8*)bufcrypt, 
+        if ((res=crypto_blowfish(blkinfo->blkcompsize, &cryptsize, (u8*)blkinfo->blkdata, (u8*)bufcrypt, 
             g_options.encryptpass, strlen((char*)g_options.encryptpass), 1))!=0)
         {   errprintf("crypt_block_blowfish() failed with res=%d\n", res);
             return -1;
         }
-        free(bufcomp);
+        blkbuf_free(blkinfo->blkdata);
         blkinfo->blkdata=bufcrypt;
         blkinfo->blkarsize=cryptsize;
         blkinfo->blkcryptalgo=ENCRYPT_BLOWFISH;
@@ -152,23 +229,22 @@ int decompress_block_generic(struct s_blockinfo *blkinfo)
     char *bufcomp=NULL;
     int res;
     
-    // allocate memory for uncompressed data
-    if ((bufcomp=malloc(blkinfo->blkrealsize))==NULL)
-    {   errprintf("malloc(%ld) failed: cannot allocate memory for compressed block\n", (long)blkinfo->blkrealsize);
-        return -1;
-    }
-    
     // check the block checksum
     if (fletcher32((u8*)blkinfo->blkdata, blkinfo->blkarsize)!=(blkinfo->blkarcsum))
     {   errprintf("block is corrupt at blockoffset=%ld, blksize=%ld\n", (long)blkinfo->blkoffset, (long)blkinfo->blkrealsize);
+        if ((bufcomp=blkbuf_alloc(blkinfo->blkrealsize, blkinfo->blknode))==NULL)
+        {   errprintf("blkbuf_alloc(%ld) failed: cannot allocate memory for compressed block\n", (long)blkinfo->blkrealsize);
+            return -1;
+        }
         memset(bufcomp, 0, blkinfo->blkrealsize);
+        blkbuf_release_block(blkinfo); // the corrupt data are replaced with zeros
+        blkinfo->blkdata=bufcomp;
     }
     else // data not corrupted, decompresses the block
     {
         if ((blkinfo->blkcryptalgo!=ENCRYPT_NONE) && (g_options.encryptalgo!=ENCRYPT_BLOWFISH))
         {   msgprintf(MSG_DEBUG1, "this archive has been encrypted, you have to provide a password "
                 "on the command line using option '-c'\n");
-            free (bufcomp);
             return -1;
         }
         
@@ -176,32 +252,39 @@ int decompress_block_generic(struct s_blockinfo *blkinfo)
         u64 clearsize;
         if (blkinfo->blkcryptalgo==ENCRYPT_BLOWFISH)
         {
-            if ((bufcrypt=malloc(blkinfo->blkrealsize+8))==NULL)
-            {   errprintf("malloc(%ld) failed: out of memory\n", (long)blkinfo->blkrealsize+8);
-                free(bufcomp);
+            if ((bufcrypt=blkbuf_alloc(blkinfo->blkrealsize+8, blkinfo->blknode))==NULL)
+            {   errprintf("blkbuf_alloc(%ld) failed: out of memory\n", (long)blkinfo->blkrealsize+8);
                 return -1;
             }
             if ((res=crypto_blowfish(blkinfo->blkarsize, &clearsize, (u8*)blkinfo->blkdata, (u8*)bufcrypt, 
                 g_options.encryptpass, strlen((char*)g_options.encryptpass), 0))!=0)
             {   errprintf("crypt_block_blowfish() failed\n");
-                free(bufcomp);
+                blkbuf_free(bufcrypt);
                 return -1;
             }
             if (clearsize!=blkinfo->blkcompsize)
             {   errprintf("clearsize does not match blkcompsize: clearsize=%ld and blkcompsize=%ld\n", 
                     (long)clearsize, (long)blkinfo->blkcompsize);
-                free(bufcomp);
+                blkbuf_free(bufcrypt);
                 return -1;
             }
-            free(blkinfo->blkdata);
+            blkbuf_release_block(blkinfo);
             blkinfo->blkdata=bufcrypt;
         }
         
+        if ((blkinfo->blkcompalgo==COMPRESS_NONE) && (blkinfo->blkmap==NULL)) // the block is passed to the restore thread as it is
+            return 0;
+        
+        // allocate memory for uncompressed data
+        if ((bufcomp=blkbuf_alloc(blkinfo->blkrealsize, blkinfo->blknode))==NULL)
+        {   errprintf("blkbuf_alloc(%ld) failed: cannot allocate memory for compressed block\n", (long)blkinfo->blkrealsize);
+            return -1;
+        }
+        
         switch (blkinfo->blkcompalgo)
         {
-            case COMPRESS_NONE:
-                memcpy(bufcomp, blkinfo->blkdata, blkinfo->blkarsize);
-                res=0;
+            case COMPRESS_NONE: // the data borrowed from the archive mapping are given back
+                memcpy(bufcomp, blkinfo->blkdata, blkinfo->blkrealsize);
                 break;
 #ifdef OPTION_LZO_SUPPORT
             case COMPRESS_LZO:
@@ -241,23 +324,57 @@ int decompress_block_generic(struct s_blockinfo *blkinfo)
 #endif // OPTION_LZMA_SUPPORT
             default:
                 errprintf("unsupported compression algorithm: %ld\n", (long)blkinfo->blkcompalgo);
+                blkbuf_free(bufcomp);
                 return -1;
         }
-        free(blkinfo->blkdata); // free old buffer (with compressed data)
+        blkbuf_release_block(blkinfo); // free old buffer (with compressed data)
         blkinfo->blkdata=bufcomp; // pointer to new buffer with uncompressed data
     }
     return 0;
 }
 
-int compression_function(int oper)
+// free the codec contexts kept by the current thread
+static void release_contexts(void)
+{
+#ifdef OPTION_LZO_SUPPORT
+    release_context_lzo();
+#endif // OPTION_LZO_SUPPORT
+    release_context_gzip();
+#ifdef OPTION_LZMA_SUPPORT
+    release_context_lzma();
+#endif // OPTION_LZMA_SUPPORT
+}
+
+int compression_function(int oper, int index)
 {
     struct s_blockinfo blkinfo;
+    bool autotune;
     s64 blknum;
+    int node=-1;
     int res;
     
+    // with numa the threads are spread over the nodes and process the blocks allocated on their node
+    if (blkbuf_get_numnodes()>0)
+    {   node=index % blkbuf_get_numnodes();
+        blkbuf_bind_thread(node);
+    }
+    
+    assert(pthread_mutex_lock(&g_poolmutex)==0);
+    autotune=g_poolautotune;
+    assert(pthread_mutex_unlock(&g_poolmutex)==0);
+    
     while (queue_get_end_of_queue(&g_queue)==false)
     {
-        if ((blknum=queue_get_first_block_todo(&g_queue, &blkinfo))>0) // block found
+        // the first thread adjusts how many threads are active, the other ones may be parked
+        if (autotune && (index==0))
+            pool_autotune();
+        else if (autotune)
+            pool_wait_unparked(index);
+        
+        if ((blknum=queue_get_first_block_todo(&g_queue, &blkinfo, node))==FSAERR_ENDOFFILE)
+            break; // no more blocks will be added to the queue
+        
+        if (blknum>0) // block found
         {
             switch (oper)
             {
@@ -280,19 +397,26 @@ int compression_function(int oper)
         }
     }
     
+    if (autotune && (index==0))
+        pool_unpark_all();
+    release_contexts();
     msgprintf(MSG_DEBUG1, "THREAD-COMP: exit success\n");
     return 0;
     
 thread_comp_fct_error:
+    if (autotune && (index==0))
+        pool_unpark_all();
+    release_contexts();
     get_stopfillqueue();
     msgprintf(MSG_DEBUG1, "THREAD-COMP: exit error\n");
     return 0;
 }
 
+// args is the index of the thread (from 0 to compressjobs-1)
 void *thread_comp_fct(void *args)
 {
     inc_secthreads();
-    compression_function(COMPTHR_COMPRESS);
+    compression_function(COMPTHR_COMPRESS, (int)(long)args);
     dec_secthreads();
     return NULL;
 }
@@ -300,7 +424,7 @@ void *thread_comp_fct(void *args)
 void *thread_decomp_fct(void *args)
 {
     inc_secthreads();
-    compression_function(COMPTHR_DECOMPRESS);
+    compression_function(COMPTHR_DECOMPRESS, (int)(long)args);
     dec_secthreads();
     return NULL;
 }
@@ -20,6 +20,7 @@
 
 enum {COMPTHR_COMPRESS=1, COMPTHR_DECOMPRESS=2};
 
+void thread_comp_init_pool(int count, bool autotune);
 void *thread_comp_fct(void *args);
 void *thread_decomp_fct(void *args);
 
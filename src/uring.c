@@ -0,0 +1,257 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "fsarchiver.h"
+#include "uring.h"
+#include "error.h"
+
+#ifdef OPTION_URING_SUPPORT
+
+#include <linux/io_uring.h>
+
+struct s_uring
+{   int      fd; // file descriptor returned by io_uring_setup
+    u32      entries; // how many entries there are in the submission ring
+    u32      *sqhead; // submission ring (shared with the kernel)
+    u32      *sqtail;
+    u32      *sqmask;
+    u32      *sqarray;
+    u32      sqlocal; // tail of the prepared entries, published in sqtail when they are submitted
+    struct io_uring_sqe *sqes;
+    u32      *cqhead; // completion ring (shared with the kernel)
+    u32      *cqtail;
+    u32      *cqmask;
+    struct io_uring_cqe *cqes;
+    void     *sqring; // memory mapped from the kernel
+    size_t   sqringsize;
+    void     *cqring;
+    size_t   cqringsize;
+    size_t   sqessize;
+    u32      tosubmit; // requests prepared and not submitted yet
+    u32      inflight; // requests submitted and not completed yet
+};
+
+static int uring_enter(int fd, u32 tosubmit, u32 mincomplete, u32 flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags, NULL, 0);
+}
+
+// returns NULL when io_uring is not supported (old kernel, disabled by the administrator, ...)
+curing *uring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    curing *r;
+    char *sq;
+    char *cq;
+    
+    if ((r=calloc(1, sizeof(curing)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(curing));
+        return NULL;
+    }
+    
+    memset(&p, 0, sizeof(p));
+    if ((r->fd=(int)syscall(__NR_io_uring_setup, entries, &p))<0)
+    {   msgprintf(MSG_VERB2, "io_uring_setup(%u) failed: errno=%d\n", entries, errno);
+        free(r);
+        return NULL;
+    }
+    
+    r->entries=p.sq_entries;
+    r->sqringsize=p.sq_off.array+p.sq_entries*sizeof(u32);
+    r->cqringsize=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sqringsize=r->cqringsize=max(r->sqringsize, r->cqringsize);
+    r->sqessize=p.sq_entries*sizeof(struct io_uring_sqe);
+    
+    r->sqring=mmap(NULL, r->sqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqring==MAP_FAILED)
+        goto uring_create_error;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cqring=r->sqring;
+    else if ((r->cqring=mmap(NULL, r->cqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING))==MAP_FAILED)
+    {   r->cqring=NULL;
+        goto uring_create_error;
+    }
+    r->sqes=mmap(NULL, r->sqessize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes==MAP_FAILED)
+    {   r->sqes=NULL;
+        goto uring_create_error;
+    }
+    
+    sq=(char*)r->sqring;
+    r->sqhead=(u32*)(sq+p.sq_off.head);
+    r->sqtail=(u32*)(sq+p.sq_off.tail);
+    r->sqmask=(u32*)(sq+p.sq_off.ring_mask);
+    r->sqarray=(u32*)(sq+p.sq_off.array);
+    r->sqlocal=*r->sqtail;
+    cq=(char*)r->cqring;
+    r->cqhead=(u32*)(cq+p.cq_off.head);
+    r->cqtail=(u32*)(cq+p.cq_off.tail);
+    r->cqmask=(u32*)(cq+p.cq_off.ring_mask);
+    r->cqes=(struct io_uring_cqe*)(cq+p.cq_off.cqes);
+    return r;
+    
+uring_create_error:
+    sysprintf("cannot map the io_uring rings\n");
+    if (r->sqring!=MAP_FAILED)
+        munmap(r->sqring, r->sqringsize);
+    if ((r->cqring!=NULL) && (r->cqring!=r->sqring))
+        munmap(r->cqring, r->cqringsize);
+    close(r->fd);
+    free(r);
+    return NULL;
+}
+
+// the requests which are still in progress must have been waited for
+void uring_destroy(curing *r)
+{
+    if (r==NULL)
+        return;
+    munmap(r->sqes, r->sqessize);
+    if (r->cqring!=r->sqring)
+        munmap(r->cqring, r->cqringsize);
+    munmap(r->sqring, r->sqringsize);
+    close(r->fd);
+    free(r);
+}
+
+// buffers used with uring_prep_xxx_fixed() are mapped once in the kernel instead of for each request
+int uring_register_buffers(curing *r, struct iovec *iov, int count)
+{
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, count)<0)
+    {   msgprintf(MSG_VERB2, "io_uring_register(IORING_REGISTER_BUFFERS) failed: errno=%d\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(curing *r)
+{
+    struct io_uring_sqe *sqe;
+    u32 tail=r->sqlocal;
+    u32 index;
+    
+    if (tail - __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE) >= r->entries)
+    {   errprintf("the io_uring submission ring is full\n");
+        return NULL;
+    }
+    
+    index=tail & *r->sqmask;
+    sqe=&r->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sqarray[index]=index;
+    r->sqlocal=tail+1; // the kernel does not see the entry before it has been filled
+    r->tosubmit++;
+    return sqe;
+}
+
+static int uring_prep_rw(curing *r, int op, int fd, void *addr, u32 len, u64 offset, int bufindex, u64 userdata)
+{
+    struct io_uring_sqe *sqe;
+    
+    if ((sqe=uring_get_sqe(r))==NULL)
+        return -1;
+    sqe->opcode=op;
+    sqe->fd=fd;
+    sqe->addr=(unsigned long)addr;
+    sqe->len=len;
+    sqe->off=offset;
+    sqe->buf_index=(bufindex>=0)?bufindex:0;
+    sqe->user_data=userdata;
+    return 0;
+}
+
+int uring_prep_writev(curing *r, int fd, struct iovec *iov, int count, u64 offset, u64 userdata)
+{
+    return uring_prep_rw(r, IORING_OP_WRITEV, fd, iov, count, offset, -1, userdata);
+}
+
+int uring_prep_write_fixed(curing *r, int fd, void *buf, u32 len, u64 offset, int bufindex, u64 userdata)
+{
+    return uring_prep_rw(r, IORING_OP_WRITE_FIXED, fd, buf, len, offset, bufindex, userdata);
+}
+
+int uring_prep_read_fixed(curing *r, int fd, void *buf, u32 len, u64 offset, int bufindex, u64 userdata)
+{
+    return uring_prep_rw(r, IORING_OP_READ_FIXED, fd, buf, len, offset, bufindex, userdata);
+}
+
+// send the requests which have been prepared to the kernel
+int uring_submit(curing *r)
+{
+    int res;
+    
+    // the entries are complete: the release makes them visible to the kernel with the new tail
+    __atomic_store_n(r->sqtail, r->sqlocal, __ATOMIC_RELEASE);
+    while (r->tosubmit>0)
+    {
+        if ((res=uring_enter(r->fd, r->tosubmit, 0, 0))<0)
+        {   if (errno==EINTR)
+                continue;
+            sysprintf("io_uring_enter() failed to submit %u requests\n", r->tosubmit);
+            return -1;
+        }
+        r->tosubmit-=res;
+        r->inflight+=res;
+    }
+    return 0;
+}
+
+// wait until a request is completed, res is what the equivalent system call would have returned (or -errno)
+int uring_wait(curing *r, u64 *userdata, s32 *res)
+{
+    struct io_uring_cqe *cqe;
+    u32 head;
+    
+    if (r->inflight==0)
+    {   errprintf("there is no io_uring request in progress\n");
+        return -1;
+    }
+    
+    for (head=*r->cqhead; head==__atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE); head=*r->cqhead)
+    {
+        if ((uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS)<0) && (errno!=EINTR))
+        {   sysprintf("io_uring_enter() failed to wait for a request\n");
+            return -1;
+        }
+    }
+    
+    cqe=&r->cqes[head & *r->cqmask];
+    *userdata=cqe->user_data;
+    *res=cqe->res;
+    __atomic_store_n(r->cqhead, head+1, __ATOMIC_RELEASE);
+    r->inflight--;
+    return 0;
+}
+
+u32 uring_get_inflight(curing *r)
+{
+    return r->inflight+r->tosubmit;
+}
+
+#endif // OPTION_URING_SUPPORT
@@ -0,0 +1,41 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/uio.h>
+
+// minimal io_uring interface (system calls used directly, liburing is not required)
+struct s_uring;
+typedef struct s_uring curing;
+
+#ifdef OPTION_URING_SUPPORT
+
+curing *uring_create(unsigned entries);
+void    uring_destroy(curing *r);
+int     uring_register_buffers(curing *r, struct iovec *iov, int count);
+int     uring_prep_writev(curing *r, int fd, struct iovec *iov, int count, u64 offset, u64 userdata);
+int     uring_prep_write_fixed(curing *r, int fd, void *buf, u32 len, u64 offset, int bufindex, u64 userdata);
+int     uring_prep_read_fixed(curing *r, int fd, void *buf, u32 len, u64 offset, int bufindex, u64 userdata);
+int     uring_submit(curing *r);
+int     uring_wait(curing *r, u64 *userdata, s32 *res);
+u32     uring_get_inflight(curing *r);
+
+#endif // OPTION_URING_SUPPORT
+
+#endif // __URING_H__
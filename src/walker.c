@@ -0,0 +1,251 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "fsarchiver.h"
+#include "walker.h"
+#include "error.h"
+
+static void walker_unlink(cwalkjob **list, cwalkjob *job)
+{
+    if (job->prev!=NULL)
+        job->prev->next=job->next;
+    else
+        *list=job->next;
+    if (job->next!=NULL)
+        job->next->prev=job->prev;
+    job->prev=NULL;
+    job->next=NULL;
+}
+
+static void walker_push(cwalkjob **list, cwalkjob *job)
+{
+    job->prev=NULL;
+    job->next=*list;
+    if (*list!=NULL)
+        (*list)->prev=job;
+    *list=job;
+}
+
+// walker thread: it runs the last job which has been added as long as the main thread takes the results
+static void *walker_thread_fct(void *args)
+{
+    cwalker *w=(cwalker *)args;
+    cwalkjob *job;
+    
+    pthread_mutex_lock(&w->mutex);
+    for (;;)
+    {
+        while ((w->stop==false) && ((w->pending==NULL) || (w->donecount >= w->maxdone)))
+            pthread_cond_wait(&w->condjob, &w->mutex);
+        if (w->stop==true)
+            break;
+        job=w->pending;
+        walker_unlink(&w->pending, job);
+        w->pendingcount--;
+        job->status=WALKJOB_RUNNING;
+        pthread_mutex_unlock(&w->mutex);
+        
+        w->fct(w->ctx, job->data);
+        
+        pthread_mutex_lock(&w->mutex);
+        if (job->status==WALKJOB_CANCELLED) // nobody will take the result
+        {   pthread_mutex_unlock(&w->mutex);
+            w->freefct(w->ctx, job->data);
+            free(job);
+            pthread_mutex_lock(&w->mutex);
+            continue;
+        }
+        job->status=WALKJOB_DONE;
+        walker_push(&w->done, job);
+        w->donecount++;
+        pthread_cond_broadcast(&w->conddone);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    
+    return NULL;
+}
+
+int walker_init(cwalker *w, int threadcount, walkfct fct, walkfreefct freefct, void *ctx)
+{
+    int i;
+    
+    assert(w);
+    memset(w, 0, sizeof(cwalker));
+    
+    if ((w->threads=calloc(threadcount, sizeof(pthread_t)))==NULL)
+    {   errprintf("calloc() failed: out of memory\n");
+        return -1;
+    }
+    w->maxdone=threadcount*FSA_WALKER_DIRSPERJOB;
+    w->maxpending=threadcount*FSA_WALKER_MAXPENDING;
+    w->fct=fct;
+    w->freefct=freefct;
+    w->ctx=ctx;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->condjob, NULL);
+    pthread_cond_init(&w->conddone, NULL);
+    
+    for (i=0; i < threadcount; i++)
+    {
+        if (pthread_create(&w->threads[i], NULL, walker_thread_fct, (void*)w)!=0)
+        {   errprintf("pthread_create() failed: cannot start the walker threads\n");
+            walker_destroy(w);
+            return -1;
+        }
+        w->threadcount++;
+    }
+    
+    msgprintf(MSG_VERB2, "directories are read by %d walker threads\n", threadcount);
+    return 0;
+}
+
+// stop the threads and release the jobs which have not been taken
+int walker_destroy(cwalker *w)
+{
+    cwalkjob *job;
+    int i;
+    
+    assert(w);
+    
+    if (w->threads==NULL)
+        return 0;
+    
+    pthread_mutex_lock(&w->mutex);
+    w->stop=true;
+    pthread_cond_broadcast(&w->condjob);
+    pthread_mutex_unlock(&w->mutex);
+    for (i=0; i < w->threadcount; i++)
+        pthread_join(w->threads[i], NULL);
+    
+    while ((job=w->pending)!=NULL || (job=w->done)!=NULL)
+    {
+        walker_unlink((job->status==WALKJOB_PENDING)?&w->pending:&w->done, job);
+        w->freefct(w->ctx, job->data);
+        free(job);
+    }
+    pthread_cond_destroy(&w->conddone);
+    pthread_cond_destroy(&w->condjob);
+    pthread_mutex_destroy(&w->mutex);
+    free(w->threads);
+    memset(w, 0, sizeof(cwalker));
+    return 0;
+}
+
+// how many jobs can be added before the list of the jobs which have not been started is full
+int walker_get_room(cwalker *w)
+{
+    int room;
+    
+    assert(w);
+    
+    pthread_mutex_lock(&w->mutex);
+    room=max(0, w->maxpending-w->pendingcount);
+    pthread_mutex_unlock(&w->mutex);
+    return room;
+}
+
+// the job is run by a walker thread, it can be called from the function of the pool to add sub-directories,
+// returns NULL when too many jobs have not been started yet (the caller has to run it itself)
+cwalkjob *walker_add(cwalker *w, void *data)
+{
+    cwalkjob *job;
+    
+    assert(w);
+    
+    if ((job=calloc(1, sizeof(cwalkjob)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(cwalkjob));
+        return NULL;
+    }
+    job->data=data;
+    job->status=WALKJOB_PENDING;
+    
+    pthread_mutex_lock(&w->mutex);
+    if (w->pendingcount >= w->maxpending)
+    {   pthread_mutex_unlock(&w->mutex);
+        free(job);
+        return NULL;
+    }
+    walker_push(&w->pending, job);
+    w->pendingcount++;
+    pthread_cond_signal(&w->condjob);
+    pthread_mutex_unlock(&w->mutex);
+    return job;
+}
+
+// wait until the job is done and return its data, the job is run by the caller if no thread has started it
+void *walker_take(cwalker *w, cwalkjob *job)
+{
+    void *data;
+    
+    assert(w);
+    assert(job);
+    
+    pthread_mutex_lock(&w->mutex);
+    if (job->status==WALKJOB_PENDING)
+    {   walker_unlink(&w->pending, job);
+        w->pendingcount--;
+        pthread_mutex_unlock(&w->mutex);
+        w->fct(w->ctx, job->data);
+    }
+    else
+    {   while (job->status!=WALKJOB_DONE)
+            pthread_cond_wait(&w->conddone, &w->mutex);
+        walker_unlink(&w->done, job);
+        w->donecount--;
+        pthread_cond_broadcast(&w->condjob);
+        pthread_mutex_unlock(&w->mutex);
+    }
+    
+    data=job->data;
+    free(job);
+    return data;
+}
+
+// the result of the job will not be taken: it's released now, or by the thread which runs it
+void walker_cancel(cwalker *w, cwalkjob *job)
+{
+    assert(w);
+    assert(job);
+    
+    pthread_mutex_lock(&w->mutex);
+    if (job->status==WALKJOB_RUNNING)
+    {   job->status=WALKJOB_CANCELLED;
+        pthread_mutex_unlock(&w->mutex);
+        return;
+    }
+    if (job->status==WALKJOB_PENDING)
+    {   walker_unlink(&w->pending, job);
+        w->pendingcount--;
+    }
+    else
+    {   walker_unlink(&w->done, job);
+        w->donecount--;
+        pthread_cond_broadcast(&w->condjob);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    
+    w->freefct(w->ctx, job->data);
+    free(job);
+}
@@ -0,0 +1,67 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2016 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+#ifndef __WALKER_H__
+#define __WALKER_H__
+
+#include <pthread.h>
+
+enum {WALKJOB_PENDING=0, WALKJOB_RUNNING, WALKJOB_DONE, WALKJOB_CANCELLED};
+
+struct s_walkjob;
+typedef struct s_walkjob cwalkjob;
+
+// directory which has to be read by a walker thread
+struct s_walkjob
+{   void   *data; // argument given to the function of the pool, it also contains the result
+    int    status; // WALKJOB_xxx
+    cwalkjob *prev; // neighbours in the list of pending jobs or in the list of jobs which are done
+    cwalkjob *next;
+};
+
+typedef void (*walkfct)(void *ctx, void *data);
+typedef void (*walkfreefct)(void *ctx, void *data);
+
+struct s_walker;
+typedef struct s_walker cwalker;
+
+// threads which read directories in advance, the results are taken in any order by the main thread
+struct s_walker
+{   pthread_t *threads; // walker threads
+    int    threadcount; // how many items there are in threads
+    pthread_mutex_t mutex; // protects all the other fields
+    pthread_cond_t condjob; // signaled when a job is added, when a result is taken or when the threads have to stop
+    pthread_cond_t conddone; // signaled when a job is done
+    cwalkjob *pending; // jobs which have not been started, the last one which has been added comes first
+    int    pendingcount; // how many items there are in pending
+    int    maxpending; // no job is added when that many jobs have not been started
+    cwalkjob *done; // jobs which are done and which have not been taken yet
+    int    donecount; // how many items there are in done
+    int    maxdone; // the threads wait when that many results have not been taken
+    walkfct fct; // function which reads a directory
+    walkfreefct freefct; // function which releases the data of a job which has not been taken
+    void   *ctx; // first argument of fct and freefct
+    bool   stop; // true when the threads have to exit
+};
+
+int  walker_init(cwalker *w, int threadcount, walkfct fct, walkfreefct freefct, void *ctx);
+int  walker_destroy(cwalker *w);
+int  walker_get_room(cwalker *w);
+cwalkjob *walker_add(cwalker *w, void *data);
+void *walker_take(cwalker *w, cwalkjob *job);
+void walker_cancel(cwalker *w, cwalkjob *job);
+
+#endif // __WALKER_H__
@@ -227,7 +227,8 @@ int writebuf_add_header(cwritebuf *wb, cdico *d, char *magic, u32 archid, u16 fs
     return 0;
 }
 
-int writebuf_add_block(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u16 fsid)
+// serialize the header of a data block (the data are written separately)
+int writebuf_add_block_header(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u16 fsid)
 {
     cdico *blkdico; // header written in file
     int res;
@@ -244,6 +245,7 @@ int writebuf_add_block(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u
     
     if (blkinfo->blkarsize==0)
     {   errprintf("blkinfo->blkarsize=0: block is empty\n");
+        dico_destroy(blkdico);
         return -1;
     }
 
@@ -264,11 +266,5 @@ int writebuf_add_block(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u
         return -1;
     }
     
-    // write block data
-    if (writebuf_add_data(wb, blkinfo->blkdata, blkinfo->blkarsize)!=0)
-    {   msgprintf(MSG_STACK, "cannot write data block: writebuf_add_data() failed\n");
-        return -1;
-    }
-    
     return 0;
 }
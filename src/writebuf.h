@@ -34,6 +34,6 @@ int writebuf_destroy(cwritebuf *wb);
 int writebuf_add_data(cwritebuf *wb, void *data, u64 size);
 int writebuf_add_dico(cwritebuf *wb, struct s_dico *d, char *magic);
 int writebuf_add_header(cwritebuf *wb, struct s_dico *d, char *magic, u32 archid, u16 fsid);
-int writebuf_add_block(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u16 fsid);
+int writebuf_add_block_header(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u16 fsid);
 
 #endif // __WRITEBUF_H__